@@ -1,5 +1,6 @@
 #include "gupnp-enum-types.h"
 #include "gupnp-simple-igd.h"
+#include "gupnp-igd-mapping.h"
 
 /* enumerations from "gupnp-simple-igd.h" */
 GType
@@ -9,9 +10,44 @@ gupnp_simple_igd_error_get_type (void)
   if (etype == 0) {
     static const GEnumValue values[] = {
       { GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS, "GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS", "address" },
+      { GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED, "GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED", "mapping-failed" },
+      { GUPNP_SIMPLE_IGD_ERROR_NO_FREE_PORT, "GUPNP_SIMPLE_IGD_ERROR_NO_FREE_PORT", "no-free-port" },
       { 0, NULL, NULL }
     };
     etype = g_enum_register_static ("GUPnPSimpleIgdError", values);
   }
   return etype;
 }
+
+GType
+gupnp_simple_igd_routing_policy_get_type (void)
+{
+  static GType etype = 0;
+  if (etype == 0) {
+    static const GEnumValue values[] = {
+      { GUPNP_SIMPLE_IGD_ROUTING_POLICY_ALL, "GUPNP_SIMPLE_IGD_ROUTING_POLICY_ALL", "all" },
+      { GUPNP_SIMPLE_IGD_ROUTING_POLICY_FIRST, "GUPNP_SIMPLE_IGD_ROUTING_POLICY_FIRST", "first" },
+      { GUPNP_SIMPLE_IGD_ROUTING_POLICY_DEFAULT_ROUTE, "GUPNP_SIMPLE_IGD_ROUTING_POLICY_DEFAULT_ROUTE", "default-route" },
+      { 0, NULL, NULL }
+    };
+    etype = g_enum_register_static ("GUPnPSimpleIgdRoutingPolicy", values);
+  }
+  return etype;
+}
+
+GType
+gupnp_igd_mapping_state_get_type (void)
+{
+  static GType etype = 0;
+  if (etype == 0) {
+    static const GEnumValue values[] = {
+      { GUPNP_IGD_MAPPING_STATE_PENDING, "GUPNP_IGD_MAPPING_STATE_PENDING", "pending" },
+      { GUPNP_IGD_MAPPING_STATE_MAPPED, "GUPNP_IGD_MAPPING_STATE_MAPPED", "mapped" },
+      { GUPNP_IGD_MAPPING_STATE_FAILED, "GUPNP_IGD_MAPPING_STATE_FAILED", "failed" },
+      { GUPNP_IGD_MAPPING_STATE_REMOVED, "GUPNP_IGD_MAPPING_STATE_REMOVED", "removed" },
+      { 0, NULL, NULL }
+    };
+    etype = g_enum_register_static ("GUPnPIgdMappingState", values);
+  }
+  return etype;
+}
@@ -8,6 +8,10 @@ G_BEGIN_DECLS
 /* enumerations from "gupnp-simple-igd.h" */
 GType gupnp_simple_igd_error_get_type (void);
 #define GUPNP_TYPE_SIMPLE_IGD_ERROR (gupnp_simple_igd_error_get_type())
+GType gupnp_simple_igd_routing_policy_get_type (void);
+#define GUPNP_TYPE_SIMPLE_IGD_ROUTING_POLICY (gupnp_simple_igd_routing_policy_get_type())
+GType gupnp_igd_mapping_state_get_type (void);
+#define GUPNP_TYPE_IGD_MAPPING_STATE (gupnp_igd_mapping_state_get_type())
 G_END_DECLS
 
 #endif /* __GUPNP_ENUM_TYPES_H__ */
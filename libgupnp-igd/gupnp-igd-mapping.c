@@ -0,0 +1,566 @@
+/*
+ * GUPnP Simple IGD abstraction
+ *
+ * Copyright 2008 Collabora Ltd.
+ *  @author: Olivier Crete <olivier.crete@collabora.co.uk>
+ * Copyright 2008 Nokia Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+/**
+ * SECTION:gupnp-igd-mapping
+ * @short_description: A port mapping made by a GUPnPSimpleIgd
+ *
+ * A #GUPnPIgdMapping is returned by gupnp_simple_igd_add_mapping() and
+ * represents that one mapping. Its signals are only emitted for that
+ * mapping, so there is no need to compare the arguments of the
+ * #GUPnPSimpleIgd signals to find out which mapping they are about.
+ *
+ * The mapping is removed from the routers when the last reference to the
+ * #GUPnPIgdMapping is dropped.
+ *
+ * The signals are emitted in the thread of the #GUPnPSimpleIgd that
+ * created the mapping, which for a #GUPnPSimpleIgdThread is its internal
+ * thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "gupnp-igd-mapping.h"
+#include "gupnp-simple-igd-priv.h"
+#include "gupnp-simple-igd-marshal.h"
+#include "gupnp-enum-types.h"
+
+
+/**
+ * GUPnPIgdMappingClass:
+ *
+ * The class of #GUPnPIgdMapping
+ */
+
+struct _GUPnPIgdMappingClass
+{
+  GObjectClass parent_class;
+
+  /*< private >*/
+};
+
+struct _GUPnPIgdMappingPrivate
+{
+  GWeakRef igd;
+  guint id;
+
+  gchar *protocol;
+  guint16 requested_external_port;
+  gchar *local_ip;
+  guint16 local_port;
+  guint32 lease_duration;
+  gchar *description;
+
+  /* Updated from the thread of the GUPnPSimpleIgd */
+  GMutex mutex;
+  GUPnPIgdMappingState state;
+  gchar *external_ip;
+  guint external_port;
+};
+
+#define GUPNP_IGD_MAPPING_LOCK(o)   g_mutex_lock (&(o)->priv->mutex)
+#define GUPNP_IGD_MAPPING_UNLOCK(o) g_mutex_unlock (&(o)->priv->mutex)
+
+/* signals */
+enum
+{
+  SIGNAL_MAPPED,
+  SIGNAL_ERROR,
+  SIGNAL_EXTERNAL_IP_CHANGED,
+  LAST_SIGNAL
+};
+
+/* props */
+enum
+{
+  PROP_0,
+  PROP_PROTOCOL,
+  PROP_REQUESTED_EXTERNAL_PORT,
+  PROP_LOCAL_IP,
+  PROP_LOCAL_PORT,
+  PROP_LEASE_DURATION,
+  PROP_DESCRIPTION,
+  PROP_STATE,
+  PROP_EXTERNAL_IP,
+  PROP_EXTERNAL_PORT
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+
+G_DEFINE_TYPE_WITH_CODE (GUPnPIgdMapping, gupnp_igd_mapping, G_TYPE_OBJECT,
+    G_ADD_PRIVATE (GUPnPIgdMapping));
+
+static void gupnp_igd_mapping_finalize (GObject *object);
+static void gupnp_igd_mapping_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec);
+
+
+static void
+gupnp_igd_mapping_class_init (GUPnPIgdMappingClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = gupnp_igd_mapping_finalize;
+  gobject_class->get_property = gupnp_igd_mapping_get_property;
+
+  g_object_class_install_property (gobject_class,
+      PROP_PROTOCOL,
+      g_param_spec_string ("protocol",
+          "Protocol",
+          "The protocol \"UDP\" or \"TCP\"",
+          NULL,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+      PROP_REQUESTED_EXTERNAL_PORT,
+      g_param_spec_uint ("requested-external-port",
+          "Requested external port",
+          "The external port that was asked for, 0 for any port",
+          0, G_MAXUINT16, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+      PROP_LOCAL_IP,
+      g_param_spec_string ("local-ip",
+          "Local IP",
+          "The IP address packets are forwarded to",
+          NULL,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+      PROP_LOCAL_PORT,
+      g_param_spec_uint ("local-port",
+          "Local port",
+          "The local port packets are forwarded to",
+          0, G_MAXUINT16, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+      PROP_LEASE_DURATION,
+      g_param_spec_uint ("lease-duration",
+          "Lease duration",
+          "The duration of the lease in seconds",
+          0, G_MAXUINT32, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+      PROP_DESCRIPTION,
+      g_param_spec_string ("description",
+          "Description",
+          "The description that appears in the router's table",
+          NULL,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPIgdMapping:state:
+   *
+   * The state of the mapping, it is notified from the thread of the
+   * #GUPnPSimpleIgd.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_STATE,
+      g_param_spec_enum ("state",
+          "State",
+          "The state of the mapping",
+          GUPNP_TYPE_IGD_MAPPING_STATE, GUPNP_IGD_MAPPING_STATE_PENDING,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+      PROP_EXTERNAL_IP,
+      g_param_spec_string ("external-ip",
+          "External IP",
+          "The external address of the last router the port was mapped on",
+          NULL,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+      PROP_EXTERNAL_PORT,
+      g_param_spec_uint ("external-port",
+          "External port",
+          "The port mapped on the last router the port was mapped on",
+          0, G_MAXUINT16, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPIgdMapping::mapped:
+   * @self: #GUPnPIgdMapping that emitted the signal
+   * @external_ip: the external address of the router
+   * @external_port: the port that was mapped on the router
+   *
+   * This signal is emitted every time the port is mapped on a router.
+   */
+  signals[SIGNAL_MAPPED] = g_signal_new ("mapped",
+      G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST,
+      0,
+      NULL,
+      NULL,
+      _gupnp_simple_igd_marshal_VOID__STRING_UINT,
+      G_TYPE_NONE, 2, G_TYPE_STRING, G_TYPE_UINT);
+
+  /**
+   * GUPnPIgdMapping::error:
+   * @self: #GUPnPIgdMapping that emitted the signal
+   * @error: a #GError
+   *
+   * This signal is emitted every time mapping or renewing the port fails
+   * on a router.
+   */
+  signals[SIGNAL_ERROR] = g_signal_new ("error",
+      G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST,
+      0,
+      NULL,
+      NULL,
+      g_cclosure_marshal_VOID__BOXED,
+      G_TYPE_NONE, 1, G_TYPE_ERROR);
+
+  /**
+   * GUPnPIgdMapping::external-ip-changed:
+   * @self: #GUPnPIgdMapping that emitted the signal
+   * @old_ip: the previous external address of the router
+   * @new_ip: the new external address of the router
+   *
+   * This signal is emitted when the external address of a router this
+   * port is mapped on changes.
+   */
+  signals[SIGNAL_EXTERNAL_IP_CHANGED] = g_signal_new ("external-ip-changed",
+      G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST,
+      0,
+      NULL,
+      NULL,
+      _gupnp_simple_igd_marshal_VOID__STRING_STRING,
+      G_TYPE_NONE, 2, G_TYPE_STRING, G_TYPE_STRING);
+}
+
+static void
+gupnp_igd_mapping_init (GUPnPIgdMapping *self)
+{
+  self->priv = gupnp_igd_mapping_get_instance_private (self);
+
+  g_weak_ref_init (&self->priv->igd, NULL);
+  g_mutex_init (&self->priv->mutex);
+}
+
+static void
+gupnp_igd_mapping_finalize (GObject *object)
+{
+  GUPnPIgdMapping *self = GUPNP_IGD_MAPPING_CAST (object);
+  GUPnPSimpleIgd *igd = g_weak_ref_get (&self->priv->igd);
+
+  if (igd)
+  {
+    if (gupnp_igd_mapping_get_state (self) != GUPNP_IGD_MAPPING_STATE_REMOVED)
+      _gupnp_simple_igd_remove_mapping_id (igd, self->priv->id);
+    g_object_unref (igd);
+  }
+
+  g_weak_ref_clear (&self->priv->igd);
+  g_mutex_clear (&self->priv->mutex);
+
+  g_free (self->priv->protocol);
+  g_free (self->priv->local_ip);
+  g_free (self->priv->description);
+  g_free (self->priv->external_ip);
+
+  G_OBJECT_CLASS (gupnp_igd_mapping_parent_class)->finalize (object);
+}
+
+static void
+gupnp_igd_mapping_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  GUPnPIgdMapping *self = GUPNP_IGD_MAPPING_CAST (object);
+
+  switch (prop_id) {
+    case PROP_PROTOCOL:
+      g_value_set_string (value, self->priv->protocol);
+      break;
+    case PROP_REQUESTED_EXTERNAL_PORT:
+      g_value_set_uint (value, self->priv->requested_external_port);
+      break;
+    case PROP_LOCAL_IP:
+      g_value_set_string (value, self->priv->local_ip);
+      break;
+    case PROP_LOCAL_PORT:
+      g_value_set_uint (value, self->priv->local_port);
+      break;
+    case PROP_LEASE_DURATION:
+      g_value_set_uint (value, self->priv->lease_duration);
+      break;
+    case PROP_DESCRIPTION:
+      g_value_set_string (value, self->priv->description);
+      break;
+    case PROP_STATE:
+      g_value_set_enum (value, gupnp_igd_mapping_get_state (self));
+      break;
+    case PROP_EXTERNAL_IP:
+      g_value_take_string (value, gupnp_igd_mapping_dup_external_ip (self));
+      break;
+    case PROP_EXTERNAL_PORT:
+      g_value_set_uint (value, gupnp_igd_mapping_get_external_port (self));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+GUPnPIgdMapping *
+_gupnp_igd_mapping_new (GUPnPSimpleIgd *igd,
+    guint id,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description)
+{
+  GUPnPIgdMapping *self = g_object_new (GUPNP_TYPE_IGD_MAPPING, NULL);
+
+  g_weak_ref_set (&self->priv->igd, igd);
+  self->priv->id = id;
+  self->priv->protocol = g_strdup (protocol);
+  self->priv->requested_external_port = external_port;
+  self->priv->local_ip = g_strdup (local_ip);
+  self->priv->local_port = local_port;
+  self->priv->lease_duration = lease_duration;
+  self->priv->description = g_strdup (description);
+
+  return self;
+}
+
+guint
+_gupnp_igd_mapping_get_id (GUPnPIgdMapping *self)
+{
+  return self->priv->id;
+}
+
+void
+_gupnp_igd_mapping_get_spec (GUPnPIgdMapping *self,
+    GUPnPSimpleIgdPortSpec *spec)
+{
+  spec->protocol = self->priv->protocol;
+  spec->external_port = self->priv->requested_external_port;
+  spec->local_ip = self->priv->local_ip;
+  spec->local_port = self->priv->local_port;
+  spec->lease_duration = self->priv->lease_duration;
+  spec->description = self->priv->description;
+}
+
+/* Returns TRUE if the state changed */
+static gboolean
+set_state_locked (GUPnPIgdMapping *self, GUPnPIgdMappingState state)
+{
+  if (self->priv->state == state ||
+      self->priv->state == GUPNP_IGD_MAPPING_STATE_REMOVED)
+    return FALSE;
+
+  self->priv->state = state;
+
+  return TRUE;
+}
+
+void
+_gupnp_igd_mapping_mapped (GUPnPIgdMapping *self,
+    const gchar *external_ip,
+    guint external_port)
+{
+  gboolean changed;
+
+  GUPNP_IGD_MAPPING_LOCK (self);
+  changed = set_state_locked (self, GUPNP_IGD_MAPPING_STATE_MAPPED);
+  g_free (self->priv->external_ip);
+  self->priv->external_ip = g_strdup (external_ip);
+  self->priv->external_port = external_port;
+  GUPNP_IGD_MAPPING_UNLOCK (self);
+
+  if (changed)
+    g_object_notify (G_OBJECT (self), "state");
+
+  g_signal_emit (self, signals[SIGNAL_MAPPED], 0, external_ip, external_port);
+}
+
+void
+_gupnp_igd_mapping_error (GUPnPIgdMapping *self,
+    const GError *error,
+    gboolean failed)
+{
+  gboolean changed = FALSE;
+
+  if (failed)
+  {
+    GUPNP_IGD_MAPPING_LOCK (self);
+    changed = set_state_locked (self, GUPNP_IGD_MAPPING_STATE_FAILED);
+    GUPNP_IGD_MAPPING_UNLOCK (self);
+  }
+
+  if (changed)
+    g_object_notify (G_OBJECT (self), "state");
+
+  g_signal_emit (self, signals[SIGNAL_ERROR], 0, error);
+}
+
+void
+_gupnp_igd_mapping_external_ip_changed (GUPnPIgdMapping *self,
+    const gchar *old_ip,
+    const gchar *new_ip)
+{
+  GUPNP_IGD_MAPPING_LOCK (self);
+  if (!g_strcmp0 (self->priv->external_ip, old_ip))
+  {
+    g_free (self->priv->external_ip);
+    self->priv->external_ip = g_strdup (new_ip);
+  }
+  GUPNP_IGD_MAPPING_UNLOCK (self);
+
+  g_signal_emit (self, signals[SIGNAL_EXTERNAL_IP_CHANGED], 0, old_ip, new_ip);
+}
+
+void
+_gupnp_igd_mapping_removed (GUPnPIgdMapping *self)
+{
+  gboolean changed;
+
+  GUPNP_IGD_MAPPING_LOCK (self);
+  changed = set_state_locked (self, GUPNP_IGD_MAPPING_STATE_REMOVED);
+  GUPNP_IGD_MAPPING_UNLOCK (self);
+
+  if (changed)
+    g_object_notify (G_OBJECT (self), "state");
+}
+
+/**
+ * gupnp_igd_mapping_get_state:
+ * @self: a #GUPnPIgdMapping
+ *
+ * Returns: the current state of the mapping
+ */
+
+GUPnPIgdMappingState
+gupnp_igd_mapping_get_state (GUPnPIgdMapping *self)
+{
+  GUPnPIgdMappingState state;
+
+  g_return_val_if_fail (GUPNP_IS_IGD_MAPPING (self),
+      GUPNP_IGD_MAPPING_STATE_REMOVED);
+
+  GUPNP_IGD_MAPPING_LOCK (self);
+  state = self->priv->state;
+  GUPNP_IGD_MAPPING_UNLOCK (self);
+
+  return state;
+}
+
+/**
+ * gupnp_igd_mapping_get_protocol:
+ * @self: a #GUPnPIgdMapping
+ *
+ * Returns: the protocol "UDP" or "TCP"
+ */
+
+const gchar *
+gupnp_igd_mapping_get_protocol (GUPnPIgdMapping *self)
+{
+  g_return_val_if_fail (GUPNP_IS_IGD_MAPPING (self), NULL);
+
+  return self->priv->protocol;
+}
+
+/**
+ * gupnp_igd_mapping_get_local_ip:
+ * @self: a #GUPnPIgdMapping
+ *
+ * Returns: the IP address packets are forwarded to
+ */
+
+const gchar *
+gupnp_igd_mapping_get_local_ip (GUPnPIgdMapping *self)
+{
+  g_return_val_if_fail (GUPNP_IS_IGD_MAPPING (self), NULL);
+
+  return self->priv->local_ip;
+}
+
+/**
+ * gupnp_igd_mapping_get_local_port:
+ * @self: a #GUPnPIgdMapping
+ *
+ * Returns: the local port packets are forwarded to
+ */
+
+guint16
+gupnp_igd_mapping_get_local_port (GUPnPIgdMapping *self)
+{
+  g_return_val_if_fail (GUPNP_IS_IGD_MAPPING (self), 0);
+
+  return self->priv->local_port;
+}
+
+/**
+ * gupnp_igd_mapping_dup_external_ip:
+ * @self: a #GUPnPIgdMapping
+ *
+ * Returns: (transfer full) (nullable): the external address of the last
+ * router the port was mapped on, or %NULL if it is not mapped yet
+ */
+
+gchar *
+gupnp_igd_mapping_dup_external_ip (GUPnPIgdMapping *self)
+{
+  gchar *external_ip;
+
+  g_return_val_if_fail (GUPNP_IS_IGD_MAPPING (self), NULL);
+
+  GUPNP_IGD_MAPPING_LOCK (self);
+  external_ip = g_strdup (self->priv->external_ip);
+  GUPNP_IGD_MAPPING_UNLOCK (self);
+
+  return external_ip;
+}
+
+/**
+ * gupnp_igd_mapping_get_external_port:
+ * @self: a #GUPnPIgdMapping
+ *
+ * Returns: the port mapped on the last router the port was mapped on, or 0
+ * if it is not mapped yet
+ */
+
+guint
+gupnp_igd_mapping_get_external_port (GUPnPIgdMapping *self)
+{
+  guint external_port;
+
+  g_return_val_if_fail (GUPNP_IS_IGD_MAPPING (self), 0);
+
+  GUPNP_IGD_MAPPING_LOCK (self);
+  external_port = self->priv->external_port;
+  GUPNP_IGD_MAPPING_UNLOCK (self);
+
+  return external_port;
+}
@@ -0,0 +1,109 @@
+/*
+ * GUPnP Simple IGD abstraction
+ *
+ * Copyright 2008 Collabora Ltd.
+ *  @author: Olivier Crete <olivier.crete@collabora.co.uk>
+ * Copyright 2008 Nokia Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __GUPNP_IGD_MAPPING_H__
+#define __GUPNP_IGD_MAPPING_H__
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/* TYPE MACROS */
+#define GUPNP_TYPE_IGD_MAPPING       \
+  (gupnp_igd_mapping_get_type ())
+#define GUPNP_IGD_MAPPING(obj)                               \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), GUPNP_TYPE_IGD_MAPPING, \
+      GUPnPIgdMapping))
+#define GUPNP_IGD_MAPPING_CLASS(klass)                       \
+  (G_TYPE_CHECK_CLASS_CAST((klass), GUPNP_TYPE_IGD_MAPPING,  \
+      GUPnPIgdMappingClass))
+#define GUPNP_IS_IGD_MAPPING(obj)                            \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), GUPNP_TYPE_IGD_MAPPING))
+#define GUPNP_IS_IGD_MAPPING_CLASS(klass)                    \
+  (G_TYPE_CHECK_CLASS_TYPE((klass), GUPNP_TYPE_IGD_MAPPING))
+#define GUPNP_IGD_MAPPING_GET_CLASS(obj)                     \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), GUPNP_TYPE_IGD_MAPPING, \
+      GUPnPIgdMappingClass))
+#define GUPNP_IGD_MAPPING_CAST(obj)                          \
+  ((GUPnPIgdMapping *) (obj))
+
+typedef struct _GUPnPIgdMapping GUPnPIgdMapping;
+typedef struct _GUPnPIgdMappingClass GUPnPIgdMappingClass;
+typedef struct _GUPnPIgdMappingPrivate GUPnPIgdMappingPrivate;
+
+/**
+ * GUPnPIgdMapping:
+ *
+ * All members are private, access them using methods and properties
+ */
+struct _GUPnPIgdMapping
+{
+  GObject parent;
+
+  /*< private >*/
+  GUPnPIgdMappingPrivate *priv;
+};
+
+/**
+ * GUPnPIgdMappingState:
+ * @GUPNP_IGD_MAPPING_STATE_PENDING: The port has not been mapped on any
+ * router yet
+ * @GUPNP_IGD_MAPPING_STATE_MAPPED: The port is mapped on at least one router
+ * @GUPNP_IGD_MAPPING_STATE_FAILED: Mapping the port failed on every router
+ * it was tried on
+ * @GUPNP_IGD_MAPPING_STATE_REMOVED: The mapping was removed from the
+ * #GUPnPSimpleIgd
+ *
+ * The state of a #GUPnPIgdMapping
+ */
+
+typedef enum {
+  GUPNP_IGD_MAPPING_STATE_PENDING,
+  GUPNP_IGD_MAPPING_STATE_MAPPED,
+  GUPNP_IGD_MAPPING_STATE_FAILED,
+  GUPNP_IGD_MAPPING_STATE_REMOVED
+} GUPnPIgdMappingState;
+
+GType gupnp_igd_mapping_get_type (void);
+
+GUPnPIgdMappingState
+gupnp_igd_mapping_get_state (GUPnPIgdMapping *self);
+
+const gchar *
+gupnp_igd_mapping_get_protocol (GUPnPIgdMapping *self);
+
+const gchar *
+gupnp_igd_mapping_get_local_ip (GUPnPIgdMapping *self);
+
+guint16
+gupnp_igd_mapping_get_local_port (GUPnPIgdMapping *self);
+
+gchar *
+gupnp_igd_mapping_dup_external_ip (GUPnPIgdMapping *self);
+
+guint
+gupnp_igd_mapping_get_external_port (GUPnPIgdMapping *self);
+
+G_END_DECLS
+
+#endif /* __GUPNP_IGD_MAPPING_H__ */
@@ -29,8 +29,18 @@
  * GUPnPSimpleIgdClass:
 
  * @add_port: An implementation of the add_port function
+ * @add_ports: An implementation of the add_ports function
+ * @add_port_async: An implementation of the add_port_async function, it
+ *   takes ownership of the task
  * @remove_port: An implementation of the delete_port function
  * @remove_local_port: An implementation of the remove_local_port function
+ * @add_mapping: An implementation of the add_mapping function
+ * @remove_mapping_id: Removes the mapping of a #GUPnPIgdMapping that was
+ *   finalized
+ * @add_port_range: An implementation of the add_port_range function
+ * @remove_port_range: An implementation of the remove_port_range function
+ * @shutdown_async: An implementation of the shutdown_async function, it
+ *   takes ownership of the task
  *
  * The Raw UDP component transmitter class
  */
@@ -49,6 +59,19 @@ struct _GUPnPSimpleIgdClass
       guint32 lease_duration,
       const gchar *description);
 
+  void (*add_ports) (GUPnPSimpleIgd *self,
+      const GUPnPSimpleIgdPortSpec *specs,
+      guint n_specs);
+
+  void (*add_port_async) (GUPnPSimpleIgd *self,
+      const gchar *protocol,
+      guint16 external_port,
+      const gchar *local_ip,
+      guint16 local_port,
+      guint32 lease_duration,
+      const gchar *description,
+      GTask *task);
+
   void (*remove_port) (GUPnPSimpleIgd *self,
       const gchar *protocol,
       guint external_port);
@@ -58,7 +81,77 @@ struct _GUPnPSimpleIgdClass
       const gchar *local_ip,
       guint16 local_port);
 
+  void (*add_mapping) (GUPnPSimpleIgd *self,
+      GUPnPIgdMapping *mapping);
+
+  void (*remove_mapping_id) (GUPnPSimpleIgd *self,
+      guint id);
+
+  void (*add_port_range) (GUPnPSimpleIgd *self,
+      const gchar *protocol,
+      guint16 external_port,
+      const gchar *local_ip,
+      guint16 local_port,
+      guint n_ports,
+      guint32 lease_duration,
+      const gchar *description);
+
+  void (*remove_port_range) (GUPnPSimpleIgd *self,
+      const gchar *protocol,
+      guint external_port);
+
+  void (*shutdown_async) (GUPnPSimpleIgd *self,
+      guint timeout,
+      GTask *task);
+
   /*< private >*/
 };
 
+void
+_gupnp_simple_igd_remove_mapping_id (GUPnPSimpleIgd *self, guint id);
+
+/* Used by the tests to point the gateway probe to a fake router */
+
+void
+_gupnp_simple_igd_set_gateway (GUPnPSimpleIgd *self,
+    const gchar *address,
+    guint16 port);
+
+/* Used by GUPnPSimpleIgd to drive the GUPnPIgdMapping it returned */
+
+GUPnPIgdMapping *
+_gupnp_igd_mapping_new (GUPnPSimpleIgd *igd,
+    guint id,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description);
+
+guint
+_gupnp_igd_mapping_get_id (GUPnPIgdMapping *self);
+
+void
+_gupnp_igd_mapping_get_spec (GUPnPIgdMapping *self,
+    GUPnPSimpleIgdPortSpec *spec);
+
+void
+_gupnp_igd_mapping_mapped (GUPnPIgdMapping *self,
+    const gchar *external_ip,
+    guint external_port);
+
+void
+_gupnp_igd_mapping_error (GUPnPIgdMapping *self,
+    const GError *error,
+    gboolean failed);
+
+void
+_gupnp_igd_mapping_external_ip_changed (GUPnPIgdMapping *self,
+    const gchar *old_ip,
+    const gchar *new_ip);
+
+void
+_gupnp_igd_mapping_removed (GUPnPIgdMapping *self);
+
 #endif /* __GUPNP_SIMPLE_IGD_PRIV_H__ */
@@ -27,6 +27,11 @@
  *
  * This wraps a #GUPnPSimpleIgd into a thread so that it can be used without
  * having a #GMainLoop running.
+ *
+ * Dropping the last reference waits until the thread has sent the
+ * deletion of every mapping and the routers have answered. Call
+ * gupnp_simple_igd_shutdown_async() first to bound that time without
+ * blocking.
  */
 
 
@@ -37,6 +42,8 @@
 #include "gupnp-simple-igd-thread.h"
 #include "gupnp-simple-igd-priv.h"
 
+#include <string.h>
+
 
 /**
  * GUPnPSimpleIgdThreadClass:
@@ -76,7 +83,8 @@ struct _GUPnPSimpleIgdThreadPrivate
 
   struct thread_data *thread_data;
 
-  GPtrArray *add_remove_port_datas;
+  /* Attached to context, producers push commands onto it without locking */
+  struct CommandSource *command_source;
 };
 
 
@@ -107,6 +115,21 @@ static void gupnp_simple_igd_thread_add_port (GUPnPSimpleIgd *self,
     guint16 local_port,
     guint32 lease_duration,
     const gchar *description);
+static void gupnp_simple_igd_thread_add_port_async (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description,
+    GTask *task);
+static void gupnp_simple_igd_thread_add_mapping (GUPnPSimpleIgd *self,
+    GUPnPIgdMapping *mapping);
+static void gupnp_simple_igd_thread_remove_mapping_id (GUPnPSimpleIgd *self,
+    guint id);
+static void gupnp_simple_igd_thread_add_ports (GUPnPSimpleIgd *self,
+    const GUPnPSimpleIgdPortSpec *specs,
+    guint n_specs);
 static void gupnp_simple_igd_thread_remove_port (GUPnPSimpleIgd *self,
     const gchar *protocol,
     guint external_port);
@@ -114,17 +137,57 @@ static void gupnp_simple_igd_thread_remove_port_local (GUPnPSimpleIgd *self,
     const gchar *protocol,
     const gchar *local_ip,
     guint16 local_port);
+static void gupnp_simple_igd_thread_add_port_range (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint n_ports,
+    guint32 lease_duration,
+    const gchar *description);
+static void gupnp_simple_igd_thread_remove_port_range (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint external_port);
+static void gupnp_simple_igd_thread_shutdown_async (GUPnPSimpleIgd *self,
+    guint timeout,
+    GTask *task);
+
+static GSourceFuncs command_source_funcs;
+
+typedef enum {
+  COMMAND_ADD_PORT,
+  COMMAND_ADD_PORT_ASYNC,
+  COMMAND_REMOVE_PORT,
+  COMMAND_REMOVE_PORT_LOCAL,
+  COMMAND_ADD_MAPPING,
+  COMMAND_REMOVE_MAPPING_ID,
+  COMMAND_ADD_PORT_RANGE,
+  COMMAND_REMOVE_PORT_RANGE,
+  COMMAND_SHUTDOWN
+} CommandType;
+
+/* A request from any thread to the worker thread. The specs and their
+ * strings are allocated in the same block, right after the header.
+ */
+struct Command {
+  struct Command *next;
+  CommandType type;
+  guint n_specs;
+  GUPnPSimpleIgdPortSpec *specs;
+  GTask *task;
+  GUPnPIgdMapping *mapping;
+  guint id; /* or the number of ports of a range, or the shutdown timeout */
+};
 
-
-struct AddRemovePortData {
-  GMutex mutex;
-  GUPnPSimpleIgdThread *self  G_GNUC_MAY_ALIAS; /* protected by mutex */
-  gchar *protocol;
-  guint16 external_port;
-  gchar *local_ip;
-  guint16 local_port;
-  guint32 lease_duration;
-  gchar *description;
+/* The commands are a lock-free stack, pushed by any number of threads and
+ * emptied in one go by the worker thread, which is woken up only when
+ * the stack goes from empty to non-empty.
+ */
+struct CommandSource {
+  GSource source;
+  GWeakRef self;
+  struct Command *commands; /* atomic */
+  gint closed; /* atomic */
 };
 
 
@@ -140,9 +203,18 @@ gupnp_simple_igd_thread_class_init (GUPnPSimpleIgdThreadClass *klass)
   gobject_class->finalize = gupnp_simple_igd_thread_finalize;
 
   simple_igd_class->add_port = gupnp_simple_igd_thread_add_port;
+  simple_igd_class->add_port_async = gupnp_simple_igd_thread_add_port_async;
+  simple_igd_class->add_mapping = gupnp_simple_igd_thread_add_mapping;
+  simple_igd_class->remove_mapping_id =
+      gupnp_simple_igd_thread_remove_mapping_id;
+  simple_igd_class->add_ports = gupnp_simple_igd_thread_add_ports;
   simple_igd_class->remove_port = gupnp_simple_igd_thread_remove_port;
   simple_igd_class->remove_port_local =
       gupnp_simple_igd_thread_remove_port_local;
+  simple_igd_class->add_port_range = gupnp_simple_igd_thread_add_port_range;
+  simple_igd_class->remove_port_range =
+      gupnp_simple_igd_thread_remove_port_range;
+  simple_igd_class->shutdown_async = gupnp_simple_igd_thread_shutdown_async;
 }
 
 
@@ -153,8 +225,6 @@ gupnp_simple_igd_thread_init (GUPnPSimpleIgdThread *self)
 
   self->priv->context = g_main_context_new ();
   g_cond_init (&self->priv->can_dispose_cond);
-
-  self->priv->add_remove_port_datas = g_ptr_array_new ();
 }
 
 static gboolean
@@ -191,15 +261,10 @@ gupnp_simple_igd_thread_dispose (GObject *object)
 {
   GUPnPSimpleIgdThread *self = GUPNP_SIMPLE_IGD_THREAD_CAST (object);
 
+  /* Commands that have not been run yet are dropped */
+  g_atomic_int_set (&self->priv->command_source->closed, TRUE);
+
   GUPNP_SIMPLE_IGD_THREAD_LOCK (self);
-  while (self->priv->add_remove_port_datas->len)
-    {
-      struct AddRemovePortData *data =
-          g_ptr_array_remove_index (self->priv->add_remove_port_datas, 0);
-      g_mutex_lock (&data->mutex);
-      data->self = NULL;
-      g_mutex_unlock (&data->mutex);
-    }
 
   if (g_thread_self () == self->priv->thread)
   {
@@ -276,11 +341,12 @@ gupnp_simple_igd_thread_finalize (GObject *object)
 {
   GUPnPSimpleIgdThread *self = GUPNP_SIMPLE_IGD_THREAD_CAST (object);
 
+  g_source_destroy ((GSource *) self->priv->command_source);
+  g_source_unref ((GSource *) self->priv->command_source);
+
   g_main_context_unref (self->priv->context);
   g_cond_clear (&self->priv->can_dispose_cond);
 
-  g_ptr_array_free (self->priv->add_remove_port_datas, TRUE);
-
   thread_data_dec (self->priv->thread_data);
 
   G_OBJECT_CLASS (gupnp_simple_igd_thread_parent_class)->finalize (object);
@@ -348,115 +414,269 @@ gupnp_simple_igd_thread_constructed (GObject *object)
   g_main_context_ref (self->priv->context);
   data->context = self->priv->context;
 
+  self->priv->command_source = (struct CommandSource *)
+      g_source_new (&command_source_funcs, sizeof (struct CommandSource));
+  g_weak_ref_init (&self->priv->command_source->self, self);
+  g_source_attach ((GSource *) self->priv->command_source,
+      self->priv->context);
+
   self->priv->thread = g_thread_new ("gupnp-igd-thread", thread_func, data);
   g_return_if_fail (self->priv->thread);
 }
 
-static gboolean
-add_port_idle_func (gpointer user_data)
+static struct Command *
+command_source_steal_commands (struct CommandSource *cs)
 {
-  struct AddRemovePortData *data = user_data;
-  GUPnPSimpleIgdClass *klass =
-      GUPNP_SIMPLE_IGD_CLASS (gupnp_simple_igd_thread_parent_class);
-  GUPnPSimpleIgdThread *self;
+  struct Command *commands;
+  struct Command *reversed = NULL;
 
-  g_mutex_lock (&data->mutex);
-  self = data->self;
-  if (self)
-    g_object_ref (self);
-  g_mutex_unlock (&data->mutex);
-  if (!self)
-    return FALSE;
+  do {
+    commands = g_atomic_pointer_get (&cs->commands);
+  } while (!g_atomic_pointer_compare_and_exchange (&cs->commands, commands,
+          NULL));
 
-  if (klass->add_port)
-    klass->add_port (GUPNP_SIMPLE_IGD (self), data->protocol,
-        data->external_port, data->local_ip, data->local_port,
-        data->lease_duration,
-        data->description);
+  /* The stack is LIFO, run the commands in the order they were pushed */
+  while (commands)
+  {
+    struct Command *next = commands->next;
 
-  g_object_unref (self);
+    commands->next = reversed;
+    reversed = commands;
+    commands = next;
+  }
 
-  return FALSE;
+  return reversed;
 }
 
+static void
+command_free (struct Command *command)
+{
+  /* The command was dropped before the task was handed over */
+  if (command->task)
+  {
+    if (command->type == COMMAND_SHUTDOWN)
+      g_task_return_new_error (command->task, G_IO_ERROR,
+          G_IO_ERROR_CANCELLED, "The object was disposed before shutting "
+          "down");
+    else
+      g_task_return_new_error (command->task, G_IO_ERROR,
+          G_IO_ERROR_CANCELLED, "The mapping was removed");
+    g_object_unref (command->task);
+  }
+
+  /* Dropping this reference may queue the removal of the mapping */
+  if (command->mapping)
+    g_object_unref (command->mapping);
 
-static gboolean
-remove_port_idle_func (gpointer user_data)
+  g_free (command);
+}
+
+static void
+run_command (GUPnPSimpleIgd *self, struct Command *command)
 {
-  struct AddRemovePortData *data = user_data;
   GUPnPSimpleIgdClass *klass =
       GUPNP_SIMPLE_IGD_CLASS (gupnp_simple_igd_thread_parent_class);
-  GUPnPSimpleIgdThread *self;
+  GUPnPSimpleIgdPortSpec *spec = command->specs;
+  guint i;
 
-  g_mutex_lock (&data->mutex);
-  self = data->self;
-  if (self)
-    g_object_ref (self);
-  g_mutex_unlock (&data->mutex);
-  if (!self)
-    return FALSE;
+  switch (command->type)
+  {
+    case COMMAND_ADD_PORT:
+      /* The add_ports of the parent class would call our own add_port and
+       * queue every port again */
+      for (i = 0; klass->add_port && i < command->n_specs; i++)
+        klass->add_port (self, spec[i].protocol, spec[i].external_port,
+            spec[i].local_ip, spec[i].local_port, spec[i].lease_duration,
+            spec[i].description);
+      break;
+    case COMMAND_ADD_PORT_ASYNC:
+      if (klass->add_port_async)
+        klass->add_port_async (self, spec->protocol, spec->external_port,
+            spec->local_ip, spec->local_port, spec->lease_duration,
+            spec->description, g_steal_pointer (&command->task));
+      break;
+    case COMMAND_REMOVE_PORT:
+      if (klass->remove_port)
+        klass->remove_port (self, spec->protocol, spec->external_port);
+      break;
+    case COMMAND_REMOVE_PORT_LOCAL:
+      if (klass->remove_port_local)
+        klass->remove_port_local (self, spec->protocol, spec->local_ip,
+            spec->local_port);
+      break;
+    case COMMAND_ADD_MAPPING:
+      if (klass->add_mapping)
+        klass->add_mapping (self, command->mapping);
+      break;
+    case COMMAND_REMOVE_MAPPING_ID:
+      if (klass->remove_mapping_id)
+        klass->remove_mapping_id (self, command->id);
+      break;
+    case COMMAND_ADD_PORT_RANGE:
+      if (klass->add_port_range)
+        klass->add_port_range (self, spec->protocol, spec->external_port,
+            spec->local_ip, spec->local_port, command->id,
+            spec->lease_duration, spec->description);
+      break;
+    case COMMAND_REMOVE_PORT_RANGE:
+      if (klass->remove_port_range)
+        klass->remove_port_range (self, spec->protocol, spec->external_port);
+      break;
+    case COMMAND_SHUTDOWN:
+      if (klass->shutdown_async)
+        klass->shutdown_async (self, command->id,
+            g_steal_pointer (&command->task));
+      break;
+  }
+}
 
-  if (klass->remove_port)
-    klass->remove_port (GUPNP_SIMPLE_IGD (self), data->protocol,
-        data->external_port);
+static gboolean
+command_source_prepare (GSource *source, gint *timeout)
+{
+  struct CommandSource *cs = (struct CommandSource *) source;
 
-  g_object_unref (self);
+  *timeout = -1;
 
-  return FALSE;
+  return g_atomic_pointer_get (&cs->commands) != NULL;
 }
 
 static gboolean
-remove_port_local_idle_func (gpointer user_data)
+command_source_check (GSource *source)
 {
-  struct AddRemovePortData *data = user_data;
-  GUPnPSimpleIgdClass *klass =
-      GUPNP_SIMPLE_IGD_CLASS (gupnp_simple_igd_thread_parent_class);
+  struct CommandSource *cs = (struct CommandSource *) source;
+
+  return g_atomic_pointer_get (&cs->commands) != NULL;
+}
+
+static gboolean
+command_source_dispatch (GSource *source, GSourceFunc callback,
+    gpointer user_data)
+{
+  struct CommandSource *cs = (struct CommandSource *) source;
+  struct Command *commands = command_source_steal_commands (cs);
   GUPnPSimpleIgdThread *self;
 
-  g_mutex_lock (&data->mutex);
-  self = data->self;
-  if (self)
-    g_object_ref (self);
-  g_mutex_unlock (&data->mutex);
-  if (!self)
-    return FALSE;
+  /* NULL once the last reference is being dropped, we must not take a new
+   * one on an object that is being disposed */
+  self = g_weak_ref_get (&cs->self);
+
+  while (commands)
+  {
+    struct Command *next = commands->next;
 
-  if (klass->remove_port_local)
-    klass->remove_port_local (GUPNP_SIMPLE_IGD (self), data->protocol,
-        data->local_ip, data->local_port);
+    if (self && !g_atomic_int_get (&cs->closed))
+      run_command (GUPNP_SIMPLE_IGD (self), commands);
 
-  g_object_unref (self);
+    command_free (commands);
+    commands = next;
+  }
 
-  return FALSE;
+  if (self)
+    g_object_unref (self);
+
+  return G_SOURCE_CONTINUE;
 }
 
 static void
-free_add_remove_port_data (gpointer user_data)
+command_source_finalize (GSource *source)
 {
-  struct AddRemovePortData *data = user_data;
-  GUPnPSimpleIgdThread *self;
+  struct CommandSource *cs = (struct CommandSource *) source;
+  struct Command *commands = command_source_steal_commands (cs);
 
-  g_mutex_lock (&data->mutex);
-  self = data->self;
-  data->self = NULL;
-  if (self)
-    g_object_ref (self);
-  g_mutex_unlock (&data->mutex);
-  if (self)
-    {
-      GUPNP_SIMPLE_IGD_THREAD_LOCK (self);
-      g_ptr_array_remove_fast (self->priv->add_remove_port_datas, data);
-      GUPNP_SIMPLE_IGD_THREAD_UNLOCK (self);
-      g_object_unref (self);
-    }
+  while (commands)
+  {
+    struct Command *next = commands->next;
 
-  g_free (data->protocol);
-  g_free (data->local_ip);
-  g_free (data->description);
+    command_free (commands);
+    commands = next;
+  }
 
-  g_mutex_clear (&data->mutex);
+  g_weak_ref_clear (&cs->self);
+}
+
+static GSourceFuncs command_source_funcs = {
+  command_source_prepare,
+  command_source_check,
+  command_source_dispatch,
+  command_source_finalize
+};
 
-  g_slice_free (struct AddRemovePortData, data);
+static gsize
+string_size (const gchar *str)
+{
+  return str ? strlen (str) + 1 : 0;
+}
+
+static const gchar *
+copy_string (gchar **dest, const gchar *str)
+{
+  const gchar *copy = *dest;
+
+  if (!str)
+    return NULL;
+
+  *dest = g_stpcpy (*dest, str) + 1;
+
+  return copy;
+}
+
+/* Allocates a command, copying the specs and all their strings into the
+ * same block of memory */
+static struct Command *
+command_new (CommandType type, const GUPnPSimpleIgdPortSpec *specs,
+    guint n_specs)
+{
+  struct Command *command;
+  gsize size = sizeof (struct Command) +
+      sizeof (GUPnPSimpleIgdPortSpec) * n_specs;
+  gchar *strings;
+  guint i;
+
+  for (i = 0; i < n_specs; i++)
+  {
+    size += string_size (specs[i].protocol);
+    size += string_size (specs[i].local_ip);
+    size += string_size (specs[i].description);
+  }
+
+  command = g_malloc (size);
+  command->next = NULL;
+  command->task = NULL;
+  command->mapping = NULL;
+  command->id = 0;
+  command->type = type;
+  command->n_specs = n_specs;
+  command->specs = (GUPnPSimpleIgdPortSpec *) (command + 1);
+
+  strings = (gchar *) (command->specs + n_specs);
+
+  for (i = 0; i < n_specs; i++)
+  {
+    command->specs[i] = specs[i];
+    command->specs[i].protocol = copy_string (&strings, specs[i].protocol);
+    command->specs[i].local_ip = copy_string (&strings, specs[i].local_ip);
+    command->specs[i].description = copy_string (&strings,
+        specs[i].description);
+  }
+
+  return command;
+}
+
+static void
+push_command (GUPnPSimpleIgdThread *self, struct Command *command)
+{
+  struct CommandSource *cs = self->priv->command_source;
+  struct Command *head;
+
+  do {
+    head = g_atomic_pointer_get (&cs->commands);
+    command->next = head;
+  } while (!g_atomic_pointer_compare_and_exchange (&cs->commands, head,
+          command));
+
+  /* Otherwise the worker has already been woken up for the earlier ones */
+  if (head == NULL)
+    g_main_context_wakeup (self->priv->context);
 }
 
 static void
@@ -468,29 +688,64 @@ gupnp_simple_igd_thread_add_port (GUPnPSimpleIgd *self,
     guint32 lease_duration,
     const gchar *description)
 {
-  GUPnPSimpleIgdThread *realself = GUPNP_SIMPLE_IGD_THREAD (self);
-  struct AddRemovePortData *data = g_slice_new0 (struct AddRemovePortData);
-  GSource *source;
+  GUPnPSimpleIgdPortSpec spec = {
+    protocol, external_port, local_ip, local_port, lease_duration,
+    description
+  };
 
-  g_mutex_init (&data->mutex);
-  data->self = realself;
-  data->protocol = g_strdup (protocol);
-  data->external_port = external_port;
-  data->local_ip = g_strdup (local_ip);
-  data->local_port = local_port;
-  data->lease_duration = lease_duration;
-  data->description = g_strdup (description);
-  GUPNP_SIMPLE_IGD_THREAD_LOCK (realself);
-  g_ptr_array_add (realself->priv->add_remove_port_datas, data);
-  GUPNP_SIMPLE_IGD_THREAD_UNLOCK (realself);
-
-  source = g_idle_source_new ();
-  g_source_set_callback (source, add_port_idle_func, data,
-      free_add_remove_port_data);
-  g_source_set_priority (source, G_PRIORITY_DEFAULT);
-  g_source_attach (source, realself->priv->context);
-  g_source_unref (source);
-  g_main_context_wakeup (realself->priv->context);
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self),
+      command_new (COMMAND_ADD_PORT, &spec, 1));
+}
+
+static void
+gupnp_simple_igd_thread_add_port_async (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description,
+    GTask *task)
+{
+  GUPnPSimpleIgdPortSpec spec = {
+    protocol, external_port, local_ip, local_port, lease_duration,
+    description
+  };
+  struct Command *command = command_new (COMMAND_ADD_PORT_ASYNC, &spec, 1);
+
+  command->task = task;
+
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self), command);
+}
+
+static void
+gupnp_simple_igd_thread_add_mapping (GUPnPSimpleIgd *self,
+    GUPnPIgdMapping *mapping)
+{
+  struct Command *command = command_new (COMMAND_ADD_MAPPING, NULL, 0);
+
+  command->mapping = g_object_ref (mapping);
+
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self), command);
+}
+
+static void
+gupnp_simple_igd_thread_remove_mapping_id (GUPnPSimpleIgd *self, guint id)
+{
+  struct Command *command = command_new (COMMAND_REMOVE_MAPPING_ID, NULL, 0);
+
+  command->id = id;
+
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self), command);
+}
+
+static void
+gupnp_simple_igd_thread_add_ports (GUPnPSimpleIgd *self,
+    const GUPnPSimpleIgdPortSpec *specs,
+    guint n_specs)
+{
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self),
+      command_new (COMMAND_ADD_PORT, specs, n_specs));
 }
 
 static void
@@ -498,25 +753,10 @@ gupnp_simple_igd_thread_remove_port (GUPnPSimpleIgd *self,
     const gchar *protocol,
     guint external_port)
 {
-  GUPnPSimpleIgdThread *realself = GUPNP_SIMPLE_IGD_THREAD (self);
-  struct AddRemovePortData *data = g_slice_new0 (struct AddRemovePortData);
-  GSource *source;
+  GUPnPSimpleIgdPortSpec spec = { protocol, external_port, NULL, 0, 0, NULL };
 
-  g_mutex_init (&data->mutex);
-  data->self = realself;
-  data->protocol = g_strdup (protocol);
-  data->external_port = external_port;
-  GUPNP_SIMPLE_IGD_THREAD_LOCK (realself);
-  g_ptr_array_add (realself->priv->add_remove_port_datas, data);
-  GUPNP_SIMPLE_IGD_THREAD_UNLOCK (realself);
-
-  source = g_idle_source_new ();
-  g_source_set_callback (source, remove_port_idle_func, data,
-      free_add_remove_port_data);
-  g_source_set_priority (source, G_PRIORITY_DEFAULT);
-  g_source_attach (source, realself->priv->context);
-  g_source_unref (source);
-  g_main_context_wakeup (realself->priv->context);
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self),
+      command_new (COMMAND_REMOVE_PORT, &spec, 1));
 }
 
 static void
@@ -525,26 +765,55 @@ gupnp_simple_igd_thread_remove_port_local (GUPnPSimpleIgd *self,
     const gchar *local_ip,
     guint16 local_port)
 {
-  GUPnPSimpleIgdThread *realself = GUPNP_SIMPLE_IGD_THREAD (self);
-  struct AddRemovePortData *data = g_slice_new0 (struct AddRemovePortData);
-  GSource *source;
+  GUPnPSimpleIgdPortSpec spec = { protocol, 0, local_ip, local_port, 0, NULL };
 
-  g_mutex_init (&data->mutex);
-  data->self = realself;
-  data->protocol = g_strdup (protocol);
-  data->local_ip = g_strdup (local_ip);
-  data->local_port = local_port;
-  GUPNP_SIMPLE_IGD_THREAD_LOCK (realself);
-  g_ptr_array_add (realself->priv->add_remove_port_datas, data);
-  GUPNP_SIMPLE_IGD_THREAD_UNLOCK (realself);
-
-  source = g_idle_source_new ();
-  g_source_set_callback (source, remove_port_local_idle_func, data,
-      free_add_remove_port_data);
-  g_source_set_priority (source, G_PRIORITY_DEFAULT);
-  g_source_attach (source, realself->priv->context);
-  g_source_unref (source);
-  g_main_context_wakeup (realself->priv->context);
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self),
+      command_new (COMMAND_REMOVE_PORT_LOCAL, &spec, 1));
+}
+
+static void
+gupnp_simple_igd_thread_add_port_range (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint n_ports,
+    guint32 lease_duration,
+    const gchar *description)
+{
+  GUPnPSimpleIgdPortSpec spec = {
+    protocol, external_port, local_ip, local_port, lease_duration,
+    description
+  };
+  struct Command *command = command_new (COMMAND_ADD_PORT_RANGE, &spec, 1);
+
+  command->id = n_ports;
+
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self), command);
+}
+
+static void
+gupnp_simple_igd_thread_remove_port_range (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint external_port)
+{
+  GUPnPSimpleIgdPortSpec spec = { protocol, external_port, NULL, 0, 0, NULL };
+
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self),
+      command_new (COMMAND_REMOVE_PORT_RANGE, &spec, 1));
+}
+
+static void
+gupnp_simple_igd_thread_shutdown_async (GUPnPSimpleIgd *self,
+    guint timeout,
+    GTask *task)
+{
+  struct Command *command = command_new (COMMAND_SHUTDOWN, NULL, 0);
+
+  command->id = timeout;
+  command->task = task;
+
+  push_command (GUPNP_SIMPLE_IGD_THREAD (self), command);
 }
 
 /**
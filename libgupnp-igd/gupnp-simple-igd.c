@@ -42,13 +42,63 @@
 #include "gupnp-simple-igd.h"
 #include "gupnp-simple-igd-priv.h"
 #include "gupnp-simple-igd-marshal.h"
+#include "gupnp-enum-types.h"
 
 #include <string.h>
 
+#include <stdio.h>
+
+#ifdef G_OS_UNIX
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
 #include <libgupnp/gupnp.h>
+#include <libxml/parser.h>
 
 #define SOUP_REQUEST_TIMEOUT 5
 
+#define RENEW_NOT_SCHEDULED G_MAXUINT
+
+#define DEFAULT_RENEWAL_JITTER 10
+#define DEFAULT_RENEWAL_COALESCE_WINDOW 1000
+
+#define DEFAULT_MAX_CONCURRENT_ACTIONS 4
+
+/* Delays between GetExternalIPAddress retries, in ms */
+#define EXTERNAL_IP_RETRY_MIN_DELAY 1000
+#define EXTERNAL_IP_RETRY_MAX_DELAY 60000
+
+/* Delays between retries of a failed renewal, in ms, before jitter */
+#define RENEWAL_RETRY_MIN_DELAY 500
+#define RENEWAL_RETRY_MAX_DELAY 16000
+
+/* External ports tried when the requested one is taken, the stride is
+ * coprime with the size so the sequence goes through the whole range */
+#define PORT_RANGE_START 1025
+#define PORT_RANGE_SIZE (65535 - PORT_RANGE_START)
+#define PORT_RANGE_STRIDE 7919
+#define MAX_PORT_CONFLICTS 8
+
+/* Time an external port taken by a permanent entry, or by an entry whose
+ * lease is not known, is avoided for, in seconds */
+#define USED_PORT_LIFETIME 3600
+
+/* Time given to SSDP to find again a router read from the discovery cache
+ * before it is dropped, in ms */
+#define CACHE_VALIDATION_TIMEOUT 30000
+
+/* Time the router at the default gateway has to answer the unicast
+ * M-SEARCH of the gateway probe, in ms */
+#define GATEWAY_PROBE_TIMEOUT 3000
+#define SSDP_PORT 1900
+
+/* Entries of the router's table read at most at discovery, and the time
+ * the mappings wait for them, in ms */
+#define MAX_SCANNED_ENTRIES 1024
+#define SCAN_TIMEOUT 3000
+
 struct _GUPnPSimpleIgdPrivate
 {
   GMainContext *main_context;
@@ -58,30 +108,224 @@ struct _GUPnPSimpleIgdPrivate
   GPtrArray *service_proxies;
   GPtrArray *mappings;
 
+  /* Indexes into mappings, each value is a GQueue of struct Mapping */
+  GHashTable *mappings_by_external;
+  GHashTable *mappings_by_local;
+
+  /* Mappings returned as a GUPnPIgdMapping, by id */
+  GHashTable *mappings_by_id;
+  gint last_mapping_id; /* atomic */
+
   gboolean no_new_mappings;
 
   guint deleting_count;
+
+  /* Used for all the deletions, cancelled when the deadline of
+   * gupnp_simple_igd_shutdown_async() is reached */
+  GCancellable *delete_cancellable;
+
+  /* Pending gupnp_simple_igd_shutdown_async(), its deadline and the
+   * outcome of the deletions since it started */
+  GTask *shutdown_task;
+  GSource *shutdown_timeout_src;
+  GSource *shutdown_cancel_src;
+  gboolean shutting_down;
+  gboolean shutdown_timed_out;
+  guint deleted_ports;
+  guint failed_ports;
+
+  /* Min-heap of struct ProxyMapping ordered by renew_time, all renewals
+   * are dispatched from the single renew_src */
+  GPtrArray *renew_heap;
+  GSource *renew_src;
+
+  /* Renewal policy, in percent of the renewal interval and in ms */
+  guint renewal_jitter;
+  guint renewal_coalesce_window;
+
+  guint max_concurrent_actions;
+
+  gboolean remap_on_ip_change;
+  gboolean scan_port_mappings;
+
+  /* Identifies the application in the descriptions on the routers */
+  gchar *instance_tag;
+
+  /* Routers found by earlier instances, see the "discovery-cache"
+   * property, one group per service */
+  gchar *discovery_cache;
+  GKeyFile *cache;
+
+  /* See the "probe-gateway" property, struct GatewayProbe running */
+  gboolean probe_gateway;
+  GPtrArray *gateway_probes;
+
+  /* Replaces the default gateway, see _gupnp_simple_igd_set_gateway() */
+  GInetAddress *gateway;
+  guint16 gateway_port;
+
+  gboolean single_control_point;
+
+  /* See the "single-connection" and "routing-policy" properties, the
+   * struct Proxy of the services not used because of them */
+  gboolean single_connection;
+  GUPnPSimpleIgdRoutingPolicy routing_policy;
+  GPtrArray *standby_proxies;
 };
 
+typedef enum {
+  PROXY_STATE_WAITING_IP,
+  PROXY_STATE_READY,
+  PROXY_STATE_FAILED
+} ProxyState;
+
 struct Proxy {
   GUPnPSimpleIgd *parent;
   GUPnPControlPoint *cp;
   GUPnPServiceProxy *proxy;
 
+  /* Not found by a control point but from the discovery cache or by the
+   * gateway probe, cp is only set once SSDP finds the router too. Those
+   * from the cache are dropped, after deleting their mappings, when the
+   * validation source fires first, those from the probe are kept. */
+  gboolean direct;
+  GSource *cache_validation_src;
+
+  /* With the "single-connection" or "routing-policy" properties, not used
+   * for mappings, in priv->standby_proxies, until it is a connected service
+   * that they allow, and the GetStatusInfo call that tells. A service that
+   * is not connected follows its ConnectionStatus events, it is used as a
+   * fallback once no other service it competes with is connected, until
+   * one of them is. With the "default-route" policy, a router that is not
+   * the default gateway is only used while none that is is known. */
+  gboolean standby;
+  GCancellable *status_cancellable;
+  gboolean disconnected;
+  gboolean watching_status;
+  gboolean fallback;
+  gboolean off_route;
+
+  /* Mappings are only reported once the external address is known */
+  ProxyState state;
   gchar *external_ip;
   GCancellable *external_ip_cancellable;
-  gboolean external_ip_failed;
 
-  GPtrArray *proxymappings;
+  /* GetExternalIPAddress is retried with a growing delay until it works,
+   * the struct ProxyMapping added meanwhile are only sent once it does */
+  GSource *external_ip_retry_src;
+  guint external_ip_retry_delay;
+  GQueue refused;
+
+  GQueue proxymappings;
+
+  /* struct ProxyMapping mapped while the external address was not known,
+   * they are reported when it arrives */
+  GQueue pending_mapped;
+
+  /* Deadline of the last renewal batch opened on this router */
+  gint64 renew_batch_time;
+
+  /* External ports known to be taken on this router, see port_key(), to
+   * the monotonic time at which they are tried again */
+  GHashTable *used_ports;
+
+  /* The router implements WANIPConnection:2, and AddAnyPortMapping and
+   * DeletePortMappingRange work */
+  gboolean add_any_port_mapping;
+  gboolean delete_port_mapping_range;
+
+  /* While the port mapping table is read at discovery, the entries read
+   * so far by port_key() and the struct ProxyMapping waiting for it, until
+   * the end of the table or SCAN_TIMEOUT */
+  gboolean scanning;
+  GCancellable *scan_cancellable;
+  GSource *scan_timeout_src;
+  guint scan_index;
+  GHashTable *port_table;
+  GQueue scan_waiting;
+
+  /* Entries of the table deleted by proxy_scan_done(), by port_key(), and
+   * the struct ProxyMapping that want one of their ports, sent once the
+   * DeletePortMapping is done so that it can not remove them instead */
+  GHashTable *stale_deletes;
+  GQueue delete_waiting;
+
+  /* SOAP actions waiting for a slot, by priority, and those in flight */
+  GQueue pending_actions[2];
+  GQueue inflight_actions;
+};
+
+typedef enum {
+  ACTION_PRIORITY_HIGH,
+  ACTION_PRIORITY_LOW
+} ActionPriority;
+
+struct QueuedAction {
+  struct Proxy *prox;
+  GUPnPServiceProxy *proxy;
+  GUPnPServiceProxyAction *action;
+  GCancellable *cancellable;
+  GAsyncReadyCallback callback;
+  gpointer user_data;
+
+  /* Completes the action as soon as it is cancelled while queued */
+  ActionPriority priority;
+  GSource *cancel_src;
+
+  /* Link into one of the queues of prox */
+  GList link;
 };
 
 struct Mapping {
+  GUPnPSimpleIgd *parent;
+
   gchar *protocol;
   guint requested_external_port;
   gchar *local_ip;
   guint16 local_port;
   guint32 lease_duration;
   gchar *description;
+
+  /* The description as written in the tables of the routers */
+  gchar *router_description;
+
+  /* Set if the mapping was returned as a GUPnPIgdMapping */
+  guint id;
+  GWeakRef handle;
+
+  /* For a range added with gupnp_simple_igd_add_port_range(), the number
+   * of consecutive ports from local_port, 0 otherwise. A range is not in
+   * the indexes and is always reported as a whole. */
+  guint n_ports;
+
+  /* Position in priv->mappings and links into the index queues */
+  guint index;
+  GList external_link;
+  GList local_link;
+
+  /* The struct ProxyMapping for this mapping on every router */
+  GQueue proxymappings;
+
+  /* Pending gupnp_simple_igd_add_port_async() and the errors from the
+   * routers that failed so far */
+  GTask *task;
+  GSource *cancel_src;
+  GError *task_error;
+};
+
+/* Unicast search for the router at the default gateway of a context, and
+ * the download of its description */
+struct GatewayProbe {
+  GUPnPSimpleIgd *parent;
+  GUPnPContext *context;
+  GInetAddress *gateway;
+
+  GSocket *socket;
+  GSource *recv_src;
+  GSource *timeout_src;
+
+  GCancellable *cancellable;
+  gchar *location;
 };
 
 struct ProxyMapping {
@@ -91,9 +335,94 @@ struct ProxyMapping {
   GCancellable *cancellable;
 
   gboolean mapped;
+  gboolean failed;
   guint actual_external_port;
 
-  GSource *renew_src;
+  /* Position in the sequence of proxy_allocate_port() and number of
+   * ports the router refused so far */
+  guint port_candidate;
+  guint port_conflicts;
+
+  /* Monotonic time of the next renewal and position in priv->renew_heap */
+  gint64 renew_time;
+  guint renew_index;
+
+  /* When the last AddPortMapping was sent, when the lease it obtained
+   * runs out and how many renewals failed since */
+  gint64 request_time;
+  gint64 lease_expiry;
+  guint renew_retries;
+
+  /* Links into proxy->proxymappings and mapping->proxymappings */
+  GList proxy_link;
+  GList mapping_link;
+
+  /* Link into proxy->pending_mapped, if in it */
+  GList pending_link;
+  gboolean pending;
+
+  /* Link into proxy->scan_waiting or proxy->delete_waiting, if in one of
+   * them, and whether the entry was found in the router's table */
+  GList scan_link;
+  gboolean waiting_scan;
+  gboolean waiting_delete;
+  gboolean adopted;
+
+  /* Link into proxy->refused, if in it */
+  GList refused_link;
+  gboolean refused;
+
+  /* For a range, the state of each of its ports on the router, how many
+   * of them are mapped and how many AddPortMapping are in flight. The
+   * first error of those is kept until they are all answered. */
+  struct RangePort *ports;
+  guint n_mapped;
+  guint n_sending;
+  GError *range_error;
+};
+
+/* A port of a range on one router, whether the router has it and whether
+ * the last AddPortMapping sent for it succeeded */
+struct RangePort {
+  struct ProxyMapping *pm;
+  gboolean mapped;
+  gboolean done;
+};
+
+/* Copy of a mapping used to emit signals about every mapping of a router,
+ * as the signal handlers may remove mappings while we iterate. For a
+ * range, n_ports is the number of ports in it. */
+struct MappingNotify {
+  GUPnPIgdMapping *handle;
+  gboolean failed;
+  gchar *protocol;
+  guint requested_external_port;
+  guint actual_external_port;
+  guint n_ports;
+  gchar *local_ip;
+  guint16 local_port;
+  gchar *description;
+};
+
+/* Result of gupnp_simple_igd_add_port_async() */
+struct AddPortResult {
+  gchar *external_ip;
+  guint external_port;
+};
+
+/* Result of gupnp_simple_igd_shutdown_async() */
+struct ShutdownResult {
+  guint n_deleted;
+  guint n_failed;
+  gboolean timed_out;
+};
+
+/* A GTask taken from its mapping, to be returned once we are done with our
+ * own data structures, as the callback may be called synchronously */
+struct TaskReturn {
+  GTask *task;
+  struct AddPortResult *result;
+  GError *error;
 };
 
 /* signals */
@@ -102,6 +431,10 @@ enum
   SIGNAL_MAPPED_EXTERNAL_PORT,
   SIGNAL_ERROR_MAPPING_PORT,
   SIGNAL_CONTEXT_AVAILABLE,
+  SIGNAL_EXTERNAL_IP_CHANGED,
+  SIGNAL_MAPPED_EXTERNAL_PORT_RANGE,
+  SIGNAL_ERROR_MAPPING_PORT_RANGE,
+  SIGNAL_PORT_RANGE_PROGRESS,
   LAST_SIGNAL
 };
 
@@ -109,7 +442,18 @@ enum
 enum
 {
   PROP_0,
-  PROP_MAIN_CONTEXT
+  PROP_MAIN_CONTEXT,
+  PROP_RENEWAL_JITTER,
+  PROP_RENEWAL_COALESCE_WINDOW,
+  PROP_MAX_CONCURRENT_ACTIONS,
+  PROP_REMAP_ON_IP_CHANGE,
+  PROP_SCAN_PORT_MAPPINGS,
+  PROP_INSTANCE_TAG,
+  PROP_DISCOVERY_CACHE,
+  PROP_PROBE_GATEWAY,
+  PROP_SINGLE_CONTROL_POINT,
+  PROP_SINGLE_CONNECTION,
+  PROP_ROUTING_POLICY
 };
 
 guint signals[LAST_SIGNAL] = { 0 };
@@ -129,17 +473,55 @@ static void gupnp_simple_igd_dispose (GObject *object);
 static void gupnp_simple_igd_finalize (GObject *object);
 static void gupnp_simple_igd_get_property (GObject *object, guint prop_id,
     GValue *value, GParamSpec *pspec);
+static void gupnp_simple_igd_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec);
 
 static void gupnp_simple_igd_gather (GUPnPSimpleIgd *self,
     struct Proxy *prox);
 static void gupnp_simple_igd_add_proxy_mapping (GUPnPSimpleIgd *self,
     struct Proxy *prox,
     struct Mapping *mapping);
+static void proxy_mapping_queue_start (struct ProxyMapping *pm);
+static gpointer port_key (const gchar *protocol, guint port);
 
+static struct Proxy *gupnp_simple_igd_add_proxy (GUPnPSimpleIgd *self,
+    GUPnPControlPoint *cp, GUPnPServiceProxy *proxy, gboolean direct);
 static void free_proxy (struct Proxy *prox);
+static void _connection_status_changed (GUPnPServiceProxy *proxy,
+    const gchar *variable, GValue *value, gpointer user_data);
+static gboolean _cache_validation_timeout (gpointer user_data);
+static gboolean _scan_timeout (gpointer user_data);
+static void proxy_request_status (struct Proxy *prox);
 static void free_mapping (GUPnPSimpleIgd *self, struct Mapping *mapping);
+static void free_gateway_probe (struct GatewayProbe *probe);
+
+static GInetAddress *gateway_destination (GUPnPSimpleIgd *self,
+    const gchar *interface, guint16 *port);
 
 static void stop_proxymapping (struct ProxyMapping *pm, gboolean stop_renew);
+static void unschedule_renewal (GUPnPSimpleIgd *self,
+    struct ProxyMapping *pm);
+static gboolean schedule_renewal_retry (GUPnPSimpleIgd *self,
+    struct ProxyMapping *pm, gint64 now);
+static gboolean _renew_mappings_timeout (gpointer user_data);
+static void proxy_mapping_send_range (struct ProxyMapping *pm,
+    ActionPriority priority, gboolean retry);
+static GSourceFuncs renew_source_funcs;
+
+static void proxy_call_action (struct Proxy *prox,
+    GUPnPServiceProxyAction *action, ActionPriority priority,
+    GCancellable *cancellable, GAsyncReadyCallback callback,
+    gpointer user_data);
+static void proxy_delete_port_mapping (struct Proxy *prox,
+    const gchar *protocol, guint external_port);
+static void proxy_scan_next (struct Proxy *prox);
+static gssize description_parse_instance (GUPnPSimpleIgd *self,
+    const gchar *description, gint64 *pid);
+static gint current_pid (void);
+static gboolean pid_is_running (gint64 pid);
+static void free_port_entry (gpointer data);
+static void _service_proxy_got_port_mapping_entry (GObject *source_object,
+    GAsyncResult *res, gpointer user_data);
 
 static void gupnp_simple_igd_add_port_real (GUPnPSimpleIgd *self,
     const gchar *protocol,
@@ -148,6 +530,21 @@ static void gupnp_simple_igd_add_port_real (GUPnPSimpleIgd *self,
     guint16 local_port,
     guint32 lease_duration,
     const gchar *description);
+static void gupnp_simple_igd_add_port_async_real (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description,
+    GTask *task);
+static void gupnp_simple_igd_add_mapping_real (GUPnPSimpleIgd *self,
+    GUPnPIgdMapping *handle);
+static void gupnp_simple_igd_remove_mapping_id_real (GUPnPSimpleIgd *self,
+    guint id);
+static void gupnp_simple_igd_add_ports_real (GUPnPSimpleIgd *self,
+    const GUPnPSimpleIgdPortSpec *specs,
+    guint n_specs);
 static void gupnp_simple_igd_remove_port_real (GUPnPSimpleIgd *self,
     const gchar *protocol,
     guint external_port);
@@ -155,6 +552,20 @@ static void gupnp_simple_igd_remove_port_local_real (GUPnPSimpleIgd *self,
     const gchar *protocol,
     const gchar *local_ip,
     guint16 local_port);
+static void gupnp_simple_igd_add_port_range_real (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint n_ports,
+    guint32 lease_duration,
+    const gchar *description);
+static void gupnp_simple_igd_remove_port_range_real (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint external_port);
+static void gupnp_simple_igd_shutdown_async_real (GUPnPSimpleIgd *self,
+    guint timeout,
+    GTask *task);
 
 GQuark
 gupnp_simple_igd_error_quark (void)
@@ -172,10 +583,18 @@ gupnp_simple_igd_class_init (GUPnPSimpleIgdClass *klass)
   gobject_class->dispose = gupnp_simple_igd_dispose;
   gobject_class->finalize = gupnp_simple_igd_finalize;
   gobject_class->get_property = gupnp_simple_igd_get_property;
+  gobject_class->set_property = gupnp_simple_igd_set_property;
 
   klass->add_port = gupnp_simple_igd_add_port_real;
+  klass->add_ports = gupnp_simple_igd_add_ports_real;
+  klass->add_port_async = gupnp_simple_igd_add_port_async_real;
   klass->remove_port = gupnp_simple_igd_remove_port_real;
   klass->remove_port_local = gupnp_simple_igd_remove_port_local_real;
+  klass->add_mapping = gupnp_simple_igd_add_mapping_real;
+  klass->remove_mapping_id = gupnp_simple_igd_remove_mapping_id_real;
+  klass->add_port_range = gupnp_simple_igd_add_port_range_real;
+  klass->remove_port_range = gupnp_simple_igd_remove_port_range_real;
+  klass->shutdown_async = gupnp_simple_igd_shutdown_async_real;
 
   g_object_class_install_property (gobject_class,
       PROP_MAIN_CONTEXT,
@@ -184,6 +603,222 @@ gupnp_simple_igd_class_init (GUPnPSimpleIgdClass *klass)
           "This GMainContext will be used for all async activities",
           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * GUPnPSimpleIgd:renewal-jitter:
+   *
+   * Mappings are renewed after half of their lease duration. To avoid
+   * renewing every mapping created in the same burst at the same time,
+   * each renewal is moved earlier by a random amount of up to this
+   * percentage of the renewal interval. Renewals are never delayed.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_RENEWAL_JITTER,
+      g_param_spec_uint ("renewal-jitter",
+          "Renewal jitter",
+          "Maximum random advance of a renewal, in percent of its interval",
+          0, 100, DEFAULT_RENEWAL_JITTER,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:renewal-coalesce-window:
+   *
+   * Renewals on the same router that fall due within this many
+   * milliseconds after an already scheduled renewal are advanced to a
+   * random time between that renewal and their own, so each router gets
+   * its renewals in batches spread over this window instead of one by one
+   * over the whole lease. 0 disables coalescing.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_RENEWAL_COALESCE_WINDOW,
+      g_param_spec_uint ("renewal-coalesce-window",
+          "Renewal coalescing window",
+          "Window in milliseconds within which renewals on the same router "
+          "are grouped",
+          0, G_MAXUINT, DEFAULT_RENEWAL_COALESCE_WINDOW,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:max-concurrent-actions:
+   *
+   * The maximum number of SOAP actions sent to a single router at the
+   * same time, the others are queued. New mappings and removals are
+   * sent before renewals. 0 means no limit.
+   *
+   * Consumer routers fail when they get hundreds of requests at once, so
+   * the default is 4. Before this property existed, every action was
+   * sent as soon as it was made.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_MAX_CONCURRENT_ACTIONS,
+      g_param_spec_uint ("max-concurrent-actions",
+          "Maximum concurrent actions",
+          "Maximum number of SOAP actions in flight per router (0 = no limit)",
+          0, G_MAXUINT, DEFAULT_MAX_CONCURRENT_ACTIONS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:remap-on-ip-change:
+   *
+   * If %TRUE, #GUPnPSimpleIgd::mapped-external-port is emitted again for
+   * every mapping of a router when its external address changes. Set it
+   * to %FALSE to only get #GUPnPSimpleIgd::external-ip-changed, which is
+   * emitted once per router. The signals of #GUPnPIgdMapping objects are
+   * not affected.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_REMAP_ON_IP_CHANGE,
+      g_param_spec_boolean ("remap-on-ip-change",
+          "Re-emit mappings on IP change",
+          "Emit mapped-external-port for every mapping when the external "
+          "address of a router changes",
+          TRUE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:scan-port-mappings:
+   *
+   * If %TRUE, the port mapping table of each router is read when it is
+   * discovered, before any mapping is sent to it. Reading stops after 3
+   * seconds so that a large table does not hold the mappings back, only
+   * the entries read by then are used. Mappings that the router
+   * already has, for example from before the application restarted, are
+   * then reported as mapped without adding them again, duplicates of them
+   * on other external ports are deleted, and ports mapped by other hosts
+   * are not asked for. This only affects routers discovered after it is
+   * set.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_SCAN_PORT_MAPPINGS,
+      g_param_spec_boolean ("scan-port-mappings",
+          "Scan port mappings",
+          "Read the port mapping table of routers when they are discovered",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:instance-tag:
+   *
+   * If set, " [tag:host:pid]" is appended to the description of every
+   * mapping in the tables of the routers, with the name of this host and
+   * the id of this process. The table of each router is then read when it
+   * is discovered, and the mappings carrying the same tag and host but
+   * the id of a process that is no longer running are deleted. Those were
+   * left by an earlier instance that could not remove them, for example
+   * because it crashed. Only the instances on the same host are checked.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_INSTANCE_TAG,
+      g_param_spec_string ("instance-tag",
+          "Instance tag",
+          "Tag added to the descriptions to find the mappings of dead "
+          "instances",
+          NULL,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:discovery-cache:
+   *
+   * Path of a file where the routers that were discovered are remembered,
+   * by network interface and network. If set, the routers found by an
+   * earlier instance on the same network are used as soon as the network
+   * is available, without waiting for SSDP to find them. They are
+   * dropped, and forgotten, if SSDP does not find them again within 30
+   * seconds.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_DISCOVERY_CACHE,
+      g_param_spec_string ("discovery-cache",
+          "Discovery cache",
+          "File where the routers that were discovered are remembered",
+          NULL,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:probe-gateway:
+   *
+   * If %TRUE, the default gateway of each network interface is also asked
+   * directly with a unicast M-SEARCH if it is an Internet Gateway Device,
+   * at the same time as the multicast search of SSDP. The router is used
+   * as soon as the first of the two finds it. Only an answer sent by the
+   * gateway that points to a description on the gateway is followed. The
+   * router is kept even if SSDP never finds it, as on networks that filter
+   * multicast. The default gateway is only known on Linux.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_PROBE_GATEWAY,
+      g_param_spec_boolean ("probe-gateway",
+          "Probe gateway",
+          "Ask the default gateway directly if it is the router",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:single-control-point:
+   *
+   * If %TRUE, each network interface is searched once for Internet Gateway
+   * Devices, and both the WANIPConnection and WANPPPConnection services
+   * are found in the description of the router. Otherwise, each type of
+   * service is searched for separately, which finds the routers that do
+   * not announce their root device correctly but doubles the SSDP
+   * traffic and the downloads of descriptions.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_SINGLE_CONTROL_POINT,
+      g_param_spec_boolean ("single-control-point",
+          "Single control point",
+          "Search for the gateway devices instead of each connection service",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:single-connection:
+   *
+   * If %TRUE, only one of the WANIPConnection and WANPPPConnection services
+   * of a router is used, instead of adding every mapping on both. The
+   * first one that says it is connected in reply to GetStatusInfo is
+   * chosen, or that does not implement GetStatusInfo. The others are only
+   * asked again if the chosen one goes away or announces with the
+   * ConnectionStatus event that it is not connected anymore, its mappings
+   * are then deleted. If none of them is connected, one of them is used
+   * anyway until another one announces that it is connected.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_SINGLE_CONNECTION,
+      g_param_spec_boolean ("single-connection",
+          "Single connection",
+          "Use only the connected service of each router",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+          G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GUPnPSimpleIgd:routing-policy:
+   *
+   * Which of the routers that are found get the mappings. With a policy
+   * other than %GUPNP_SIMPLE_IGD_ROUTING_POLICY_ALL, a router is only
+   * used once one of its services says it is connected in reply to
+   * GetStatusInfo, or does not implement it. The other routers are asked
+   * again if the chosen one goes away. If no router is connected, one of
+   * them is used anyway until another one announces with the
+   * ConnectionStatus event that it is connected. With
+   * %GUPNP_SIMPLE_IGD_ROUTING_POLICY_DEFAULT_ROUTE, the first router is
+   * used while none that is the default gateway is found, and replaced by
+   * the one that is once it is found.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_ROUTING_POLICY,
+      g_param_spec_enum ("routing-policy",
+          "Routing policy",
+          "Which of the routers get the mappings",
+          GUPNP_TYPE_SIMPLE_IGD_ROUTING_POLICY,
+          GUPNP_SIMPLE_IGD_ROUTING_POLICY_ALL,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+          G_PARAM_STATIC_STRINGS));
+
   /**
    * GUPnPSimpleIgd::mapped-external-port:
    * @self: #GUPnPSimpleIgd that emitted the signal
@@ -222,6 +857,10 @@ gupnp_simple_igd_class_init (GUPnPSimpleIgdClass *klass)
    *
    * This means that mapping a port on a specific IGD has failed (it may still
    * succeed on other IGDs on the network).
+   *
+   * A failed renewal of an existing mapping is retried a few times first,
+   * the signal is only emitted if it still fails when the lease is about to
+   * run out on the router.
    */
   signals[SIGNAL_ERROR_MAPPING_PORT] = g_signal_new ("error-mapping-port",
       G_TYPE_FROM_CLASS (klass),
@@ -254,6 +893,106 @@ gupnp_simple_igd_class_init (GUPnPSimpleIgdClass *klass)
       NULL,
       _gupnp_simple_igd_marshal_BOOLEAN__OBJECT,
       G_TYPE_BOOLEAN, 1, G_TYPE_OBJECT);
+
+  /**
+   * GUPnPSimpleIgd::external-ip-changed:
+   * @self: #GUPnPSimpleIgd that emitted the signal
+   * @old_ip: (nullable): the previous external address of the router, or
+   * %NULL if it was not known yet
+   * @new_ip: the new external address of the router
+   * @udn: the UDN of the router
+   *
+   * This signal is emitted once every time the external address of a
+   * router changes, whatever the number of mappings on it.
+   */
+  signals[SIGNAL_EXTERNAL_IP_CHANGED] = g_signal_new ("external-ip-changed",
+      G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST,
+      0,
+      NULL,
+      NULL,
+      _gupnp_simple_igd_marshal_VOID__STRING_STRING_STRING,
+      G_TYPE_NONE, 3, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+
+  /**
+   * GUPnPSimpleIgd::mapped-external-port-range:
+   * @self: #GUPnPSimpleIgd that emitted the signal
+   * @proto: the requested protocol ("UDP" or "TCP")
+   * @external_ip: the external IP
+   * @replaces_external_ip: if this mapping replaces another mapping,
+   *  this is the old external IP
+   * @external_port: the first external port of the range
+   * @n_ports: the number of ports in the range
+   * @local_ip: IP address that the router should forward the packets to
+   * @local_port: the first local port of the range
+   * @description: the user's selected description
+   *
+   * This is the equivalent of #GUPnPSimpleIgd::mapped-external-port for a
+   * range added with gupnp_simple_igd_add_port_range(). It is emitted once
+   * every port of the range is mapped on a router.
+   */
+  signals[SIGNAL_MAPPED_EXTERNAL_PORT_RANGE] =
+      g_signal_new ("mapped-external-port-range",
+          G_TYPE_FROM_CLASS (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL,
+          NULL,
+          _gupnp_simple_igd_marshal_VOID__STRING_STRING_STRING_UINT_UINT_STRING_UINT_STRING,
+          G_TYPE_NONE, 8, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+          G_TYPE_UINT, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT,
+          G_TYPE_STRING);
+
+  /**
+   * GUPnPSimpleIgd::error-mapping-port-range:
+   * @self: #GUPnPSimpleIgd that emitted the signal
+   * @error: a #GError
+   * @proto: The requested protocol
+   * @external_port: the external port requested in
+   *  gupnp_simple_igd_add_port_range()
+   * @n_ports: the number of ports in the range
+   * @local_ip: internal ip this is forwarded to
+   * @local_port: the first local port of the range
+   * @description: the passed description
+   *
+   * This is the equivalent of #GUPnPSimpleIgd::error-mapping-port for a
+   * range added with gupnp_simple_igd_add_port_range(). It is emitted
+   * once per router with the error of the first port that could not be
+   * mapped or renewed, and again only after the range was fully mapped on
+   * that router since. The ports that are mapped stay mapped until the
+   * range is removed.
+   */
+  signals[SIGNAL_ERROR_MAPPING_PORT_RANGE] =
+      g_signal_new ("error-mapping-port-range",
+          G_TYPE_FROM_CLASS (klass),
+          G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+          0,
+          NULL,
+          NULL,
+          _gupnp_simple_igd_marshal_VOID__BOXED_STRING_UINT_UINT_STRING_UINT_STRING,
+          G_TYPE_NONE, 7, G_TYPE_ERROR, G_TYPE_STRING, G_TYPE_UINT,
+          G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING);
+
+  /**
+   * GUPnPSimpleIgd::port-range-progress:
+   * @self: #GUPnPSimpleIgd that emitted the signal
+   * @proto: the requested protocol ("UDP" or "TCP")
+   * @external_port: the first external port of the range
+   * @n_ports: the number of ports in the range
+   * @n_mapped: the number of ports of the range mapped on the router
+   *
+   * This signal is emitted while the ports of a range added with
+   * gupnp_simple_igd_add_port_range() are mapped on a router, each time
+   * another tenth of the range is mapped.
+   */
+  signals[SIGNAL_PORT_RANGE_PROGRESS] = g_signal_new ("port-range-progress",
+      G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST,
+      0,
+      NULL,
+      NULL,
+      _gupnp_simple_igd_marshal_VOID__STRING_UINT_UINT_UINT,
+      G_TYPE_NONE, 4, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT);
 }
 
 static void
@@ -262,699 +1001,4808 @@ gupnp_simple_igd_init (GUPnPSimpleIgd *self)
   self->priv = gupnp_simple_igd_get_instance_private (self);
 
   self->priv->service_proxies = g_ptr_array_new ();
+  self->priv->standby_proxies = g_ptr_array_new ();
   self->priv->mappings = g_ptr_array_new ();
+  self->priv->mappings_by_external = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, (GDestroyNotify) g_queue_free);
+  self->priv->mappings_by_local = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, (GDestroyNotify) g_queue_free);
+  self->priv->mappings_by_id = g_hash_table_new (g_direct_hash,
+      g_direct_equal);
+  self->priv->renew_heap = g_ptr_array_new ();
+  self->priv->delete_cancellable = g_cancellable_new ();
+  self->priv->gateway_probes = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) free_gateway_probe);
+  self->priv->renewal_jitter = DEFAULT_RENEWAL_JITTER;
+  self->priv->renewal_coalesce_window = DEFAULT_RENEWAL_COALESCE_WINDOW;
+  self->priv->max_concurrent_actions = DEFAULT_MAX_CONCURRENT_ACTIONS;
+  self->priv->remap_on_ip_change = TRUE;
 }
 
-/**
- * gupnp_simple_igd_delete_all_mappings:
- * @self: a #GUPnPSimpleIgd
- *
- * Removes all mappings and prevents other from being formed
- * Should only be called by the dispose function of subclasses
- *
- * Returns: %TRUE if the object can be disposed, %FALSE otherwise
- */
+static gchar *
+mapping_external_key (const gchar *protocol, guint external_port)
+{
+  return g_strdup_printf ("%s:%u", protocol, external_port);
+}
 
-gboolean
-gupnp_simple_igd_delete_all_mappings (GUPnPSimpleIgd *self)
+static gchar *
+mapping_local_key (const gchar *protocol, const gchar *local_ip,
+    guint16 local_port)
 {
-  self->priv->no_new_mappings = TRUE;
+  return g_strdup_printf ("%s:%s:%u", protocol, local_ip, local_port);
+}
 
-  while (self->priv->mappings->len)
+static void
+mapping_index_insert (GHashTable *index, gchar *key, GList *link)
+{
+  GQueue *queue = g_hash_table_lookup (index, key);
+
+  if (queue)
   {
-    free_mapping (self, g_ptr_array_index (self->priv->mappings, 0));
-    g_ptr_array_remove_index_fast (self->priv->mappings, 0);
+    g_free (key);
+  }
+  else
+  {
+    queue = g_queue_new ();
+    g_hash_table_insert (index, key, queue);
   }
 
-  return (self->priv->deleting_count == 0);
+  g_queue_push_tail_link (queue, link);
 }
 
 static void
-gupnp_simple_igd_dispose (GObject *object)
+mapping_index_remove (GHashTable *index, gchar *key, GList *link)
 {
-  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
+  GQueue *queue = g_hash_table_lookup (index, key);
 
-  if (!gupnp_simple_igd_delete_all_mappings (self))
-    return;
+  if (queue)
+  {
+    g_queue_unlink (queue, link);
+    if (g_queue_is_empty (queue))
+      g_hash_table_remove (index, key);
+  }
 
-  if (self->priv->gupnp_context_manager)
-    g_object_unref (self->priv->gupnp_context_manager);
-  self->priv->gupnp_context_manager = NULL;
+  g_free (key);
+}
 
-  if (self->priv->service_proxies) {
-    g_ptr_array_foreach (self->priv->service_proxies, (GFunc) free_proxy, NULL);
-    g_ptr_array_free (self->priv->service_proxies, TRUE);
-  }
+static struct Mapping *
+mapping_index_lookup (GHashTable *index, gchar *key)
+{
+  GQueue *queue = g_hash_table_lookup (index, key);
 
-  G_OBJECT_CLASS (gupnp_simple_igd_parent_class)->dispose (object);
+  g_free (key);
+
+  if (queue)
+    return g_queue_peek_head (queue);
+  else
+    return NULL;
 }
 
 static void
-_external_ip_address_changed (GUPnPServiceProxy *proxy, const gchar *variable,
-    GValue *value, gpointer user_data)
+add_mapping (GUPnPSimpleIgd *self, struct Mapping *mapping)
 {
-  struct Proxy *prox = user_data;
-  gchar *new_ip;
-  guint i;
-
-  g_return_if_fail (G_VALUE_HOLDS_STRING(value));
+  mapping->index = self->priv->mappings->len;
+  g_ptr_array_add (self->priv->mappings, mapping);
 
-  /* It hasn't really changed, ignore it */
-  if (prox->external_ip &&
-      !strcmp (g_value_get_string (value), prox->external_ip))
+  /* A range can only be removed with gupnp_simple_igd_remove_port_range() */
+  if (mapping->n_ports)
     return;
 
-  /* Ignore invalid external IP address */
-  if (!g_hostname_is_ip_address (g_value_get_string (value)))
-    return;
+  mapping->external_link.data = mapping;
+  mapping_index_insert (self->priv->mappings_by_external,
+      mapping_external_key (mapping->protocol,
+          mapping->requested_external_port),
+      &mapping->external_link);
+  mapping->local_link.data = mapping;
+  mapping_index_insert (self->priv->mappings_by_local,
+      mapping_local_key (mapping->protocol, mapping->local_ip,
+          mapping->local_port),
+      &mapping->local_link);
+
+  if (mapping->id)
+    g_hash_table_insert (self->priv->mappings_by_id,
+        GUINT_TO_POINTER (mapping->id), mapping);
+}
 
-  new_ip = g_value_dup_string (value);
+static void
+add_port_result_free (struct AddPortResult *result)
+{
+  g_free (result->external_ip);
+  g_slice_free (struct AddPortResult, result);
+}
+
+/* Returns a new reference to the GUPnPIgdMapping of this mapping, if it
+ * still exists */
+static GUPnPIgdMapping *
+mapping_get_handle (struct Mapping *mapping)
+{
+  if (!mapping->id)
+    return NULL;
+
+  return g_weak_ref_get (&mapping->handle);
+}
+
+/* TRUE if mapping the port failed on every router it was tried on */
+static gboolean
+mapping_all_failed (struct Mapping *mapping)
+{
+  GList *item;
 
-  for (i=0; i < prox->proxymappings->len; i++)
+  for (item = mapping->proxymappings.head; item; item = item->next)
   {
-    struct ProxyMapping *pm = g_ptr_array_index (prox->proxymappings, i);
+    struct ProxyMapping *pm = item->data;
 
-    if (pm->mapped)
-      g_signal_emit (prox->parent, signals[SIGNAL_MAPPED_EXTERNAL_PORT], 0,
-          pm->mapping->protocol, new_ip, prox->external_ip,
-          pm->actual_external_port, pm->mapping->local_ip,
-          pm->mapping->local_port, pm->mapping->description);
+    if (!pm->failed)
+      return FALSE;
   }
 
-  g_free (prox->external_ip);
-  prox->external_ip = new_ip;
+  return TRUE;
 }
 
-static void
-_service_proxy_delete_port_mapping (GObject *source_object, GAsyncResult *res,
-    gpointer user_data)
+static GTask *
+mapping_steal_task (struct Mapping *mapping)
 {
-  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
-  GUPnPServiceProxyAction *action;
-  GError *error = NULL;
-  GUPnPSimpleIgd *self = user_data;
+  GTask *task = mapping->task;
 
-  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+  mapping->task = NULL;
+  g_clear_error (&mapping->task_error);
 
-  if (action == NULL ||
-      !gupnp_service_proxy_action_get_result (action, &error, NULL)) {
-    g_return_if_fail (error);
-    g_warning ("Error deleting port mapping: %s", error->message);
+  if (mapping->cancel_src)
+  {
+    g_source_destroy (mapping->cancel_src);
+    g_source_unref (mapping->cancel_src);
+    mapping->cancel_src = NULL;
   }
-  g_clear_error (&error);
-
-  if (action)
-    gupnp_service_proxy_action_unref (action);
 
-  self->priv->deleting_count--;
-  g_object_unref (self);
+  return task;
 }
 
 static void
-free_proxymapping (struct ProxyMapping *pm, GUPnPSimpleIgd *self)
+mapping_take_task_mapped (struct Mapping *mapping, const gchar *external_ip,
+    guint external_port, GArray *returns)
 {
-  stop_proxymapping (pm, TRUE);
+  struct TaskReturn tr = { NULL, NULL, NULL };
 
-  if (pm->mapped && self)
-  {
-    GUPnPServiceProxyAction *action;
+  if (!mapping->task)
+    return;
 
-    self->priv->deleting_count++;
-    g_object_ref (self);
+  tr.task = mapping_steal_task (mapping);
+  tr.result = g_slice_new (struct AddPortResult);
+  tr.result->external_ip = g_strdup (external_ip);
+  tr.result->external_port = external_port;
 
-    action = gupnp_service_proxy_action_new ("DeletePortMapping",
-        "NewRemoteHost", G_TYPE_STRING, "",
-        "NewExternalPort", G_TYPE_UINT, pm->actual_external_port,
-        "NewProtocol", G_TYPE_STRING, pm->mapping->protocol,
-        NULL);
+  g_array_append_val (returns, tr);
+}
+
+static void
+mapping_add_task_error (struct Mapping *mapping, const GError *error)
+{
+  GError *aggregate;
 
-    gupnp_service_proxy_call_action_async (pm->proxy->proxy, action, NULL,
-        _service_proxy_delete_port_mapping, self);
+  if (!mapping->task)
+    return;
+
+  if (!mapping->task_error)
+  {
+    mapping->task_error = g_error_copy (error);
+    return;
   }
 
-  g_slice_free (struct ProxyMapping, pm);
+  if (g_error_matches (mapping->task_error, GUPNP_SIMPLE_IGD_ERROR,
+          GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED))
+    aggregate = g_error_new (GUPNP_SIMPLE_IGD_ERROR,
+        GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED, "%s; %s",
+        mapping->task_error->message, error->message);
+  else
+    aggregate = g_error_new (GUPNP_SIMPLE_IGD_ERROR,
+        GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED,
+        "Could not map the port on any router: %s; %s",
+        mapping->task_error->message, error->message);
+
+  g_error_free (mapping->task_error);
+  mapping->task_error = aggregate;
 }
 
+/* Fails the task once every router it was tried on has failed */
 static void
-free_proxy (struct Proxy *prox)
+mapping_take_task_failed (struct Mapping *mapping, GArray *returns)
 {
-  g_cancellable_cancel (prox->external_ip_cancellable);
-  g_clear_object (&prox->external_ip_cancellable);
+  struct TaskReturn tr = { NULL, NULL, NULL };
 
-  gupnp_service_proxy_remove_notify (prox->proxy, "ExternalIPAddress",
-      _external_ip_address_changed, prox);
+  if (!mapping->task || !mapping->task_error || !mapping_all_failed (mapping))
+    return;
 
-  g_ptr_array_foreach (prox->proxymappings, (GFunc) free_proxymapping, NULL);
-  g_ptr_array_free (prox->proxymappings, TRUE);
-  g_free (prox->external_ip);
-  g_slice_free (struct Proxy, prox);
+  tr.error = g_steal_pointer (&mapping->task_error);
+  tr.task = mapping_steal_task (mapping);
+
+  g_array_append_val (returns, tr);
 }
 
 static void
-free_mapping (GUPnPSimpleIgd *self, struct Mapping *mapping)
+task_returns_flush (GArray *returns)
 {
-  guint i, j;
+  guint i;
 
-  for (i=0; i < self->priv->service_proxies->len; i++)
+  for (i = 0; i < returns->len; i++)
   {
-    struct Proxy *prox = g_ptr_array_index (self->priv->service_proxies, i);
+    struct TaskReturn *tr = &g_array_index (returns, struct TaskReturn, i);
 
-    for (j=0; j < prox->proxymappings->len; j++)
-    {
-      struct ProxyMapping *pm = g_ptr_array_index (prox->proxymappings, j);
-      if (pm->mapping == mapping)
-      {
-        free_proxymapping (pm, self);
-        g_ptr_array_remove_index_fast (prox->proxymappings, j);
-        j--;
-      }
-    }
+    if (tr->result)
+      g_task_return_pointer (tr->task, tr->result,
+          (GDestroyNotify) add_port_result_free);
+    else
+      g_task_return_error (tr->task, tr->error);
+    g_object_unref (tr->task);
   }
 
-  g_free (mapping->protocol);
-  g_free (mapping->local_ip);
-  g_free (mapping->description);
-  g_slice_free (struct Mapping, mapping);
+  g_array_free (returns, TRUE);
 }
 
+static GArray *
+task_returns_new (void)
+{
+  return g_array_new (FALSE, FALSE, sizeof (struct TaskReturn));
+}
+
+/* pm is the state of a range on one router */
 static void
-gupnp_simple_igd_finalize (GObject *object)
+port_range_notify_init (struct MappingNotify *mn, struct ProxyMapping *pm)
 {
-  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
+  mn->handle = NULL;
+  mn->failed = FALSE;
+  mn->protocol = g_strdup (pm->mapping->protocol);
+  mn->requested_external_port = pm->mapping->requested_external_port;
+  mn->actual_external_port = pm->actual_external_port;
+  mn->n_ports = pm->mapping->n_ports;
+  mn->local_ip = g_strdup (pm->mapping->local_ip);
+  mn->local_port = pm->mapping->local_port;
+  mn->description = g_strdup (pm->mapping->description);
+}
 
-  g_main_context_unref (self->priv->main_context);
+static void
+remove_mapping (GUPnPSimpleIgd *self, struct Mapping *mapping)
+{
+  GPtrArray *mappings = self->priv->mappings;
 
-  g_warn_if_fail (self->priv->mappings->len == 0);
-  g_ptr_array_free (self->priv->mappings, TRUE);
+  g_assert (g_ptr_array_index (mappings, mapping->index) == mapping);
 
-  G_OBJECT_CLASS (gupnp_simple_igd_parent_class)->finalize (object);
+  g_ptr_array_remove_index_fast (mappings, mapping->index);
+  if (mapping->index < mappings->len)
+  {
+    struct Mapping *moved = g_ptr_array_index (mappings, mapping->index);
+    moved->index = mapping->index;
+  }
+
+  if (!mapping->n_ports)
+  {
+    mapping_index_remove (self->priv->mappings_by_external,
+        mapping_external_key (mapping->protocol,
+            mapping->requested_external_port),
+        &mapping->external_link);
+    mapping_index_remove (self->priv->mappings_by_local,
+        mapping_local_key (mapping->protocol, mapping->local_ip,
+            mapping->local_port),
+        &mapping->local_link);
+  }
+
+  if (mapping->id)
+    g_hash_table_remove (self->priv->mappings_by_id,
+        GUINT_TO_POINTER (mapping->id));
+
+  free_mapping (self, mapping);
 }
 
 static void
-gupnp_simple_igd_get_property (GObject *object, guint prop_id,
-    GValue *value, GParamSpec *pspec)
+shutdown_result_free (struct ShutdownResult *result)
 {
-  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
+  g_slice_free (struct ShutdownResult, result);
+}
 
-  switch (prop_id) {
-    case PROP_MAIN_CONTEXT:
-      g_value_set_pointer (value, self->priv->main_context);
-      break;
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-      break;
+static void
+shutdown_clear_sources (GUPnPSimpleIgd *self)
+{
+  if (self->priv->shutdown_timeout_src)
+  {
+    g_source_destroy (self->priv->shutdown_timeout_src);
+    g_clear_pointer (&self->priv->shutdown_timeout_src, g_source_unref);
   }
 
+  if (self->priv->shutdown_cancel_src)
+  {
+    g_source_destroy (self->priv->shutdown_cancel_src);
+    g_clear_pointer (&self->priv->shutdown_cancel_src, g_source_unref);
+  }
 }
 
-
+/* Accounts for a deletion request that is done, covering n_ports ports,
+ * and completes the shutdown once none is left in flight */
 static void
-_cp_service_avail (GUPnPControlPoint *cp,
-    GUPnPServiceProxy *proxy,
-    GUPnPSimpleIgd *self)
+deletion_done (GUPnPSimpleIgd *self, guint n_ports, const GError *error)
 {
-  struct Proxy *prox;
-  guint i;
+  struct ShutdownResult *result;
+  GTask *task;
 
-  if (self->priv->no_new_mappings)
-    return;
+  if (error)
+    self->priv->failed_ports += n_ports;
+  else
+    self->priv->deleted_ports += n_ports;
 
-  prox = g_slice_new0 (struct Proxy);
+  self->priv->deleting_count--;
 
-  prox->parent = self;
-  prox->cp = cp;
-  prox->proxy = proxy;
-  prox->proxymappings = g_ptr_array_new ();
+  if (self->priv->deleting_count || !self->priv->shutdown_task)
+    return;
 
-  gupnp_simple_igd_gather (self, prox);
+  shutdown_clear_sources (self);
 
-  for (i = 0; i < self->priv->mappings->len; i++)
-    gupnp_simple_igd_add_proxy_mapping (self, prox,
-        g_ptr_array_index (self->priv->mappings, i));
+  result = g_slice_new (struct ShutdownResult);
+  result->n_deleted = self->priv->deleted_ports;
+  result->n_failed = self->priv->failed_ports;
+  result->timed_out = self->priv->shutdown_timed_out;
 
-  g_ptr_array_add(self->priv->service_proxies, prox);
+  task = g_steal_pointer (&self->priv->shutdown_task);
+  g_task_return_pointer (task, result, (GDestroyNotify) shutdown_result_free);
+  g_object_unref (task);
 }
 
+/* A DeletePortMappingRange in flight */
+struct RangeDelete {
+  GUPnPSimpleIgd *self;
+  GUPnPServiceProxy *proxy;
+  gchar *protocol;
+  guint start_port;
+  guint end_port;
+};
 
 static void
-_cp_service_unavail (GUPnPControlPoint *cp,
-    GUPnPServiceProxy *proxy,
-    GUPnPSimpleIgd *self)
+_service_proxy_deleted_port_mapping_range (GObject *source_object,
+    GAsyncResult *res, gpointer user_data)
 {
-  guint i;
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  GUPnPServiceProxyAction *action;
+  struct RangeDelete *rd = user_data;
+  GUPnPSimpleIgd *self = rd->self;
+  GError *error = NULL;
+  guint n_ports = rd->end_port - rd->start_port + 1;
 
-  for (i=0; i < self->priv->service_proxies->len; i++)
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  /* If cut by the deadline of the shutdown, there is no time left to
+   * delete the ports one by one */
+  if ((action == NULL &&
+          !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) ||
+      (action != NULL &&
+          !gupnp_service_proxy_action_get_result (action, &error, NULL)))
   {
-    struct Proxy *prox = g_ptr_array_index (self->priv->service_proxies, i);
+    guint i;
 
-    if (prox->cp == cp &&
-        !strcmp (gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (proxy)),
-            gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (prox->proxy))))
+    /* The deletion must still be accounted for below */
+    if (!error)
+      g_set_error_literal (&error, GUPNP_SIMPLE_IGD_ERROR,
+          GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED,
+          "Could not delete the range of ports");
+
+    /* The router may not implement it, or only let us delete mappings
+     * to our own address, delete the ports one by one if it is still
+     * there */
+    for (i = 0; i < self->priv->service_proxies->len; i++)
     {
-      free_proxy (prox);
-      g_ptr_array_remove_index_fast (self->priv->service_proxies, i);
+      struct Proxy *prox = g_ptr_array_index (self->priv->service_proxies, i);
+      guint port;
+
+      if (prox->proxy != rd->proxy)
+        continue;
+
+      prox->delete_port_mapping_range = FALSE;
+      for (port = rd->start_port; port <= rd->end_port; port++)
+        proxy_delete_port_mapping (prox, rd->protocol, port);
+
+      /* Accounted for by the single deletions */
+      g_clear_error (&error);
+      n_ports = 0;
       break;
     }
   }
-}
-
-static void
-gupnp_simple_igd_add_control_point (GUPnPSimpleIgd *self,
-    GUPnPContext *gupnp_context, const char *target)
-{
-  GUPnPControlPoint *cp;
-
-  cp = gupnp_control_point_new (gupnp_context, target);
-  g_return_if_fail (cp);
-  g_assert (GUPNP_IS_CONTROL_POINT (cp));
-  g_assert (G_IS_OBJECT (self));
 
-  g_signal_connect_object (cp, "service-proxy-available",
-      G_CALLBACK (_cp_service_avail), self, 0);
-  g_signal_connect_object (cp, "service-proxy-unavailable",
-      G_CALLBACK (_cp_service_unavail), self, 0);
+  if (action)
+    gupnp_service_proxy_action_unref (action);
 
-  gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (cp), TRUE);
+  g_object_unref (rd->proxy);
+  g_free (rd->protocol);
+  g_slice_free (struct RangeDelete, rd);
 
-  gupnp_context_manager_manage_control_point (
-      self->priv->gupnp_context_manager, cp);
-  g_object_unref (cp);
+  deletion_done (self, n_ports, error);
+  g_clear_error (&error);
+  g_object_unref (self);
 }
 
 static void
-_context_available (GUPnPContextManager *manager, GUPnPContext *gupnp_context,
-    GUPnPSimpleIgd *self)
+proxy_delete_port_mapping_range (struct Proxy *prox, const gchar *protocol,
+    guint start_port, guint end_port)
 {
-  SoupSession *session;
-  gboolean ignore_context = FALSE;
+  GUPnPSimpleIgd *self = prox->parent;
+  struct RangeDelete *rd = g_slice_new0 (struct RangeDelete);
+  GUPnPServiceProxyAction *action;
+  guint port;
+
+  self->priv->deleting_count++;
+  rd->self = g_object_ref (self);
+  rd->proxy = g_object_ref (prox->proxy);
+  rd->protocol = g_strdup (protocol);
+  rd->start_port = start_port;
+  rd->end_port = end_port;
+
+  for (port = start_port; port <= end_port; port++)
+    g_hash_table_remove (prox->used_ports, port_key (protocol, port));
+
+  action = gupnp_service_proxy_action_new ("DeletePortMappingRange",
+      "NewStartPort", G_TYPE_UINT, start_port,
+      "NewEndPort", G_TYPE_UINT, end_port,
+      "NewProtocol", G_TYPE_STRING, protocol,
+      "NewManage", G_TYPE_BOOLEAN, FALSE,
+      NULL);
 
-  g_signal_emit (self, signals[SIGNAL_CONTEXT_AVAILABLE], 0, gupnp_context,
-      &ignore_context);
+  proxy_call_action (prox, action, ACTION_PRIORITY_HIGH,
+      self->priv->delete_cancellable,
+      _service_proxy_deleted_port_mapping_range, rd);
+}
 
-  if (ignore_context)
-    return;
+static gint
+compare_proxymapping_ports (gconstpointer a, gconstpointer b)
+{
+  const struct ProxyMapping *pm_a = *(struct ProxyMapping * const *) a;
+  const struct ProxyMapping *pm_b = *(struct ProxyMapping * const *) b;
+  gint ret = strcmp (pm_a->mapping->protocol, pm_b->mapping->protocol);
 
-  session = gupnp_context_get_session (gupnp_context);
-  g_object_set (session, "timeout", SOUP_REQUEST_TIMEOUT, NULL);
+  if (ret)
+    return ret;
 
-  gupnp_simple_igd_add_control_point (self, gupnp_context,
-      "urn:schemas-upnp-org:service:WANIPConnection:1");
-  gupnp_simple_igd_add_control_point (self, gupnp_context,
-      "urn:schemas-upnp-org:service:WANPPPConnection:1");
+  return (gint) pm_a->actual_external_port - (gint) pm_b->actual_external_port;
 }
 
+/* Whether pm forwards to the address we talk to the router from. With
+ * NewManage set to FALSE, DeletePortMappingRange only removes the entries
+ * of the control point's own address, the others are left in place. */
+static gboolean
+proxy_mapping_to_host (struct ProxyMapping *pm)
+{
+  GUPnPServiceInfo *info = GUPNP_SERVICE_INFO (pm->proxy->proxy);
+  GSSDPClient *client = GSSDP_CLIENT (gupnp_service_info_get_context (info));
+
+  return !g_strcmp0 (pm->mapping->local_ip,
+      gssdp_client_get_host_ip (client));
+}
 
+/* Deletes the runs of consecutive ports of a range mapped on the
+ * WANIPConnection:2 router of pm with one DeletePortMappingRange each, the
+ * ports covered are then not deleted one by one when pm is freed */
 static void
-gupnp_simple_igd_constructed (GObject *object)
+proxy_mapping_delete_port_runs (struct ProxyMapping *pm)
 {
-  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
-
-  self->priv->main_context = g_main_context_get_thread_default ();
-  if (!self->priv->main_context)
-    self->priv->main_context = g_main_context_default ();
-  g_main_context_ref (self->priv->main_context);
+  struct Mapping *mapping = pm->mapping;
+  guint i = 0, j, k;
 
-  self->priv->gupnp_context_manager = gupnp_context_manager_create (0);
+  if (!proxy_mapping_to_host (pm))
+    return;
 
-  g_signal_connect_object (self->priv->gupnp_context_manager,
-      "context-available", G_CALLBACK (_context_available), self, 0);
+  while (i < mapping->n_ports)
+  {
+    for (j = i; j < mapping->n_ports && pm->ports[j].mapped; j++)
+      ;
 
-  if (G_OBJECT_CLASS (gupnp_simple_igd_parent_class)->constructed)
-    G_OBJECT_CLASS (gupnp_simple_igd_parent_class)->constructed (object);
-}
+    if (j - i > 1)
+    {
+      proxy_delete_port_mapping_range (pm->proxy, mapping->protocol,
+          pm->actual_external_port + i, pm->actual_external_port + j - 1);
 
-/**
- * gupnp_simple_igd_new:
- * main context)
- *
- * This creates a new #GUPnpSimpleIgd object using the special GMainContext
- *
- * Returns: a new #GUPnPSimpleIgd
- */
+      for (k = i; k < j; k++)
+        pm->ports[k].mapped = FALSE;
+      pm->n_mapped -= j - i;
+    }
 
-GUPnPSimpleIgd *
-gupnp_simple_igd_new (void)
-{
-  return g_object_new (GUPNP_TYPE_SIMPLE_IGD, NULL);
+    i = j + 1;
+  }
 }
 
-
+/* Deletes the runs of consecutive external ports mapped on a
+ * WANIPConnection:2 router with one DeletePortMappingRange each, the
+ * mappings covered are then not deleted one by one when they are freed.
+ * Mappings to another host are always deleted one by one. */
 static void
-_service_proxy_got_external_ip_address (GObject *source_object,
-    GAsyncResult *res, gpointer user_data)
+proxy_delete_port_mapping_ranges (struct Proxy *prox)
 {
-  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
-  struct Proxy *prox = user_data;
-  GUPnPSimpleIgd *self = prox->parent;
-  GUPnPServiceProxyAction *action;
-  GError *error = NULL;
-  gchar *ip = NULL;
-  guint i;
-
-  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+  GPtrArray *mapped;
+  GList *item;
+  guint i, j, k;
 
-  if (action == NULL &&
-      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  if (!prox->delete_port_mapping_range)
     return;
 
-  g_clear_object (&prox->external_ip_cancellable);
-
-  if (action == NULL)
-    goto error;
+  mapped = g_ptr_array_new ();
+  for (item = prox->proxymappings.head; item; item = item->next)
+  {
+    struct ProxyMapping *pm = item->data;
 
-  if (!gupnp_service_proxy_action_get_result (action, &error,
-          "NewExternalIPAddress", G_TYPE_STRING, &ip, NULL)) {
-    gupnp_service_proxy_action_unref (action);
-    goto error;
+    if (pm->mapping->n_ports)
+      proxy_mapping_delete_port_runs (pm);
+    else if (pm->mapped && proxy_mapping_to_host (pm))
+      g_ptr_array_add (mapped, pm);
   }
-  gupnp_service_proxy_action_unref (action);
 
-  if (!g_hostname_is_ip_address (ip))
+  g_ptr_array_sort (mapped, compare_proxymapping_ports);
+
+  for (i = 0; i < mapped->len; i = j + 1)
   {
-    prox->external_ip_failed = TRUE;
+    struct ProxyMapping *first = g_ptr_array_index (mapped, i);
+    struct ProxyMapping *last = first;
 
-    for (i=0; i < prox->proxymappings->len; i++)
+    for (j = i; j + 1 < mapped->len; j++)
     {
-      struct ProxyMapping *pm = g_ptr_array_index (prox->proxymappings, i);
-      GError gerror = {GUPNP_SIMPLE_IGD_ERROR,
-                       GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS,
-                       "Invalid IP address returned by router"};
-
-      g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT],
-          GUPNP_SIMPLE_IGD_ERROR, &gerror, pm->mapping->protocol,
-          pm->mapping->requested_external_port, pm->mapping->local_ip,
-          pm->mapping->local_port, pm->mapping->description);
+      struct ProxyMapping *next = g_ptr_array_index (mapped, j + 1);
+
+      if (strcmp (next->mapping->protocol, first->mapping->protocol) ||
+          next->actual_external_port != last->actual_external_port + 1)
+        break;
+      last = next;
     }
-    return;
-  }
 
-  /* Only emit the new signal if the IP changes */
-  if (prox->external_ip &&
-      strcmp (ip, prox->external_ip))
-  {
-    for (i=0; i < prox->proxymappings->len; i++)
-    {
-      struct ProxyMapping *pm = g_ptr_array_index (prox->proxymappings, i);
+    if (j == i)
+      continue;
 
-      if (pm->mapped)
-        g_signal_emit (self, signals[SIGNAL_MAPPED_EXTERNAL_PORT], 0,
-            pm->mapping->protocol, ip, prox->external_ip,
-            pm->actual_external_port, pm->mapping->local_ip,
-            pm->mapping->local_port, pm->mapping->description);
-    }
-  }
+    proxy_delete_port_mapping_range (prox, first->mapping->protocol,
+        first->actual_external_port, last->actual_external_port);
 
-  g_free (prox->external_ip);
-  prox->external_ip = ip;
+    for (k = i; k <= j; k++)
+      ((struct ProxyMapping *) g_ptr_array_index (mapped, k))->mapped = FALSE;
+  }
 
-  return;
+  g_ptr_array_free (mapped, TRUE);
+}
 
-error:
+/* Deletes every port mapped on the router before it stops being used
+ * while the mappings stay, the deletions are still sent once prox is
+ * freed */
+static void
+proxy_delete_mappings (struct Proxy *prox)
 {
-    guint i;
+  GList *item;
+  guint i;
 
-    prox->external_ip_failed = TRUE;
-    g_return_if_fail (error);
+  proxy_delete_port_mapping_ranges (prox);
 
-    for (i=0; i < prox->proxymappings->len; i++)
-    {
-      struct ProxyMapping *pm = g_ptr_array_index (prox->proxymappings, i);
+  for (item = prox->proxymappings.head; item; item = item->next)
+  {
+    struct ProxyMapping *pm = item->data;
+
+    if (pm->mapped)
+      proxy_delete_port_mapping (prox, pm->mapping->protocol,
+          pm->actual_external_port);
+    pm->mapped = FALSE;
 
-      g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT], error->domain,
-          error, pm->mapping->protocol, pm->mapping->requested_external_port,
-          pm->mapping->local_ip, pm->mapping->local_port,
-          pm->mapping->description);
+    for (i = 0; i < pm->mapping->n_ports; i++)
+    {
+      if (pm->ports[i].mapped)
+        proxy_delete_port_mapping (prox, pm->mapping->protocol,
+            pm->actual_external_port + i);
+      pm->ports[i].mapped = FALSE;
     }
   }
-  g_clear_error (&error);
 }
 
-static void
-gupnp_simple_igd_gather (GUPnPSimpleIgd *self,
-    struct Proxy *prox)
-{
-  GUPnPServiceProxyAction *action;
-
-  g_assert (prox->external_ip_cancellable == NULL);
-  prox->external_ip_cancellable = g_cancellable_new ();
-
+/**
+ * gupnp_simple_igd_delete_all_mappings:
+ * @self: a #GUPnPSimpleIgd
+ *
+ * Removes all mappings and prevents other from being formed
+ * Should only be called by the dispose function of subclasses
+ *
+ * Returns: %TRUE if the object can be disposed, %FALSE otherwise
+ */
+
+gboolean
+gupnp_simple_igd_delete_all_mappings (GUPnPSimpleIgd *self)
+{
+  guint i;
+
+  self->priv->no_new_mappings = TRUE;
+
+  for (i = 0; i < self->priv->service_proxies->len; i++)
+    proxy_delete_port_mapping_ranges (
+        g_ptr_array_index (self->priv->service_proxies, i));
+
+  while (self->priv->mappings->len)
+    remove_mapping (self, g_ptr_array_index (self->priv->mappings,
+            self->priv->mappings->len - 1));
+
+  return (self->priv->deleting_count == 0);
+}
+
+static void
+gupnp_simple_igd_dispose (GObject *object)
+{
+  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
+
+  if (!gupnp_simple_igd_delete_all_mappings (self))
+    return;
+
+  if (self->priv->gupnp_context_manager)
+    g_object_unref (self->priv->gupnp_context_manager);
+  self->priv->gupnp_context_manager = NULL;
+
+  g_ptr_array_set_size (self->priv->gateway_probes, 0);
+
+  if (self->priv->service_proxies) {
+    g_ptr_array_foreach (self->priv->service_proxies, (GFunc) free_proxy, NULL);
+    g_ptr_array_free (self->priv->service_proxies, TRUE);
+  }
+
+  if (self->priv->standby_proxies) {
+    g_ptr_array_foreach (self->priv->standby_proxies, (GFunc) free_proxy, NULL);
+    g_ptr_array_free (self->priv->standby_proxies, TRUE);
+  }
+
+  G_OBJECT_CLASS (gupnp_simple_igd_parent_class)->dispose (object);
+}
+
+static void
+mapping_notify_clear (struct MappingNotify *mn)
+{
+  g_clear_object (&mn->handle);
+  g_free (mn->protocol);
+  g_free (mn->local_ip);
+  g_free (mn->description);
+}
+
+/* queue is one of the queues of struct ProxyMapping of prox */
+static GArray *
+proxy_snapshot_mappings (struct Proxy *prox, GQueue *queue,
+    gboolean only_mapped, gboolean only_handles)
+{
+  GArray *array = g_array_sized_new (FALSE, FALSE,
+      sizeof (struct MappingNotify), queue->length);
+  GList *l;
+
+  g_array_set_clear_func (array, (GDestroyNotify) mapping_notify_clear);
+
+  for (l = queue->head; l; l = l->next)
+  {
+    struct ProxyMapping *pm = l->data;
+    struct MappingNotify mn;
+
+    if (only_mapped && !pm->mapped)
+      continue;
+
+    if (only_handles && !pm->mapping->id)
+      continue;
+
+    /* Reported by proxy_snapshot_port_ranges() */
+    if (pm->mapping->n_ports)
+      continue;
+
+    mn.handle = mapping_get_handle (pm->mapping);
+    mn.failed = mapping_all_failed (pm->mapping);
+    mn.protocol = g_strdup (pm->mapping->protocol);
+    mn.requested_external_port = pm->mapping->requested_external_port;
+    mn.actual_external_port = pm->actual_external_port;
+    mn.n_ports = 1;
+    mn.local_ip = g_strdup (pm->mapping->local_ip);
+    mn.local_port = pm->mapping->local_port;
+    mn.description = g_strdup (pm->mapping->description);
+    g_array_append_val (array, mn);
+  }
+
+  return array;
+}
+
+/* Same as proxy_snapshot_mappings() for the ranges, only those whose
+ * ports are all mapped on prox if only_mapped is set */
+static GArray *
+proxy_snapshot_port_ranges (struct Proxy *prox, gboolean only_mapped)
+{
+  GArray *array = g_array_new (FALSE, FALSE, sizeof (struct MappingNotify));
+  GList *l;
+
+  g_array_set_clear_func (array, (GDestroyNotify) mapping_notify_clear);
+
+  for (l = prox->proxymappings.head; l; l = l->next)
+  {
+    struct ProxyMapping *pm = l->data;
+    struct MappingNotify mn;
+
+    if (!pm->mapping->n_ports)
+      continue;
+
+    if (only_mapped && pm->n_mapped < pm->mapping->n_ports)
+      continue;
+
+    port_range_notify_init (&mn, pm);
+    g_array_append_val (array, mn);
+  }
+
+  return array;
+}
+
+static void
+proxy_emit_mapped_external_port (struct Proxy *prox, const gchar *new_ip,
+    const gchar *old_ip)
+{
+  gboolean remap = !old_ip || prox->parent->priv->remap_on_ip_change;
+  GArray *array;
+  guint i;
+
+  /* The first time, only the mappings that were waiting for the address
+   * have to be reported */
+  if (old_ip)
+    array = proxy_snapshot_mappings (prox, &prox->proxymappings, TRUE,
+        !remap);
+  else
+    array = proxy_snapshot_mappings (prox, &prox->pending_mapped, TRUE,
+        FALSE);
+
+  while (!g_queue_is_empty (&prox->pending_mapped))
+  {
+    struct ProxyMapping *pm = g_queue_peek_head (&prox->pending_mapped);
+
+    g_queue_unlink (&prox->pending_mapped, &pm->pending_link);
+    pm->pending = FALSE;
+  }
+
+  for (i = 0; i < array->len; i++)
+  {
+    struct MappingNotify *mn = &g_array_index (array, struct MappingNotify, i);
+
+    if (remap)
+      g_signal_emit (prox->parent, signals[SIGNAL_MAPPED_EXTERNAL_PORT], 0,
+          mn->protocol, new_ip, old_ip, mn->actual_external_port,
+          mn->local_ip, mn->local_port, mn->description);
+
+    if (mn->handle && old_ip)
+      _gupnp_igd_mapping_external_ip_changed (mn->handle, old_ip, new_ip);
+    else if (mn->handle)
+      _gupnp_igd_mapping_mapped (mn->handle, new_ip, mn->actual_external_port);
+  }
+
+  g_array_unref (array);
+
+  if (!remap)
+    return;
+
+  /* The ranges were not reported before the address was known either */
+  array = proxy_snapshot_port_ranges (prox, TRUE);
+
+  for (i = 0; i < array->len; i++)
+  {
+    struct MappingNotify *mn = &g_array_index (array, struct MappingNotify, i);
+
+    g_signal_emit (prox->parent, signals[SIGNAL_MAPPED_EXTERNAL_PORT_RANGE],
+        0, mn->protocol, new_ip, old_ip, mn->actual_external_port,
+        mn->n_ports, mn->local_ip, mn->local_port, mn->description);
+  }
+
+  g_array_unref (array);
+}
+
+static void
+proxy_emit_error_mapping_port (struct Proxy *prox, GError *error)
+{
+  GArray *array = proxy_snapshot_mappings (prox,
+      &prox->proxymappings, FALSE, FALSE);
+  guint i;
+
+  for (i = 0; i < array->len; i++)
+  {
+    struct MappingNotify *mn = &g_array_index (array, struct MappingNotify, i);
+
+    g_signal_emit (prox->parent, signals[SIGNAL_ERROR_MAPPING_PORT],
+        error->domain, error, mn->protocol, mn->requested_external_port,
+        mn->local_ip, mn->local_port, mn->description);
+
+    if (mn->handle)
+      _gupnp_igd_mapping_error (mn->handle, error, mn->failed);
+  }
+
+  g_array_unref (array);
+
+  array = proxy_snapshot_port_ranges (prox, FALSE);
+
+  for (i = 0; i < array->len; i++)
+  {
+    struct MappingNotify *mn = &g_array_index (array, struct MappingNotify, i);
+
+    g_signal_emit (prox->parent, signals[SIGNAL_ERROR_MAPPING_PORT_RANGE],
+        error->domain, error, mn->protocol, mn->requested_external_port,
+        mn->n_ports, mn->local_ip, mn->local_port, mn->description);
+  }
+
+  g_array_unref (array);
+}
+
+static void
+proxy_emit_external_ip_changed (struct Proxy *prox, const gchar *new_ip,
+    const gchar *old_ip)
+{
+  g_signal_emit (prox->parent, signals[SIGNAL_EXTERNAL_IP_CHANGED], 0,
+      old_ip, new_ip,
+      gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (prox->proxy)));
+}
+
+static void proxy_set_external_ip (struct Proxy *prox, gchar *ip);
+
+static void
+_external_ip_address_changed (GUPnPServiceProxy *proxy, const gchar *variable,
+    GValue *value, gpointer user_data)
+{
+  struct Proxy *prox = user_data;
+  gchar *new_ip;
+
+  g_return_if_fail (G_VALUE_HOLDS_STRING(value));
+
+  /* It hasn't really changed, ignore it */
+  if (prox->external_ip &&
+      !strcmp (g_value_get_string (value), prox->external_ip))
+    return;
+
+  /* Ignore invalid external IP address */
+  if (!g_hostname_is_ip_address (g_value_get_string (value)))
+    return;
+
+  new_ip = g_value_dup_string (value);
+
+  proxy_set_external_ip (prox, new_ip);
+}
+
+static void proxy_dispatch_actions (struct Proxy *prox);
+
+static void
+queued_action_clear_cancel_src (struct QueuedAction *qa)
+{
+  if (qa->cancel_src)
+  {
+    g_source_destroy (qa->cancel_src);
+    g_clear_pointer (&qa->cancel_src, g_source_unref);
+  }
+}
+
+static void
+free_queued_action (struct QueuedAction *qa)
+{
+  queued_action_clear_cancel_src (qa);
+  if (qa->cancellable)
+    g_object_unref (qa->cancellable);
+  g_object_unref (qa->proxy);
+  g_slice_free (struct QueuedAction, qa);
+}
+
+/* Completes an action that was never sent the way
+ * gupnp_service_proxy_call_action_async() completes a cancelled one, the
+ * callback is called from an idle and
+ * gupnp_service_proxy_call_action_finish() returns G_IO_ERROR_CANCELLED.
+ */
+static void
+queued_action_return_cancelled (struct QueuedAction *qa)
+{
+  GTask *task = g_task_new (qa->proxy, qa->cancellable, qa->callback,
+      qa->user_data);
+
+  g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+      "The action was cancelled before it was sent");
+  g_object_unref (task);
+
+  gupnp_service_proxy_action_unref (qa->action);
+  free_queued_action (qa);
+}
+
+static gboolean
+_queued_action_cancelled (GCancellable *cancellable, gpointer user_data)
+{
+  struct QueuedAction *qa = user_data;
+
+  g_queue_unlink (&qa->prox->pending_actions[qa->priority], &qa->link);
+  queued_action_return_cancelled (qa);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+_queued_action_done (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  struct QueuedAction *qa = user_data;
+  GAsyncReadyCallback callback = qa->callback;
+  gpointer callback_data = qa->user_data;
+
+  /* The router may have gone away while the action was in flight */
+  if (qa->prox)
+  {
+    g_queue_unlink (&qa->prox->inflight_actions, &qa->link);
+    proxy_dispatch_actions (qa->prox);
+  }
+
+  free_queued_action (qa);
+
+  callback (source_object, res, callback_data);
+}
+
+static void
+queued_action_send (struct QueuedAction *qa)
+{
+  gupnp_service_proxy_call_action_async (qa->proxy, qa->action,
+      qa->cancellable, _queued_action_done, qa);
+}
+
+static void
+proxy_dispatch_actions (struct Proxy *prox)
+{
+  guint max = prox->parent->priv->max_concurrent_actions;
+
+  /* When shutting down, everything left is a deletion, send them all */
+  if (prox->parent->priv->shutting_down)
+    max = 0;
+
+  while (max == 0 || prox->inflight_actions.length < max)
+  {
+    struct QueuedAction *qa;
+    GQueue *queue;
+
+    if (!g_queue_is_empty (&prox->pending_actions[ACTION_PRIORITY_HIGH]))
+      queue = &prox->pending_actions[ACTION_PRIORITY_HIGH];
+    else if (!g_queue_is_empty (&prox->pending_actions[ACTION_PRIORITY_LOW]))
+      queue = &prox->pending_actions[ACTION_PRIORITY_LOW];
+    else
+      break;
+
+    qa = g_queue_peek_head (queue);
+    g_queue_unlink (queue, &qa->link);
+    queued_action_clear_cancel_src (qa);
+
+    /* Nobody is waiting for the result anymore, don't bother the router */
+    if (qa->cancellable && g_cancellable_is_cancelled (qa->cancellable))
+    {
+      queued_action_return_cancelled (qa);
+      continue;
+    }
+
+    g_queue_push_tail_link (&prox->inflight_actions, &qa->link);
+    queued_action_send (qa);
+  }
+}
+
+/* Sends the action to the router once less than max-concurrent-actions
+ * are in flight on it. The callback is called as with
+ * gupnp_service_proxy_call_action_async(), also with G_IO_ERROR_CANCELLED
+ * if the cancellable is cancelled before the action is sent.
+ */
+static void
+proxy_call_action (struct Proxy *prox, GUPnPServiceProxyAction *action,
+    ActionPriority priority, GCancellable *cancellable,
+    GAsyncReadyCallback callback, gpointer user_data)
+{
+  struct QueuedAction *qa = g_slice_new0 (struct QueuedAction);
+
+  qa->prox = prox;
+  qa->proxy = g_object_ref (prox->proxy);
+  qa->action = action;
+  qa->callback = callback;
+  qa->user_data = user_data;
+  qa->priority = priority;
+  qa->link.data = qa;
+
+  if (cancellable)
+  {
+    qa->cancellable = g_object_ref (cancellable);
+    qa->cancel_src = g_cancellable_source_new (cancellable);
+    g_source_set_callback (qa->cancel_src,
+        (GSourceFunc) _queued_action_cancelled, qa, NULL);
+    g_source_attach (qa->cancel_src, prox->parent->priv->main_context);
+  }
+
+  g_queue_push_tail_link (&prox->pending_actions[priority], &qa->link);
+
+  proxy_dispatch_actions (prox);
+}
+
+static void
+proxy_flush_actions (struct Proxy *prox)
+{
+  struct QueuedAction *qa;
+  guint i;
+
+  while ((qa = g_queue_peek_head (&prox->inflight_actions)))
+  {
+    g_queue_unlink (&prox->inflight_actions, &qa->link);
+    qa->prox = NULL;
+  }
+
+  /* Whatever was not cancelled yet, like removals, is still sent */
+  for (i = 0; i < G_N_ELEMENTS (prox->pending_actions); i++)
+  {
+    while ((qa = g_queue_peek_head (&prox->pending_actions[i])))
+    {
+      g_queue_unlink (&prox->pending_actions[i], &qa->link);
+      queued_action_clear_cancel_src (qa);
+      qa->prox = NULL;
+
+      if (qa->cancellable && g_cancellable_is_cancelled (qa->cancellable))
+        queued_action_return_cancelled (qa);
+      else
+        queued_action_send (qa);
+    }
+  }
+}
+
+static void
+_service_proxy_delete_port_mapping (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  GUPnPServiceProxyAction *action;
+  GError *error = NULL;
+  GUPnPSimpleIgd *self = user_data;
+
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  if (action == NULL ||
+      !gupnp_service_proxy_action_get_result (action, &error, NULL)) {
+    g_return_if_fail (error);
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Error deleting port mapping: %s", error->message);
+  }
+
+  if (action)
+    gupnp_service_proxy_action_unref (action);
+
+  deletion_done (self, 1, error);
+  g_clear_error (&error);
+  g_object_unref (self);
+}
+
+static void
+free_proxymapping (struct ProxyMapping *pm, GUPnPSimpleIgd *self)
+{
+  guint i;
+
+  stop_proxymapping (pm, TRUE);
+
+  if (pm->pending)
+    g_queue_unlink (&pm->proxy->pending_mapped, &pm->pending_link);
+
+  if (pm->waiting_scan)
+    g_queue_unlink (&pm->proxy->scan_waiting, &pm->scan_link);
+
+  if (pm->waiting_delete)
+    g_queue_unlink (&pm->proxy->delete_waiting, &pm->scan_link);
+
+  if (pm->refused)
+    g_queue_unlink (&pm->proxy->refused, &pm->refused_link);
+
+  if (pm->mapped && self)
+    proxy_delete_port_mapping (pm->proxy, pm->mapping->protocol,
+        pm->actual_external_port);
+
+  for (i = 0; self && i < pm->mapping->n_ports; i++)
+    if (pm->ports[i].mapped)
+      proxy_delete_port_mapping (pm->proxy, pm->mapping->protocol,
+          pm->actual_external_port + i);
+
+  g_free (pm->ports);
+  g_clear_error (&pm->range_error);
+  g_slice_free (struct ProxyMapping, pm);
+}
+
+static void
+free_proxy (struct Proxy *prox)
+{
+  GError error = {GUPNP_SIMPLE_IGD_ERROR,
+                  GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED,
+                  "The router went away"};
+  GArray *returns = task_returns_new ();
+
+  g_cancellable_cancel (prox->external_ip_cancellable);
+  g_clear_object (&prox->external_ip_cancellable);
+
+  if (prox->external_ip_retry_src)
+  {
+    g_source_destroy (prox->external_ip_retry_src);
+    g_source_unref (prox->external_ip_retry_src);
+  }
+
+  g_cancellable_cancel (prox->scan_cancellable);
+  g_clear_object (&prox->scan_cancellable);
+
+  if (prox->scan_timeout_src)
+  {
+    g_source_destroy (prox->scan_timeout_src);
+    g_source_unref (prox->scan_timeout_src);
+  }
+
+  if (prox->cache_validation_src)
+  {
+    g_source_destroy (prox->cache_validation_src);
+    g_source_unref (prox->cache_validation_src);
+  }
+
+  g_cancellable_cancel (prox->status_cancellable);
+  g_clear_object (&prox->status_cancellable);
+
+  if (!prox->standby)
+    gupnp_service_proxy_remove_notify (prox->proxy, "ExternalIPAddress",
+        _external_ip_address_changed, prox);
+
+  if (prox->watching_status)
+    gupnp_service_proxy_remove_notify (prox->proxy, "ConnectionStatus",
+        _connection_status_changed, prox);
+
+  while (!g_queue_is_empty (&prox->proxymappings))
+  {
+    struct ProxyMapping *pm = g_queue_peek_head (&prox->proxymappings);
+    struct Mapping *mapping = pm->mapping;
+    gboolean failed = pm->failed;
+
+    g_queue_unlink (&prox->proxymappings, &pm->proxy_link);
+    g_queue_unlink (&mapping->proxymappings, &pm->mapping_link);
+    free_proxymapping (pm, NULL);
+
+    /* Fail the task if this was the last router it was waiting for */
+    if (!failed)
+      mapping_add_task_error (mapping, &error);
+    mapping_take_task_failed (mapping, returns);
+  }
+
+  proxy_flush_actions (prox);
+
+  g_hash_table_unref (prox->used_ports);
+  g_clear_pointer (&prox->port_table, g_hash_table_unref);
+  g_clear_pointer (&prox->stale_deletes, g_hash_table_unref);
+  g_free (prox->external_ip);
+  g_object_unref (prox->proxy);
+  g_slice_free (struct Proxy, prox);
+
+  task_returns_flush (returns);
+}
+
+static void
+free_mapping (GUPnPSimpleIgd *self, struct Mapping *mapping)
+{
+  GTask *task = mapping_steal_task (mapping);
+  GUPnPIgdMapping *handle = mapping_get_handle (mapping);
+
+  while (!g_queue_is_empty (&mapping->proxymappings))
+  {
+    struct ProxyMapping *pm = g_queue_peek_head (&mapping->proxymappings);
+
+    g_queue_unlink (&mapping->proxymappings, &pm->mapping_link);
+    g_queue_unlink (&pm->proxy->proxymappings, &pm->proxy_link);
+    free_proxymapping (pm, self);
+  }
+
+  g_free (mapping->protocol);
+  g_free (mapping->local_ip);
+  g_free (mapping->description);
+  g_free (mapping->router_description);
+  g_weak_ref_clear (&mapping->handle);
+  g_slice_free (struct Mapping, mapping);
+
+  if (handle)
+  {
+    _gupnp_igd_mapping_removed (handle);
+    g_object_unref (handle);
+  }
+
+  if (task)
+  {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+        "The mapping was removed");
+    g_object_unref (task);
+  }
+}
+
+static void
+gupnp_simple_igd_finalize (GObject *object)
+{
+  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
+
+  g_source_destroy (self->priv->renew_src);
+  g_source_unref (self->priv->renew_src);
+  g_main_context_unref (self->priv->main_context);
+
+  g_warn_if_fail (self->priv->renew_heap->len == 0);
+  g_ptr_array_free (self->priv->renew_heap, TRUE);
+
+  g_warn_if_fail (self->priv->mappings->len == 0);
+  g_ptr_array_free (self->priv->mappings, TRUE);
+  g_hash_table_unref (self->priv->mappings_by_external);
+  g_hash_table_unref (self->priv->mappings_by_local);
+  g_hash_table_unref (self->priv->mappings_by_id);
+  g_ptr_array_free (self->priv->gateway_probes, TRUE);
+  g_clear_object (&self->priv->gateway);
+
+  g_free (self->priv->instance_tag);
+  g_free (self->priv->discovery_cache);
+  g_clear_pointer (&self->priv->cache, g_key_file_unref);
+  g_object_unref (self->priv->delete_cancellable);
+
+  G_OBJECT_CLASS (gupnp_simple_igd_parent_class)->finalize (object);
+}
+
+static void
+gupnp_simple_igd_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
+
+  switch (prop_id) {
+    case PROP_MAIN_CONTEXT:
+      g_value_set_pointer (value, self->priv->main_context);
+      break;
+    case PROP_RENEWAL_JITTER:
+      g_value_set_uint (value, self->priv->renewal_jitter);
+      break;
+    case PROP_RENEWAL_COALESCE_WINDOW:
+      g_value_set_uint (value, self->priv->renewal_coalesce_window);
+      break;
+    case PROP_MAX_CONCURRENT_ACTIONS:
+      g_value_set_uint (value, self->priv->max_concurrent_actions);
+      break;
+    case PROP_REMAP_ON_IP_CHANGE:
+      g_value_set_boolean (value, self->priv->remap_on_ip_change);
+      break;
+    case PROP_SCAN_PORT_MAPPINGS:
+      g_value_set_boolean (value, self->priv->scan_port_mappings);
+      break;
+    case PROP_INSTANCE_TAG:
+      g_value_set_string (value, self->priv->instance_tag);
+      break;
+    case PROP_DISCOVERY_CACHE:
+      g_value_set_string (value, self->priv->discovery_cache);
+      break;
+    case PROP_PROBE_GATEWAY:
+      g_value_set_boolean (value, self->priv->probe_gateway);
+      break;
+    case PROP_SINGLE_CONTROL_POINT:
+      g_value_set_boolean (value, self->priv->single_control_point);
+      break;
+    case PROP_SINGLE_CONNECTION:
+      g_value_set_boolean (value, self->priv->single_connection);
+      break;
+    case PROP_ROUTING_POLICY:
+      g_value_set_enum (value, self->priv->routing_policy);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+
+}
+
+static void
+gupnp_simple_igd_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
+
+  switch (prop_id) {
+    case PROP_RENEWAL_JITTER:
+      self->priv->renewal_jitter = g_value_get_uint (value);
+      break;
+    case PROP_RENEWAL_COALESCE_WINDOW:
+      self->priv->renewal_coalesce_window = g_value_get_uint (value);
+      break;
+    case PROP_MAX_CONCURRENT_ACTIONS:
+      self->priv->max_concurrent_actions = g_value_get_uint (value);
+      break;
+    case PROP_REMAP_ON_IP_CHANGE:
+      self->priv->remap_on_ip_change = g_value_get_boolean (value);
+      break;
+    case PROP_SCAN_PORT_MAPPINGS:
+      self->priv->scan_port_mappings = g_value_get_boolean (value);
+      break;
+    case PROP_INSTANCE_TAG:
+      self->priv->instance_tag = g_value_dup_string (value);
+      break;
+    case PROP_DISCOVERY_CACHE:
+      self->priv->discovery_cache = g_value_dup_string (value);
+      break;
+    case PROP_PROBE_GATEWAY:
+      self->priv->probe_gateway = g_value_get_boolean (value);
+      break;
+    case PROP_SINGLE_CONTROL_POINT:
+      self->priv->single_control_point = g_value_get_boolean (value);
+      break;
+    case PROP_SINGLE_CONNECTION:
+      self->priv->single_connection = g_value_get_boolean (value);
+      break;
+    case PROP_ROUTING_POLICY:
+      self->priv->routing_policy = g_value_get_enum (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+
+/* Returns the version of the service if it is of the given type, 0 if it
+ * is of another type. The control points look for version 1, but they also
+ * find services with a later version. */
+static guint
+service_version (GUPnPServiceProxy *proxy, const gchar *type_prefix)
+{
+  const gchar *type =
+      gupnp_service_info_get_service_type (GUPNP_SERVICE_INFO (proxy));
+
+  if (!type || !g_str_has_prefix (type, type_prefix))
+    return 0;
+
+  return (guint) g_ascii_strtoull (type + strlen (type_prefix), NULL, 10);
+}
+
+static void
+gupnp_simple_igd_activate_proxy (GUPnPSimpleIgd *self, struct Proxy *prox)
+{
+  guint i;
+
+  prox->standby = FALSE;
+
+  gupnp_simple_igd_gather (self, prox);
+
+  if (self->priv->scan_port_mappings || self->priv->instance_tag)
+  {
+    prox->scanning = TRUE;
+    prox->scan_cancellable = g_cancellable_new ();
+    prox->port_table = g_hash_table_new_full (NULL, NULL, NULL,
+        free_port_entry);
+    prox->scan_timeout_src = g_timeout_source_new (SCAN_TIMEOUT);
+    g_source_set_callback (prox->scan_timeout_src, _scan_timeout, prox,
+        NULL);
+    g_source_attach (prox->scan_timeout_src, self->priv->main_context);
+    proxy_scan_next (prox);
+  }
+
+  for (i = 0; i < self->priv->mappings->len; i++)
+    gupnp_simple_igd_add_proxy_mapping (self, prox,
+        g_ptr_array_index (self->priv->mappings, i));
+
+  g_ptr_array_add(self->priv->service_proxies, prox);
+}
+
+static gboolean
+proxy_same_device (struct Proxy *prox, struct Proxy *other)
+{
+  GUPnPServiceInfo *info = GUPNP_SERVICE_INFO (prox->proxy);
+  GUPnPServiceInfo *other_info = GUPNP_SERVICE_INFO (other->proxy);
+
+  return gupnp_service_info_get_context (info) ==
+      gupnp_service_info_get_context (other_info) &&
+      !strcmp (gupnp_service_info_get_udn (info),
+          gupnp_service_info_get_udn (other_info));
+}
+
+/* All the services of a router come from the same description */
+static gboolean
+proxy_same_router (struct Proxy *prox, struct Proxy *other)
+{
+  GUPnPServiceInfo *info = GUPNP_SERVICE_INFO (prox->proxy);
+  GUPnPServiceInfo *other_info = GUPNP_SERVICE_INFO (other->proxy);
+
+  return gupnp_service_info_get_context (info) ==
+      gupnp_service_info_get_context (other_info) &&
+      !strcmp (gupnp_service_info_get_location (info),
+          gupnp_service_info_get_location (other_info));
+}
+
+/* Returns TRUE if the router is our default gateway, FALSE if it is not,
+ * and with unknown set if the default gateway is not known */
+static gboolean
+proxy_on_default_route (struct Proxy *prox, gboolean *unknown)
+{
+  GUPnPServiceInfo *info = GUPNP_SERVICE_INFO (prox->proxy);
+  GSSDPClient *client = GSSDP_CLIENT (gupnp_service_info_get_context (info));
+  GInetAddress *gateway;
+  GInetAddress *address = NULL;
+  GUri *uri;
+  guint16 port;
+  gboolean on_route = FALSE;
+
+  gateway = gateway_destination (prox->parent,
+      gssdp_client_get_interface (client), &port);
+  *unknown = (gateway == NULL);
+  if (!gateway)
+    return FALSE;
+
+  uri = g_uri_parse (gupnp_service_info_get_location (info), G_URI_FLAGS_NONE,
+      NULL);
+  if (uri && g_uri_get_host (uri))
+    address = g_inet_address_new_from_string (g_uri_get_host (uri));
+
+  if (address)
+  {
+    on_route = g_inet_address_equal (address, gateway);
+    g_object_unref (address);
+  }
+
+  if (uri)
+    g_uri_unref (uri);
+  g_object_unref (gateway);
+
+  return on_route;
+}
+
+static gboolean
+gupnp_simple_igd_knows_default_route (GUPnPSimpleIgd *self)
+{
+  GPtrArray *lists[] = {
+    self->priv->service_proxies,
+    self->priv->standby_proxies
+  };
+  guint i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (lists); i++)
+    for (j = 0; j < lists[i]->len; j++)
+    {
+      gboolean unknown;
+
+      if (proxy_on_default_route (g_ptr_array_index (lists[i], j), &unknown))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Whether the "routing-policy" lets the router be used at all, and if
+ * only while no other router is used */
+static gboolean
+proxy_policy_allows (GUPnPSimpleIgd *self, struct Proxy *prox,
+    gboolean *first, gboolean *off_route)
+{
+  *first =
+      (self->priv->routing_policy == GUPNP_SIMPLE_IGD_ROUTING_POLICY_FIRST);
+  *off_route = FALSE;
+
+  if (self->priv->routing_policy ==
+      GUPNP_SIMPLE_IGD_ROUTING_POLICY_DEFAULT_ROUTE)
+  {
+    gboolean unknown;
+
+    /* Without a known default gateway, or while no router on it is known,
+     * the first router is used */
+    if (!proxy_on_default_route (prox, &unknown))
+    {
+      if (!unknown && gupnp_simple_igd_knows_default_route (self))
+        return FALSE;
+      *first = TRUE;
+      *off_route = !unknown;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Whether the used service other keeps prox from being used according to
+ * the "routing-policy" and "single-connection" properties */
+static gboolean
+proxy_excludes (GUPnPSimpleIgd *self, struct Proxy *prox, gboolean first,
+    struct Proxy *other)
+{
+  return (first && !proxy_same_router (prox, other)) ||
+      (self->priv->single_connection && proxy_same_device (prox, other));
+}
+
+/* Whether a service on standby may be used, a connected one also replaces
+ * the services used as a fallback */
+static gboolean
+gupnp_simple_igd_may_use_proxy (GUPnPSimpleIgd *self, struct Proxy *prox,
+    gboolean replace_fallbacks)
+{
+  gboolean first;
+  gboolean off_route;
+  guint i;
+
+  if (!proxy_policy_allows (self, prox, &first, &off_route))
+    return FALSE;
+
+  for (i = 0; i < self->priv->service_proxies->len; i++)
+  {
+    struct Proxy *other = g_ptr_array_index (self->priv->service_proxies, i);
+
+    if (proxy_excludes (self, prox, first, other) &&
+        !(replace_fallbacks && other->fallback))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Follows the ConnectionStatus events of the service, see
+ * _connection_status_changed() */
+static void
+proxy_watch_status (struct Proxy *prox)
+{
+  if (prox->watching_status)
+    return;
+
+  prox->watching_status = TRUE;
+  gupnp_service_proxy_add_notify (prox->proxy, "ConnectionStatus",
+      G_TYPE_STRING, _connection_status_changed, prox);
+  gupnp_service_proxy_set_subscribed (prox->proxy, TRUE);
+}
+
+/* Puts a used service back on standby, the ports it mapped are deleted
+ * first */
+static void
+gupnp_simple_igd_requeue_proxy (GUPnPSimpleIgd *self, struct Proxy *prox)
+{
+  struct Proxy *standby;
+
+  g_ptr_array_remove_fast (self->priv->service_proxies, prox);
+  proxy_delete_mappings (prox);
+
+  standby = gupnp_simple_igd_add_proxy (self, prox->cp, prox->proxy,
+      prox->direct);
+  if (prox->cache_validation_src)
+  {
+    standby->cache_validation_src =
+        g_timeout_source_new (CACHE_VALIDATION_TIMEOUT);
+    g_source_set_callback (standby->cache_validation_src,
+        _cache_validation_timeout, standby, NULL);
+    g_source_attach (standby->cache_validation_src,
+        self->priv->main_context);
+  }
+
+  free_proxy (prox);
+}
+
+/* Uses a service on standby, it replaces the services used as a fallback
+ * that it competes with, and if it is on the default route, the routers
+ * used while none on it was known */
+static void
+gupnp_simple_igd_use_proxy (GUPnPSimpleIgd *self, struct Proxy *prox,
+    gboolean fallback)
+{
+  GPtrArray *replaced;
+  gboolean first;
+  gboolean off_route;
+  gboolean on_route;
+  guint i;
+
+  proxy_policy_allows (self, prox, &first, &off_route);
+  on_route = (self->priv->routing_policy ==
+      GUPNP_SIMPLE_IGD_ROUTING_POLICY_DEFAULT_ROUTE && !first);
+
+  /* The replaced services delete their ports before the new one maps them,
+   * the two may share the same table on the router */
+  replaced = g_ptr_array_new ();
+  for (i = 0; i < self->priv->service_proxies->len; i++)
+  {
+    struct Proxy *other = g_ptr_array_index (self->priv->service_proxies, i);
+
+    if ((!fallback && other->fallback &&
+            proxy_excludes (self, prox, first, other)) ||
+        (on_route && other->off_route))
+      g_ptr_array_add (replaced, other);
+  }
+  for (i = 0; i < replaced->len; i++)
+    gupnp_simple_igd_requeue_proxy (self, g_ptr_array_index (replaced, i));
+  g_ptr_array_free (replaced, TRUE);
+
+  g_ptr_array_remove_fast (self->priv->standby_proxies, prox);
+  prox->fallback = fallback;
+  prox->off_route = off_route;
+  gupnp_simple_igd_activate_proxy (self, prox);
+
+  /* Tells when it loses its connection */
+  proxy_watch_status (prox);
+}
+
+/* A used service that lost its connection is put back on standby and the
+ * services on standby are asked again which one to use instead */
+static void
+gupnp_simple_igd_lose_proxy (GUPnPSimpleIgd *self, struct Proxy *prox)
+{
+  guint i;
+
+  g_debug ("%s of %s lost its connection",
+      gupnp_service_info_get_service_type (GUPNP_SERVICE_INFO (prox->proxy)),
+      gupnp_service_info_get_location (GUPNP_SERVICE_INFO (prox->proxy)));
+
+  gupnp_simple_igd_requeue_proxy (self, prox);
+
+  for (i = 0; i < self->priv->standby_proxies->len; i++)
+    proxy_request_status (g_ptr_array_index (self->priv->standby_proxies, i));
+}
+
+/* Once every service on standby answered, those that are not connected are
+ * used if nothing connected keeps them from it */
+static void
+gupnp_simple_igd_use_disconnected (GUPnPSimpleIgd *self)
+{
+  guint i;
+
+  if (self->priv->no_new_mappings)
+    return;
+
+  for (i = 0; i < self->priv->standby_proxies->len; i++)
+    if (((struct Proxy *) g_ptr_array_index (self->priv->standby_proxies,
+                i))->status_cancellable)
+      return;
+
+  for (i = 0; i < self->priv->standby_proxies->len;)
+  {
+    struct Proxy *prox = g_ptr_array_index (self->priv->standby_proxies, i);
+
+    if (prox->disconnected &&
+        gupnp_simple_igd_may_use_proxy (self, prox, FALSE))
+    {
+      g_debug ("No connected service, using %s of %s",
+          gupnp_service_info_get_service_type (GUPNP_SERVICE_INFO (
+                  prox->proxy)),
+          gupnp_service_info_get_location (GUPNP_SERVICE_INFO (prox->proxy)));
+      gupnp_simple_igd_use_proxy (self, prox, TRUE);
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+static void
+proxy_set_connected (struct Proxy *prox, gboolean connected)
+{
+  GUPnPSimpleIgd *self = prox->parent;
+
+  if (!connected)
+  {
+    if (!prox->standby)
+      return;
+
+    prox->disconnected = TRUE;
+    proxy_watch_status (prox);
+    gupnp_simple_igd_use_disconnected (self);
+    return;
+  }
+
+  prox->disconnected = FALSE;
+  if (!prox->standby)
+  {
+    prox->fallback = FALSE;
+    return;
+  }
+
+  if (!self->priv->no_new_mappings &&
+      gupnp_simple_igd_may_use_proxy (self, prox, TRUE))
+    gupnp_simple_igd_use_proxy (self, prox, FALSE);
+}
+
+static void
+_connection_status_changed (GUPnPServiceProxy *proxy, const gchar *variable,
+    GValue *value, gpointer user_data)
+{
+  struct Proxy *prox = user_data;
+  const gchar *status;
+
+  g_return_if_fail (G_VALUE_HOLDS_STRING (value));
+
+  status = g_value_get_string (value);
+
+  /* An empty value does not tell, the service is treated as connected like
+   * one that does not implement GetStatusInfo */
+  if (!g_strcmp0 (status, "Connected"))
+    proxy_set_connected (prox, TRUE);
+  else if (status && *status && !prox->standby && !prox->fallback)
+    gupnp_simple_igd_lose_proxy (prox->parent, prox);
+}
+
+static void
+_service_proxy_got_status_info (GObject *source_object,
+    GAsyncResult *res, gpointer user_data)
+{
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  struct Proxy *prox = user_data;
+  GUPnPServiceProxyAction *action;
+  GError *error = NULL;
+  gchar *status = NULL;
+  gboolean connected = TRUE;
+
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  if (action == NULL &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  {
+    g_error_free (error);
+    return;
+  }
+
+  g_clear_object (&prox->status_cancellable);
+
+  /* A service that can not tell is treated as connected */
+  if (action && gupnp_service_proxy_action_get_result (action, &error,
+          "NewConnectionStatus", G_TYPE_STRING, &status, NULL))
+    connected = !g_strcmp0 (status, "Connected");
+  else
+    g_debug ("Could not get the status of %s: %s",
+        gupnp_service_info_get_service_type (GUPNP_SERVICE_INFO (proxy)),
+        error->message);
+
+  if (action)
+    gupnp_service_proxy_action_unref (action);
+  g_clear_error (&error);
+  g_free (status);
+
+  proxy_set_connected (prox, connected);
+}
+
+static void
+proxy_request_status (struct Proxy *prox)
+{
+  GUPnPServiceProxyAction *action;
+
+  if (prox->status_cancellable)
+    return;
+
+  prox->status_cancellable = g_cancellable_new ();
+
+  action = gupnp_service_proxy_action_new ("GetStatusInfo", NULL);
+
+  proxy_call_action (prox, action, ACTION_PRIORITY_HIGH,
+      prox->status_cancellable, _service_proxy_got_status_info, prox);
+}
+
+static struct Proxy *
+gupnp_simple_igd_add_proxy (GUPnPSimpleIgd *self, GUPnPControlPoint *cp,
+    GUPnPServiceProxy *proxy, gboolean direct)
+{
+  struct Proxy *prox;
+
+  prox = g_slice_new0 (struct Proxy);
+
+  prox->parent = self;
+  prox->cp = cp;
+  prox->proxy = g_object_ref (proxy);
+  prox->direct = direct;
+  g_queue_init (&prox->proxymappings);
+  g_queue_init (&prox->pending_mapped);
+  g_queue_init (&prox->pending_actions[ACTION_PRIORITY_HIGH]);
+  g_queue_init (&prox->pending_actions[ACTION_PRIORITY_LOW]);
+  g_queue_init (&prox->inflight_actions);
+  prox->used_ports = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  g_queue_init (&prox->scan_waiting);
+  g_queue_init (&prox->delete_waiting);
+  g_queue_init (&prox->refused);
+  prox->add_any_port_mapping = service_version (proxy,
+      "urn:schemas-upnp-org:service:WANIPConnection:") >= 2;
+  prox->delete_port_mapping_range = prox->add_any_port_mapping;
+
+  if (self->priv->single_connection ||
+      self->priv->routing_policy != GUPNP_SIMPLE_IGD_ROUTING_POLICY_ALL)
+  {
+    prox->standby = TRUE;
+    g_ptr_array_add (self->priv->standby_proxies, prox);
+    proxy_request_status (prox);
+  }
+  else
+  {
+    gupnp_simple_igd_activate_proxy (self, prox);
+  }
+
+  return prox;
+}
+
+/* Removes the proxy, if it was used, another service of the same device,
+ * or with a routing policy another router, may be used instead */
+static void
+gupnp_simple_igd_drop_proxy (GUPnPSimpleIgd *self, struct Proxy *prox)
+{
+  if (prox->standby)
+  {
+    g_ptr_array_remove_fast (self->priv->standby_proxies, prox);
+  }
+  else
+  {
+    guint i;
+
+    g_ptr_array_remove_fast (self->priv->service_proxies, prox);
+
+    for (i = 0; i < self->priv->standby_proxies->len; i++)
+    {
+      struct Proxy *other = g_ptr_array_index (self->priv->standby_proxies,
+          i);
+
+      if (self->priv->routing_policy != GUPNP_SIMPLE_IGD_ROUTING_POLICY_ALL ||
+          proxy_same_device (prox, other))
+        proxy_request_status (other);
+    }
+  }
+
+  free_proxy (prox);
+
+  /* The others may have only waited for the answer of this one */
+  gupnp_simple_igd_use_disconnected (self);
+}
+
+/* Identifies a service of a router seen through a network interface in the
+ * discovery cache */
+static gchar *
+cache_group (GUPnPServiceInfo *info)
+{
+  GSSDPClient *client = GSSDP_CLIENT (gupnp_service_info_get_context (info));
+
+  return g_strdup_printf ("%s %s %s %s", gssdp_client_get_interface (client),
+      gssdp_client_get_network (client), gupnp_service_info_get_udn (info),
+      gupnp_service_info_get_service_type (info));
+}
+
+static void
+gupnp_simple_igd_save_cache (GUPnPSimpleIgd *self)
+{
+  gchar *dir;
+  GError *error = NULL;
+
+  dir = g_path_get_dirname (self->priv->discovery_cache);
+  g_mkdir_with_parents (dir, 0700);
+  g_free (dir);
+
+  if (!g_key_file_save_to_file (self->priv->cache,
+          self->priv->discovery_cache, &error))
+  {
+    g_debug ("Could not write the discovery cache %s: %s",
+        self->priv->discovery_cache, error->message);
+    g_error_free (error);
+  }
+}
+
+static void
+cache_set_string (GKeyFile *cache, const gchar *group, const gchar *key,
+    const gchar *value)
+{
+  g_key_file_set_string (cache, group, key, value ? value : "");
+}
+
+/* Only what is needed to build the proxy again is kept: the location of the
+ * description, the description of the service and its URLs */
+static void
+gupnp_simple_igd_cache_store (GUPnPSimpleIgd *self, GUPnPServiceProxy *proxy)
+{
+  GUPnPServiceInfo *info = GUPNP_SERVICE_INFO (proxy);
+  GSSDPClient *client = GSSDP_CLIENT (gupnp_service_info_get_context (info));
+  gchar *group;
+  gchar *control_url;
+  gchar *cached_control_url;
+
+  if (!self->priv->cache)
+    return;
+
+  control_url = gupnp_service_info_get_control_url (info);
+  if (!control_url)
+    return;
+
+  group = cache_group (info);
+  cached_control_url = g_key_file_get_string (self->priv->cache, group,
+      "control-url", NULL);
+
+  if (g_strcmp0 (control_url, cached_control_url))
+  {
+    gchar *id = gupnp_service_info_get_id (info);
+    gchar *event_url = gupnp_service_info_get_event_subscription_url (info);
+    gchar *scpd_url = gupnp_service_info_get_scpd_url (info);
+
+    cache_set_string (self->priv->cache, group, "interface",
+        gssdp_client_get_interface (client));
+    cache_set_string (self->priv->cache, group, "network",
+        gssdp_client_get_network (client));
+    cache_set_string (self->priv->cache, group, "location",
+        gupnp_service_info_get_location (info));
+    cache_set_string (self->priv->cache, group, "udn",
+        gupnp_service_info_get_udn (info));
+    cache_set_string (self->priv->cache, group, "service-type",
+        gupnp_service_info_get_service_type (info));
+    cache_set_string (self->priv->cache, group, "service-id", id);
+    cache_set_string (self->priv->cache, group, "control-url", control_url);
+    cache_set_string (self->priv->cache, group, "event-url", event_url);
+    cache_set_string (self->priv->cache, group, "scpd-url", scpd_url);
+    gupnp_simple_igd_save_cache (self);
+
+    g_free (id);
+    g_free (event_url);
+    g_free (scpd_url);
+  }
+
+  g_free (cached_control_url);
+  g_free (control_url);
+  g_free (group);
+}
+
+static void
+gupnp_simple_igd_cache_forget (GUPnPSimpleIgd *self,
+    GUPnPServiceProxy *proxy)
+{
+  gchar *group = cache_group (GUPNP_SERVICE_INFO (proxy));
+
+  if (g_key_file_remove_group (self->priv->cache, group, NULL))
+    gupnp_simple_igd_save_cache (self);
+  g_free (group);
+}
+
+static xmlNode *
+xml_child (xmlNode *node, const gchar *name)
+{
+  xmlNode *child;
+
+  if (!node)
+    return NULL;
+
+  for (child = node->children; child; child = child->next)
+    if (child->type == XML_ELEMENT_NODE &&
+        !strcmp ((const gchar *) child->name, name))
+      return child;
+
+  return NULL;
+}
+
+/* The description of the router is not fetched again, the proxy is built
+ * on a description holding only the cached service */
+static GUPnPServiceProxy *
+cache_create_proxy (GKeyFile *cache, const gchar *group,
+    GUPnPContext *gupnp_context)
+{
+  gchar *location = g_key_file_get_string (cache, group, "location", NULL);
+  gchar *udn = g_key_file_get_string (cache, group, "udn", NULL);
+  gchar *type = g_key_file_get_string (cache, group, "service-type", NULL);
+  gchar *id = g_key_file_get_string (cache, group, "service-id", NULL);
+  gchar *control_url = g_key_file_get_string (cache, group, "control-url",
+      NULL);
+  gchar *event_url = g_key_file_get_string (cache, group, "event-url", NULL);
+  gchar *scpd_url = g_key_file_get_string (cache, group, "scpd-url", NULL);
+  GUPnPServiceProxy *proxy = NULL;
+
+  if (location && udn && type && id && control_url && event_url && scpd_url)
+  {
+    gchar *description;
+    xmlDoc *xml;
+
+    description = g_markup_printf_escaped ("<?xml version=\"1.0\"?>"
+        "<root xmlns=\"urn:schemas-upnp-org:device-1-0\"><device>"
+        "<UDN>%s</UDN><serviceList><service>"
+        "<serviceType>%s</serviceType><serviceId>%s</serviceId>"
+        "<controlURL>%s</controlURL><eventSubURL>%s</eventSubURL>"
+        "<SCPDURL>%s</SCPDURL>"
+        "</service></serviceList></device></root>",
+        udn, type, id, control_url, event_url, scpd_url);
+    xml = xmlReadMemory (description, strlen (description), location, NULL,
+        XML_PARSE_NONET);
+    g_free (description);
+
+    if (xml)
+    {
+      GUPnPXMLDoc *doc = gupnp_xml_doc_new (xml);
+      xmlNode *element = xml_child (xml_child (xml_child (
+          xmlDocGetRootElement (xml), "device"), "serviceList"), "service");
+      GUri *url_base = g_uri_parse (location, G_URI_FLAGS_NONE, NULL);
+
+      if (element && url_base)
+        proxy = gupnp_resource_factory_create_service_proxy (
+            gupnp_resource_factory_get_default (), gupnp_context, doc,
+            element, udn, type, location, url_base);
+
+      if (url_base)
+        g_uri_unref (url_base);
+      g_object_unref (doc);
+    }
+  }
+
+  g_free (location);
+  g_free (udn);
+  g_free (type);
+  g_free (id);
+  g_free (control_url);
+  g_free (event_url);
+  g_free (scpd_url);
+
+  return proxy;
+}
+
+static gboolean
+_cache_validation_timeout (gpointer user_data)
+{
+  struct Proxy *prox = user_data;
+  GUPnPSimpleIgd *self = prox->parent;
+
+  g_debug ("Router %s was not found by SSDP, dropping it",
+      gupnp_service_info_get_location (GUPNP_SERVICE_INFO (prox->proxy)));
+
+  /* Otherwise they would stay on it and be added a second time if SSDP
+   * finds it later */
+  proxy_delete_mappings (prox);
+
+  gupnp_simple_igd_cache_forget (self, prox->proxy);
+  gupnp_simple_igd_drop_proxy (self, prox);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+gupnp_simple_igd_add_cached_proxies (GUPnPSimpleIgd *self,
+    GUPnPContext *gupnp_context)
+{
+  GSSDPClient *client = GSSDP_CLIENT (gupnp_context);
+  gchar **groups;
+  guint i;
+
+  if (!self->priv->cache || self->priv->no_new_mappings)
+    return;
+
+  groups = g_key_file_get_groups (self->priv->cache, NULL);
+
+  for (i = 0; groups[i]; i++)
+  {
+    gchar *interface = g_key_file_get_string (self->priv->cache, groups[i],
+        "interface", NULL);
+    gchar *network = g_key_file_get_string (self->priv->cache, groups[i],
+        "network", NULL);
+    GUPnPServiceProxy *proxy = NULL;
+    struct Proxy *prox;
+
+    if (!g_strcmp0 (interface, gssdp_client_get_interface (client)) &&
+        !g_strcmp0 (network, gssdp_client_get_network (client)))
+      proxy = cache_create_proxy (self->priv->cache, groups[i],
+          gupnp_context);
+
+    g_free (interface);
+    g_free (network);
+
+    if (!proxy)
+      continue;
+
+    prox = gupnp_simple_igd_add_proxy (self, NULL, proxy, TRUE);
+    g_object_unref (proxy);
+
+    prox->cache_validation_src =
+        g_timeout_source_new (CACHE_VALIDATION_TIMEOUT);
+    g_source_set_callback (prox->cache_validation_src,
+        _cache_validation_timeout, prox, NULL);
+    g_source_attach (prox->cache_validation_src, self->priv->main_context);
+  }
+
+  g_strfreev (groups);
+}
+
+static struct Proxy *
+gupnp_simple_igd_find_proxy (GUPnPSimpleIgd *self, GUPnPContext *gupnp_context,
+    const gchar *udn, const gchar *service_type)
+{
+  GPtrArray *lists[] = {
+    self->priv->service_proxies,
+    self->priv->standby_proxies
+  };
+  guint l, i;
+
+  for (l = 0; l < G_N_ELEMENTS (lists); l++)
+  {
+    for (i = 0; i < lists[l]->len; i++)
+    {
+      struct Proxy *prox = g_ptr_array_index (lists[l], i);
+      GUPnPServiceInfo *info = GUPNP_SERVICE_INFO (prox->proxy);
+
+      if (gupnp_service_info_get_context (info) == gupnp_context &&
+          !strcmp (gupnp_service_info_get_udn (info), udn) &&
+          !strcmp (gupnp_service_info_get_service_type (info), service_type))
+        return prox;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+free_gateway_probe (struct GatewayProbe *probe)
+{
+  g_cancellable_cancel (probe->cancellable);
+  g_object_unref (probe->cancellable);
+
+  if (probe->recv_src)
+  {
+    g_source_destroy (probe->recv_src);
+    g_source_unref (probe->recv_src);
+  }
+  if (probe->timeout_src)
+  {
+    g_source_destroy (probe->timeout_src);
+    g_source_unref (probe->timeout_src);
+  }
+
+  g_clear_object (&probe->socket);
+  g_object_unref (probe->context);
+  g_object_unref (probe->gateway);
+  g_free (probe->location);
+  g_slice_free (struct GatewayProbe, probe);
+}
+
+/* Reads the default route of the interface from the kernel */
+static GInetAddress *
+default_gateway (const gchar *interface)
+{
+  GInetAddress *gateway = NULL;
+#ifdef __linux__
+  gchar *contents;
+  gchar **lines;
+  guint i;
+
+  if (!interface ||
+      !g_file_get_contents ("/proc/net/route", &contents, NULL, NULL))
+    return NULL;
+
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  /* The first line names the columns, the addresses are in network order
+   * printed as a host integer */
+  for (i = 1; lines[i] && !gateway; i++)
+  {
+    gchar iface[64];
+    guint destination, address, flags;
+
+    if (sscanf (lines[i], "%63s %x %x %x", iface, &destination, &address,
+            &flags) == 4 &&
+        !strcmp (iface, interface) && destination == 0 &&
+        (flags & 0x2) /* RTF_GATEWAY */)
+    {
+      guint32 bytes = address;
+
+      gateway = g_inet_address_new_from_bytes ((const guint8 *) &bytes,
+          G_SOCKET_FAMILY_IPV4);
+    }
+  }
+
+  g_strfreev (lines);
+#endif
+
+  return gateway;
+}
+
+/* The default gateway and the port that its SSDP server listens on */
+static GInetAddress *
+gateway_destination (GUPnPSimpleIgd *self, const gchar *interface,
+    guint16 *port)
+{
+  if (self->priv->gateway)
+  {
+    *port = self->priv->gateway_port;
+    return g_object_ref (self->priv->gateway);
+  }
+
+  *port = SSDP_PORT;
+
+  return default_gateway (interface);
+}
+
+/* Replaces the default gateway of every interface used by the gateway
+ * probe and the routing policy, %NULL restores the real one and a port of
+ * 0 is the SSDP one. The tests point it to a fake router before the
+ * networks are found. */
+void
+_gupnp_simple_igd_set_gateway (GUPnPSimpleIgd *self, const gchar *address,
+    guint16 port)
+{
+  GInetAddress *gateway = NULL;
+
+  g_return_if_fail (GUPNP_IS_SIMPLE_IGD (self));
+
+  if (address)
+  {
+    gateway = g_inet_address_new_from_string (address);
+    g_return_if_fail (gateway != NULL);
+  }
+
+  g_clear_object (&self->priv->gateway);
+  self->priv->gateway = gateway;
+  self->priv->gateway_port = port ? port : SSDP_PORT;
+}
+
+static gboolean
+is_wan_connection (const gchar *service_type)
+{
+  return g_str_has_prefix (service_type,
+      "urn:schemas-upnp-org:service:WANIPConnection:") ||
+      g_str_has_prefix (service_type,
+          "urn:schemas-upnp-org:service:WANPPPConnection:");
+}
+
+/* Adds the WAN connection services of the device and of its embedded
+ * devices that SSDP has not found yet */
+static void
+gupnp_simple_igd_add_probed_device (GUPnPSimpleIgd *self,
+    GUPnPContext *gupnp_context, GUPnPXMLDoc *doc, xmlNode *device,
+    const gchar *location, const GUri *url_base)
+{
+  xmlNode *udn_element = xml_child (device, "UDN");
+  xmlNode *list;
+  xmlNode *node;
+  xmlChar *udn;
+
+  if (!udn_element)
+    return;
+
+  udn = xmlNodeGetContent (udn_element);
+
+  list = xml_child (device, "serviceList");
+  for (node = list ? list->children : NULL; node; node = node->next)
+  {
+    xmlNode *type_element = xml_child (node, "serviceType");
+    xmlChar *type;
+
+    if (!type_element)
+      continue;
+
+    type = xmlNodeGetContent (type_element);
+
+    /* The answer came from the gateway itself, the router needs no
+     * confirmation by SSDP, which may never see it if multicast is
+     * filtered. It also confirms the same router read from the cache. */
+    if (is_wan_connection ((const gchar *) type))
+    {
+      struct Proxy *prox = gupnp_simple_igd_find_proxy (self, gupnp_context,
+          (const gchar *) udn, (const gchar *) type);
+
+      if (!prox)
+      {
+        GUPnPServiceProxy *proxy;
+
+        proxy = gupnp_resource_factory_create_service_proxy (
+            gupnp_resource_factory_get_default (), gupnp_context, doc, node,
+            (const gchar *) udn, (const gchar *) type, location, url_base);
+        gupnp_simple_igd_add_proxy (self, NULL, proxy, TRUE);
+        gupnp_simple_igd_cache_store (self, proxy);
+        g_object_unref (proxy);
+      }
+      else if (prox->cache_validation_src &&
+          !g_strcmp0 (location, gupnp_service_info_get_location (
+                  GUPNP_SERVICE_INFO (prox->proxy))))
+      {
+        g_source_destroy (prox->cache_validation_src);
+        g_source_unref (prox->cache_validation_src);
+        prox->cache_validation_src = NULL;
+      }
+    }
+
+    xmlFree (type);
+  }
+
+  list = xml_child (device, "deviceList");
+  for (node = list ? list->children : NULL; node; node = node->next)
+    if (node->type == XML_ELEMENT_NODE &&
+        !strcmp ((const gchar *) node->name, "device"))
+      gupnp_simple_igd_add_probed_device (self, gupnp_context, doc, node,
+          location, url_base);
+
+  xmlFree (udn);
+}
+
+static void
+_gateway_probe_description (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  struct GatewayProbe *probe = user_data;
+  GUPnPSimpleIgd *self;
+  SoupMessage *msg;
+  GBytes *description;
+  GError *error = NULL;
+
+  description = soup_session_send_and_read_finish (
+      SOUP_SESSION (source_object), res, &error);
+
+  /* The probe is already freed */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  {
+    g_error_free (error);
+    return;
+  }
+
+  self = probe->parent;
+  msg = soup_session_get_async_result_message (SOUP_SESSION (source_object),
+      res);
+
+  if (!description)
+  {
+    g_debug ("Could not fetch the description of the gateway %s: %s",
+        probe->location, error->message);
+    g_error_free (error);
+  }
+  else if (!SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (msg)))
+  {
+    g_debug ("Could not fetch the description of the gateway %s: %s",
+        probe->location, soup_message_get_reason_phrase (msg));
+  }
+  else if (!self->priv->no_new_mappings)
+  {
+    gsize len;
+    const gchar *data = g_bytes_get_data (description, &len);
+    xmlDoc *xml = xmlReadMemory (data, len, probe->location, NULL,
+        XML_PARSE_NONET);
+
+    if (xml)
+    {
+      GUPnPXMLDoc *doc = gupnp_xml_doc_new (xml);
+      xmlNode *root = xmlDocGetRootElement (xml);
+      xmlNode *url_base_element = xml_child (root, "URLBase");
+      xmlChar *url_base_str = NULL;
+      GUri *url_base;
+
+      if (url_base_element)
+        url_base_str = xmlNodeGetContent (url_base_element);
+      url_base = g_uri_parse (url_base_str ?
+          (const gchar *) url_base_str : probe->location,
+          G_URI_FLAGS_NONE, NULL);
+
+      if (url_base)
+      {
+        gupnp_simple_igd_add_probed_device (self, probe->context, doc,
+            xml_child (root, "device"), probe->location, url_base);
+        g_uri_unref (url_base);
+      }
+
+      if (url_base_str)
+        xmlFree (url_base_str);
+      g_object_unref (doc);
+    }
+    else
+    {
+      g_debug ("Could not parse the description of the gateway %s",
+          probe->location);
+    }
+  }
+
+  if (description)
+    g_bytes_unref (description);
+
+  g_ptr_array_remove_fast (self->priv->gateway_probes, probe);
+}
+
+/* Returns the value of the LOCATION header of a positive answer to the
+ * M-SEARCH */
+static gchar *
+msearch_response_location (const gchar *response)
+{
+  gchar **lines = g_strsplit (response, "\r\n", -1);
+  gchar *location = NULL;
+  guint i;
+
+  if (lines[0] && g_str_has_prefix (lines[0], "HTTP/1.") &&
+      strstr (lines[0], " 200 "))
+  {
+    for (i = 1; lines[i] && lines[i][0] && !location; i++)
+      if (!g_ascii_strncasecmp (lines[i], "LOCATION:", 9))
+        location = g_strstrip (g_strdup (lines[i] + 9));
+  }
+
+  g_strfreev (lines);
+
+  return location;
+}
+
+/* Only the gateway itself may answer, and only with a description that it
+ * serves, otherwise any host of the network could send the mappings to a
+ * control URL of its choosing */
+static gboolean
+is_gateway_location (struct GatewayProbe *probe, const gchar *location)
+{
+  GUri *uri = g_uri_parse (location, G_URI_FLAGS_NONE, NULL);
+  GInetAddress *host = NULL;
+  gboolean valid;
+
+  if (uri && g_uri_get_host (uri))
+    host = g_inet_address_new_from_string (g_uri_get_host (uri));
+  valid = host && g_inet_address_equal (host, probe->gateway);
+
+  g_clear_object (&host);
+  if (uri)
+    g_uri_unref (uri);
+
+  return valid;
+}
+
+static gboolean
+_gateway_probe_recv (GSocket *socket, GIOCondition condition,
+    gpointer user_data)
+{
+  struct GatewayProbe *probe = user_data;
+  GSocketAddress *sender = NULL;
+  gchar buffer[2048];
+  gssize len;
+  gboolean from_gateway;
+  SoupMessage *msg;
+
+  len = g_socket_receive_from (socket, &sender, buffer, sizeof (buffer) - 1,
+      NULL, NULL);
+  from_gateway = len > 0 && G_IS_INET_SOCKET_ADDRESS (sender) &&
+      g_inet_address_equal (g_inet_socket_address_get_address (
+              G_INET_SOCKET_ADDRESS (sender)), probe->gateway);
+  g_clear_object (&sender);
+  if (!from_gateway)
+    return G_SOURCE_CONTINUE;
+  buffer[len] = '\0';
+
+  probe->location = msearch_response_location (buffer);
+  if (!probe->location)
+    return G_SOURCE_CONTINUE;
+
+  if (!is_gateway_location (probe, probe->location))
+  {
+    g_debug ("Ignoring the description %s that is not on the gateway",
+        probe->location);
+    g_clear_pointer (&probe->location, g_free);
+    return G_SOURCE_CONTINUE;
+  }
+
+  msg = soup_message_new ("GET", probe->location);
+  if (!msg)
+  {
+    g_clear_pointer (&probe->location, g_free);
+    return G_SOURCE_CONTINUE;
+  }
+
+  g_source_destroy (probe->timeout_src);
+  g_clear_pointer (&probe->timeout_src, g_source_unref);
+  g_clear_pointer (&probe->recv_src, g_source_unref);
+
+  soup_session_send_and_read_async (gupnp_context_get_session (probe->context),
+      msg, G_PRIORITY_DEFAULT, probe->cancellable,
+      _gateway_probe_description, probe);
+  g_object_unref (msg);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+_gateway_probe_timeout (gpointer user_data)
+{
+  struct GatewayProbe *probe = user_data;
+
+  g_debug ("The default gateway did not answer the M-SEARCH");
+
+  g_ptr_array_remove_fast (probe->parent->priv->gateway_probes, probe);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+gupnp_simple_igd_probe_gateway (GUPnPSimpleIgd *self,
+    GUPnPContext *gupnp_context)
+{
+  struct GatewayProbe *probe;
+  GInetAddress *gateway;
+  GSocketAddress *address;
+  guint16 port;
+  gchar *gateway_str;
+  gchar *msearch;
+  GError *error = NULL;
+
+  gateway = gateway_destination (self,
+      gssdp_client_get_interface (GSSDP_CLIENT (gupnp_context)), &port);
+  if (!gateway)
+    return;
+
+  probe = g_slice_new0 (struct GatewayProbe);
+  probe->parent = self;
+  probe->context = g_object_ref (gupnp_context);
+  probe->gateway = gateway;
+  probe->cancellable = g_cancellable_new ();
+
+  gateway_str = g_inet_address_to_string (gateway);
+  msearch = g_strdup_printf ("M-SEARCH * HTTP/1.1\r\n"
+      "HOST: %s:%d\r\n"
+      "MAN: \"ssdp:discover\"\r\n"
+      "ST: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+      "\r\n", gateway_str, port);
+  address = g_inet_socket_address_new (gateway, port);
+
+  probe->socket = g_socket_new (G_SOCKET_FAMILY_IPV4,
+      G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &error);
+  if (!probe->socket ||
+      g_socket_send_to (probe->socket, address, msearch, strlen (msearch),
+          NULL, &error) < 0)
+  {
+    g_debug ("Could not send the M-SEARCH to the gateway %s: %s",
+        gateway_str, error->message);
+    g_error_free (error);
+    free_gateway_probe (probe);
+    goto out;
+  }
+
+  probe->recv_src = g_socket_create_source (probe->socket, G_IO_IN,
+      probe->cancellable);
+  g_source_set_callback (probe->recv_src, (GSourceFunc) _gateway_probe_recv,
+      probe, NULL);
+  g_source_attach (probe->recv_src, self->priv->main_context);
+
+  probe->timeout_src = g_timeout_source_new (GATEWAY_PROBE_TIMEOUT);
+  g_source_set_callback (probe->timeout_src, _gateway_probe_timeout, probe,
+      NULL);
+  g_source_attach (probe->timeout_src, self->priv->main_context);
+
+  g_ptr_array_add (self->priv->gateway_probes, probe);
+
+ out:
+  g_object_unref (address);
+  g_free (gateway_str);
+  g_free (msearch);
+}
+
+static void
+_cp_service_avail (GUPnPControlPoint *cp,
+    GUPnPServiceProxy *proxy,
+    GUPnPSimpleIgd *self)
+{
+  GUPnPServiceInfo *info = GUPNP_SERVICE_INFO (proxy);
+  struct Proxy *direct;
+
+  if (self->priv->no_new_mappings)
+    return;
+
+  /* The proxy built from the cache or by the gateway probe keeps being used
+   * if the router still has the same control URL, its mappings are already
+   * there */
+  direct = gupnp_simple_igd_find_proxy (self,
+      gupnp_service_info_get_context (info), gupnp_service_info_get_udn (info),
+      gupnp_service_info_get_service_type (info));
+  if (direct && direct->direct && !direct->cp)
+  {
+    gchar *control_url = gupnp_service_info_get_control_url (info);
+    gchar *direct_control_url = gupnp_service_info_get_control_url (
+        GUPNP_SERVICE_INFO (direct->proxy));
+    gboolean valid = !g_strcmp0 (control_url, direct_control_url);
+
+    g_free (control_url);
+    g_free (direct_control_url);
+
+    if (valid)
+    {
+      direct->cp = cp;
+      if (direct->cache_validation_src)
+      {
+        g_source_destroy (direct->cache_validation_src);
+        g_source_unref (direct->cache_validation_src);
+        direct->cache_validation_src = NULL;
+      }
+      return;
+    }
+
+    gupnp_simple_igd_drop_proxy (self, direct);
+  }
+
+  gupnp_simple_igd_add_proxy (self, cp, proxy, FALSE);
+  gupnp_simple_igd_cache_store (self, proxy);
+}
+
+
+static void
+_cp_service_unavail (GUPnPControlPoint *cp,
+    GUPnPServiceProxy *proxy,
+    GUPnPSimpleIgd *self)
+{
+  GPtrArray *lists[] = {
+    self->priv->service_proxies,
+    self->priv->standby_proxies
+  };
+  guint l, i;
+
+  for (l = 0; l < G_N_ELEMENTS (lists); l++)
+  {
+    for (i = 0; i < lists[l]->len; i++)
+    {
+      struct Proxy *prox = g_ptr_array_index (lists[l], i);
+
+      if (prox->cp == cp &&
+          !strcmp (gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (proxy)),
+              gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (prox->proxy))))
+      {
+        gupnp_simple_igd_drop_proxy (self, prox);
+        return;
+      }
+    }
+  }
+}
+
+/* Adds the WAN connection services of the device and of its embedded
+ * devices, as if the control point had found them one by one */
+static void
+gupnp_simple_igd_add_device_services (GUPnPSimpleIgd *self,
+    GUPnPControlPoint *cp, GUPnPDeviceInfo *device)
+{
+  GList *services = gupnp_device_info_list_services (device);
+  GList *devices = gupnp_device_info_list_devices (device);
+  GList *item;
+
+  for (item = services; item; item = item->next)
+    if (is_wan_connection (gupnp_service_info_get_service_type (
+                GUPNP_SERVICE_INFO (item->data))))
+      _cp_service_avail (cp, GUPNP_SERVICE_PROXY (item->data), self);
+
+  for (item = devices; item; item = item->next)
+    gupnp_simple_igd_add_device_services (self, cp,
+        GUPNP_DEVICE_INFO (item->data));
+
+  g_list_free_full (services, g_object_unref);
+  g_list_free_full (devices, g_object_unref);
+}
+
+static void
+_cp_device_avail (GUPnPControlPoint *cp,
+    GUPnPDeviceProxy *proxy,
+    GUPnPSimpleIgd *self)
+{
+  gupnp_simple_igd_add_device_services (self, cp, GUPNP_DEVICE_INFO (proxy));
+}
+
+/* The services of all the devices of the router come from the same
+ * description */
+static void
+_cp_device_unavail (GUPnPControlPoint *cp,
+    GUPnPDeviceProxy *proxy,
+    GUPnPSimpleIgd *self)
+{
+  const gchar *location =
+      gupnp_device_info_get_location (GUPNP_DEVICE_INFO (proxy));
+  GPtrArray *lists[] = {
+    self->priv->service_proxies,
+    self->priv->standby_proxies
+  };
+  guint l, i;
+
+  /* Dropping one only moves the last one of the list to its place */
+  for (l = 0; l < G_N_ELEMENTS (lists); l++)
+  {
+    for (i = lists[l]->len; i > 0; i--)
+    {
+      struct Proxy *prox = g_ptr_array_index (lists[l], i - 1);
+
+      if (prox->cp == cp &&
+          !strcmp (location, gupnp_service_info_get_location (
+                  GUPNP_SERVICE_INFO (prox->proxy))))
+        gupnp_simple_igd_drop_proxy (self, prox);
+    }
+  }
+}
+
+static void
+gupnp_simple_igd_add_control_point (GUPnPSimpleIgd *self,
+    GUPnPContext *gupnp_context, const char *target)
+{
+  GUPnPControlPoint *cp;
+
+  cp = gupnp_control_point_new (gupnp_context, target);
+  g_return_if_fail (cp);
+  g_assert (GUPNP_IS_CONTROL_POINT (cp));
+  g_assert (G_IS_OBJECT (self));
+
+  if (self->priv->single_control_point)
+  {
+    g_signal_connect_object (cp, "device-proxy-available",
+        G_CALLBACK (_cp_device_avail), self, 0);
+    g_signal_connect_object (cp, "device-proxy-unavailable",
+        G_CALLBACK (_cp_device_unavail), self, 0);
+  }
+  else
+  {
+    g_signal_connect_object (cp, "service-proxy-available",
+        G_CALLBACK (_cp_service_avail), self, 0);
+    g_signal_connect_object (cp, "service-proxy-unavailable",
+        G_CALLBACK (_cp_service_unavail), self, 0);
+  }
+
+  gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (cp), TRUE);
+
+  gupnp_context_manager_manage_control_point (
+      self->priv->gupnp_context_manager, cp);
+  g_object_unref (cp);
+}
+
+static void
+_context_available (GUPnPContextManager *manager, GUPnPContext *gupnp_context,
+    GUPnPSimpleIgd *self)
+{
+  SoupSession *session;
+  gboolean ignore_context = FALSE;
+
+  g_signal_emit (self, signals[SIGNAL_CONTEXT_AVAILABLE], 0, gupnp_context,
+      &ignore_context);
+
+  if (ignore_context)
+    return;
+
+  session = gupnp_context_get_session (gupnp_context);
+  g_object_set (session, "timeout", SOUP_REQUEST_TIMEOUT, NULL);
+
+  gupnp_simple_igd_add_cached_proxies (self, gupnp_context);
+
+  if (self->priv->probe_gateway)
+    gupnp_simple_igd_probe_gateway (self, gupnp_context);
+
+  /* These also find later versions, like WANIPConnection:2, a control
+   * point for those would only discover the same routers again */
+  if (self->priv->single_control_point)
+  {
+    gupnp_simple_igd_add_control_point (self, gupnp_context,
+        "urn:schemas-upnp-org:device:InternetGatewayDevice:1");
+  }
+  else
+  {
+    gupnp_simple_igd_add_control_point (self, gupnp_context,
+        "urn:schemas-upnp-org:service:WANIPConnection:1");
+    gupnp_simple_igd_add_control_point (self, gupnp_context,
+        "urn:schemas-upnp-org:service:WANPPPConnection:1");
+  }
+}
+
+
+static void
+gupnp_simple_igd_constructed (GObject *object)
+{
+  GUPnPSimpleIgd *self = GUPNP_SIMPLE_IGD_CAST (object);
+
+  self->priv->main_context = g_main_context_get_thread_default ();
+  if (!self->priv->main_context)
+    self->priv->main_context = g_main_context_default ();
+  g_main_context_ref (self->priv->main_context);
+
+  self->priv->renew_src = g_source_new (&renew_source_funcs, sizeof (GSource));
+  g_source_set_callback (self->priv->renew_src, _renew_mappings_timeout, self,
+      NULL);
+  g_source_attach (self->priv->renew_src, self->priv->main_context);
+
+  self->priv->gupnp_context_manager = gupnp_context_manager_create (0);
+
+  g_signal_connect_object (self->priv->gupnp_context_manager,
+      "context-available", G_CALLBACK (_context_available), self, 0);
+
+  if (self->priv->discovery_cache)
+  {
+    GError *error = NULL;
+
+    self->priv->cache = g_key_file_new ();
+    if (!g_key_file_load_from_file (self->priv->cache,
+            self->priv->discovery_cache, G_KEY_FILE_NONE, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("Could not read the discovery cache %s: %s",
+            self->priv->discovery_cache, error->message);
+      g_clear_error (&error);
+    }
+  }
+
+  if (G_OBJECT_CLASS (gupnp_simple_igd_parent_class)->constructed)
+    G_OBJECT_CLASS (gupnp_simple_igd_parent_class)->constructed (object);
+}
+
+/**
+ * gupnp_simple_igd_new:
+ * main context)
+ *
+ * This creates a new #GUPnpSimpleIgd object using the special GMainContext
+ *
+ * Returns: a new #GUPnPSimpleIgd
+ */
+
+GUPnPSimpleIgd *
+gupnp_simple_igd_new (void)
+{
+  return g_object_new (GUPNP_TYPE_SIMPLE_IGD, NULL);
+}
+
+
+/* Takes the tasks of the mappings already mapped on this router now that its
+ * external address is known, or fails them if it could not be found */
+static GArray *
+proxy_take_tasks (struct Proxy *prox, const GError *error)
+{
+  GArray *returns = task_returns_new ();
+  GList *item;
+
+  for (item = prox->proxymappings.head; item; item = item->next)
+  {
+    struct ProxyMapping *pm = item->data;
+
+    if (error)
+      pm->failed = TRUE;
+
+    if (!pm->mapping->task)
+      continue;
+
+    if (error)
+    {
+      mapping_add_task_error (pm->mapping, error);
+      mapping_take_task_failed (pm->mapping, returns);
+    }
+    else if (pm->mapped)
+    {
+      mapping_take_task_mapped (pm->mapping, prox->external_ip,
+          pm->actual_external_port, returns);
+    }
+  }
+
+  return returns;
+}
+
+static void _service_proxy_got_external_ip_address (GObject *source_object,
+    GAsyncResult *res, gpointer user_data);
+
+static void
+proxy_request_external_ip (struct Proxy *prox)
+{
+  GUPnPServiceProxyAction *action;
+
+  g_assert (prox->external_ip_cancellable == NULL);
+  prox->external_ip_cancellable = g_cancellable_new ();
+
   action = gupnp_service_proxy_action_new (
       "GetExternalIPAddress", NULL);
 
-  gupnp_service_proxy_call_action_async (prox->proxy, action,
-      prox->external_ip_cancellable,
-      _service_proxy_got_external_ip_address, prox);
+  proxy_call_action (prox, action, ACTION_PRIORITY_HIGH,
+      prox->external_ip_cancellable,
+      _service_proxy_got_external_ip_address, prox);
+}
+
+static gboolean
+_retry_external_ip (gpointer user_data)
+{
+  struct Proxy *prox = user_data;
+
+  g_source_unref (prox->external_ip_retry_src);
+  prox->external_ip_retry_src = NULL;
+
+  proxy_request_external_ip (prox);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+proxy_schedule_external_ip_retry (struct Proxy *prox)
+{
+  if (prox->external_ip_retry_src)
+    return;
+
+  if (prox->external_ip_retry_delay == 0)
+    prox->external_ip_retry_delay = EXTERNAL_IP_RETRY_MIN_DELAY;
+  else
+    prox->external_ip_retry_delay = MIN (prox->external_ip_retry_delay * 2,
+        EXTERNAL_IP_RETRY_MAX_DELAY);
+
+  prox->external_ip_retry_src =
+      g_timeout_source_new (prox->external_ip_retry_delay);
+  g_source_set_callback (prox->external_ip_retry_src, _retry_external_ip,
+      prox, NULL);
+  g_source_attach (prox->external_ip_retry_src,
+      prox->parent->priv->main_context);
+}
+
+/* Tries again the mappings that were refused or failed because the
+ * router's address could not be found */
+static void
+proxy_retry_refused_mappings (struct Proxy *prox)
+{
+  GList *item;
+
+  for (item = prox->proxymappings.head; item; item = item->next)
+  {
+    struct ProxyMapping *pm = item->data;
+
+    /* Only those whose AddPortMapping failed are really failed */
+    if (pm->mapped || pm->n_mapped || pm->cancellable)
+      pm->failed = FALSE;
+  }
+
+  while ((item = g_queue_pop_head_link (&prox->refused)))
+  {
+    struct ProxyMapping *pm = item->data;
+
+    pm->refused = FALSE;
+    pm->failed = FALSE;
+    proxy_mapping_queue_start (pm);
+  }
+}
+
+/* Makes the router ready, reporting the mappings that were waiting for its
+ * address, or reports the change of address. Takes ownership of ip. */
+static void
+proxy_set_external_ip (struct Proxy *prox, gchar *ip)
+{
+  gchar *old_ip = prox->external_ip;
+  gboolean was_failed = (prox->state == PROXY_STATE_FAILED);
+  GArray *returns;
+
+  if (old_ip && !strcmp (ip, old_ip))
+  {
+    g_free (ip);
+    return;
+  }
+
+  prox->state = PROXY_STATE_READY;
+  prox->external_ip = ip;
+  prox->external_ip_retry_delay = 0;
+
+  if (prox->external_ip_retry_src)
+  {
+    g_source_destroy (prox->external_ip_retry_src);
+    g_source_unref (prox->external_ip_retry_src);
+    prox->external_ip_retry_src = NULL;
+  }
+
+  if (was_failed)
+    proxy_retry_refused_mappings (prox);
+
+  returns = proxy_take_tasks (prox, NULL);
+
+  proxy_emit_external_ip_changed (prox, ip, old_ip);
+  proxy_emit_mapped_external_port (prox, ip, old_ip);
+
+  task_returns_flush (returns);
+  g_free (old_ip);
+}
+
+/* Retries until the address is found. The mappings are only reported as
+ * failed on the first error, not again on every retry. */
+static void
+proxy_set_failed (struct Proxy *prox, GError *error)
+{
+  GArray *returns;
+
+  proxy_schedule_external_ip_retry (prox);
+
+  if (prox->state == PROXY_STATE_FAILED)
+    return;
+
+  prox->state = PROXY_STATE_FAILED;
+
+  returns = proxy_take_tasks (prox, error);
+  proxy_emit_error_mapping_port (prox, error);
+  task_returns_flush (returns);
+}
+
+static void
+_service_proxy_got_external_ip_address (GObject *source_object,
+    GAsyncResult *res, gpointer user_data)
+{
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  struct Proxy *prox = user_data;
+  GUPnPServiceProxyAction *action;
+  GError *error = NULL;
+  gchar *ip = NULL;
+
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  if (action == NULL &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  {
+    g_error_free (error);
+    return;
+  }
+
+  g_clear_object (&prox->external_ip_cancellable);
+
+  if (action == NULL)
+    goto error;
+
+  if (!gupnp_service_proxy_action_get_result (action, &error,
+          "NewExternalIPAddress", G_TYPE_STRING, &ip, NULL)) {
+    gupnp_service_proxy_action_unref (action);
+    goto error;
+  }
+  gupnp_service_proxy_action_unref (action);
+
+  if (!g_hostname_is_ip_address (ip))
+  {
+    GError gerror = {GUPNP_SIMPLE_IGD_ERROR,
+                     GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS,
+                     "Invalid IP address returned by router"};
+
+    g_free (ip);
+    proxy_set_failed (prox, &gerror);
+    return;
+  }
+
+  proxy_set_external_ip (prox, ip);
+
+  return;
+
+error:
+  g_return_if_fail (error);
+  proxy_set_failed (prox, error);
+  g_clear_error (&error);
+}
+
+static void
+gupnp_simple_igd_gather (GUPnPSimpleIgd *self,
+    struct Proxy *prox)
+{
+  proxy_request_external_ip (prox);
+
+  gupnp_service_proxy_add_notify (prox->proxy, "ExternalIPAddress",
+      G_TYPE_STRING, _external_ip_address_changed, prox);
+
+  gupnp_service_proxy_set_subscribed (prox->proxy, TRUE);
+}
+
+static void
+_service_proxy_renewed_port_mapping (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  GUPnPServiceProxyAction *action;
+  struct ProxyMapping *pm = user_data;
+  GUPnPSimpleIgd *self;
+  GUPnPIgdMapping *handle;
+  GError *error = NULL;
+
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  /* pm may be gone already */
+  if (action == NULL &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  {
+    g_error_free (error);
+    return;
+  }
+
+  self = pm->proxy->parent;
+  g_clear_object (&pm->cancellable);
+
+  if (action) {
+    if (gupnp_service_proxy_action_get_result (action, &error, NULL)) {
+      gupnp_service_proxy_action_unref (action);
+      pm->lease_expiry = pm->request_time +
+          (gint64) pm->mapping->lease_duration * G_USEC_PER_SEC;
+      pm->renew_retries = 0;
+      return;
+    }
+    gupnp_service_proxy_action_unref (action);
+  }
+
+  g_return_if_fail (error);
+
+  if (schedule_renewal_retry (self, pm, g_get_monotonic_time ()))
+  {
+    g_clear_error (&error);
+    return;
+  }
+
+  handle = mapping_get_handle (pm->mapping);
+  g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT], error->domain,
+      error, pm->mapping->protocol, pm->mapping->requested_external_port,
+      pm->mapping->local_ip, pm->mapping->local_port,
+      pm->mapping->description);
+  if (handle)
+  {
+    _gupnp_igd_mapping_error (handle, error, FALSE);
+    g_object_unref (handle);
+  }
+  g_clear_error (&error);
+}
+
+/* Creates AddPortMapping, or AddAnyPortMapping which takes the same
+ * arguments, for the port of mapping that is offset ports from its first
+ * one */
+static GUPnPServiceProxyAction *
+add_port_mapping_action_new (struct Mapping *mapping,
+    const gchar *action_name, guint external_port, guint offset)
+{
+  return gupnp_service_proxy_action_new (action_name,
+      "NewRemoteHost", G_TYPE_STRING, "",
+      "NewExternalPort", G_TYPE_UINT, external_port,
+      "NewProtocol", G_TYPE_STRING, mapping->protocol,
+      "NewInternalPort", G_TYPE_UINT, mapping->local_port + offset,
+      "NewInternalClient", G_TYPE_STRING, mapping->local_ip,
+      "NewEnabled", G_TYPE_BOOLEAN, TRUE,
+      "NewPortMappingDescription", G_TYPE_STRING,
+      mapping->router_description,
+      "NewLeaseDuration", G_TYPE_UINT, mapping->lease_duration,
+      NULL);
+}
+
+/* Sends AddPortMapping, or AddAnyPortMapping, for pm */
+static void
+gupnp_simple_igd_call_add_port_mapping (struct ProxyMapping *pm,
+    const gchar *action_name, ActionPriority priority,
+    GAsyncReadyCallback callback)
+{
+  GUPnPServiceProxyAction *action;
+  g_assert (pm);
+  g_return_if_fail (pm->cancellable == NULL);
+  g_assert (pm->proxy);
+  g_assert (pm->mapping);
+
+  pm->cancellable = g_cancellable_new ();
+  pm->request_time = g_get_monotonic_time ();
+
+  action = add_port_mapping_action_new (pm->mapping, action_name,
+      pm->actual_external_port, 0);
+
+  proxy_call_action (pm->proxy, action, priority, pm->cancellable, callback,
+      pm);
+}
+
+static void
+renew_heap_set (GPtrArray *heap, guint i, struct ProxyMapping *pm)
+{
+  g_ptr_array_index (heap, i) = pm;
+  pm->renew_index = i;
+}
+
+static void
+renew_heap_sift_up (GPtrArray *heap, guint i)
+{
+  struct ProxyMapping *pm = g_ptr_array_index (heap, i);
+
+  while (i > 0)
+  {
+    guint parent = (i - 1) / 2;
+    struct ProxyMapping *parent_pm = g_ptr_array_index (heap, parent);
+
+    if (parent_pm->renew_time <= pm->renew_time)
+      break;
+
+    renew_heap_set (heap, i, parent_pm);
+    i = parent;
+  }
+
+  renew_heap_set (heap, i, pm);
+}
+
+static void
+renew_heap_sift_down (GPtrArray *heap, guint i)
+{
+  struct ProxyMapping *pm = g_ptr_array_index (heap, i);
+
+  for (;;)
+  {
+    guint child = 2 * i + 1;
+    struct ProxyMapping *child_pm;
+
+    if (child >= heap->len)
+      break;
+
+    if (child + 1 < heap->len &&
+        ((struct ProxyMapping *) g_ptr_array_index (heap, child + 1))->renew_time <
+        ((struct ProxyMapping *) g_ptr_array_index (heap, child))->renew_time)
+      child++;
+
+    child_pm = g_ptr_array_index (heap, child);
+    if (pm->renew_time <= child_pm->renew_time)
+      break;
+
+    renew_heap_set (heap, i, child_pm);
+    i = child;
+  }
+
+  renew_heap_set (heap, i, pm);
+}
+
+static void
+renew_source_update (GUPnPSimpleIgd *self)
+{
+  GPtrArray *heap = self->priv->renew_heap;
+
+  if (heap->len)
+  {
+    struct ProxyMapping *pm = g_ptr_array_index (heap, 0);
+
+    g_source_set_ready_time (self->priv->renew_src, pm->renew_time);
+  }
+  else
+  {
+    g_source_set_ready_time (self->priv->renew_src, -1);
+  }
+}
+
+static void
+renew_heap_remove (GPtrArray *heap, struct ProxyMapping *pm)
+{
+  guint i = pm->renew_index;
+  struct ProxyMapping *last;
+
+  pm->renew_index = RENEW_NOT_SCHEDULED;
+
+  last = g_ptr_array_remove_index (heap, heap->len - 1);
+  if (last == pm)
+    return;
+
+  renew_heap_set (heap, i, last);
+  renew_heap_sift_up (heap, i);
+  renew_heap_sift_down (heap, last->renew_index);
+}
+
+static void
+schedule_renewal (GUPnPSimpleIgd *self, struct ProxyMapping *pm,
+    gint64 renew_time)
+{
+  GPtrArray *heap = self->priv->renew_heap;
+
+  if (pm->renew_index != RENEW_NOT_SCHEDULED)
+    renew_heap_remove (heap, pm);
+
+  pm->renew_time = renew_time;
+  g_ptr_array_add (heap, pm);
+  pm->renew_index = heap->len - 1;
+  renew_heap_sift_up (heap, pm->renew_index);
+
+  if (pm->renew_index == 0)
+    renew_source_update (self);
+}
+
+static void
+unschedule_renewal (GUPnPSimpleIgd *self, struct ProxyMapping *pm)
+{
+  gboolean was_first = (pm->renew_index == 0);
+
+  if (pm->renew_index == RENEW_NOT_SCHEDULED)
+    return;
+
+  renew_heap_remove (self->priv->renew_heap, pm);
+
+  if (was_first)
+    renew_source_update (self);
+}
+
+static gint64
+renewal_interval (struct ProxyMapping *pm)
+{
+  return (gint64) MAX (pm->mapping->lease_duration / 2, 1) * G_USEC_PER_SEC;
+}
+
+/* Picks when to renew a mapping next: half of the lease from now, moved
+ * earlier by the jitter. If the last batch of renewals on the same router
+ * starts close enough before that, the renewal joins it at a random point
+ * between the start of the batch and its own deadline, so a batch is spread
+ * over its window instead of hitting the router at once. A range is renewed
+ * as a whole, all its ports at once.
+ */
+static gint64
+renewal_deadline (GUPnPSimpleIgd *self, struct ProxyMapping *pm, gint64 now)
+{
+  struct Proxy *prox = pm->proxy;
+  gint64 interval = renewal_interval (pm);
+  gint64 window = (gint64) self->priv->renewal_coalesce_window * 1000;
+  gint64 deadline;
+
+  deadline = now + interval;
+  if (self->priv->renewal_jitter)
+    deadline -= (gint64) (g_random_double () * interval *
+        self->priv->renewal_jitter / 100);
+
+  if (window > 0 &&
+      prox->renew_batch_time > now &&
+      prox->renew_batch_time <= deadline &&
+      deadline - prox->renew_batch_time <= window)
+    deadline = prox->renew_batch_time + (gint64) (g_random_double () *
+        (deadline - prox->renew_batch_time));
+  else
+    prox->renew_batch_time = deadline;
+
+  return deadline;
+}
+
+/* Retries a failed renewal after a delay that doubles with each failure,
+ * half of it random so that all the mappings of a router that dropped a
+ * batch of requests are not retried together. Gives up once the retry
+ * would only be sent after the lease has run out on the router, the
+ * regular renewal scheduled by _renew_mappings_timeout() stays in place.
+ *
+ * Returns: TRUE if a retry was scheduled
+ */
+static gboolean
+schedule_renewal_retry (GUPnPSimpleIgd *self, struct ProxyMapping *pm,
+    gint64 now)
+{
+  gint64 delay = RENEWAL_RETRY_MAX_DELAY;
+
+  if (pm->renew_retries < 6)
+    delay = MIN (delay,
+        (gint64) RENEWAL_RETRY_MIN_DELAY << pm->renew_retries);
+  delay *= 1000;
+  delay = delay / 2 + (gint64) (g_random_double () * delay / 2);
+
+  if (now + delay >= pm->lease_expiry)
+  {
+    pm->renew_retries = 0;
+    return FALSE;
+  }
+
+  pm->renew_retries++;
+  schedule_renewal (self, pm, now + delay);
+
+  return TRUE;
+}
+
+static gboolean
+_renew_mappings_timeout (gpointer user_data)
+{
+  GUPnPSimpleIgd *self = user_data;
+  GPtrArray *heap = self->priv->renew_heap;
+  gint64 now = g_get_monotonic_time ();
+
+  while (heap->len)
+  {
+    struct ProxyMapping *pm = g_ptr_array_index (heap, 0);
+
+    if (pm->renew_time > now)
+      break;
+
+    pm->renew_time = renewal_deadline (self, pm, now);
+    renew_heap_sift_down (heap, 0);
+
+    stop_proxymapping (pm, FALSE);
+
+    /* A retry of a range only sends the ports that failed again */
+    if (pm->mapping->n_ports)
+      proxy_mapping_send_range (pm, ACTION_PRIORITY_LOW,
+          pm->renew_retries > 0);
+    else
+      gupnp_simple_igd_call_add_port_mapping (pm, "AddPortMapping",
+          ACTION_PRIORITY_LOW,
+          _service_proxy_renewed_port_mapping);
+  }
+
+  renew_source_update (self);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+renew_source_dispatch (GSource *source, GSourceFunc callback,
+    gpointer user_data)
+{
+  return callback (user_data);
+}
+
+static GSourceFuncs renew_source_funcs = {
+  NULL,
+  NULL,
+  renew_source_dispatch,
+  NULL
+};
+
+static gpointer
+port_key (const gchar *protocol, guint port)
+{
+  return GUINT_TO_POINTER (
+      (g_ascii_strcasecmp (protocol, "UDP") ? 0 : 1 << 16) | port);
+}
+
+/* Remembers that port is taken on the router, until the entry there is
+ * removed or for one lease, in seconds */
+static void
+proxy_mark_port_used (struct Proxy *prox, const gchar *protocol, guint port,
+    guint lease_duration)
+{
+  gint64 *expiry = g_new (gint64, 1);
+
+  if (lease_duration == 0)
+    lease_duration = USED_PORT_LIFETIME;
+
+  *expiry = g_get_monotonic_time () +
+      (gint64) lease_duration * G_USEC_PER_SEC;
+  g_hash_table_replace (prox->used_ports, port_key (protocol, port), expiry);
+}
+
+static gboolean
+proxy_port_used (struct Proxy *prox, const gchar *protocol, guint port)
+{
+  gpointer key = port_key (protocol, port);
+  gint64 *expiry = g_hash_table_lookup (prox->used_ports, key);
+
+  if (!expiry)
+    return FALSE;
+
+  if (*expiry > g_get_monotonic_time ())
+    return TRUE;
+
+  g_hash_table_remove (prox->used_ports, key);
+  return FALSE;
+}
+
+/* Proposes the next external port for a mapping that did not request a
+ * specific one. The sequence only depends on the local address, port and
+ * protocol, so the same host gets the same port back after a restart and
+ * different hosts forwarding the same local port do not all compete for the
+ * same candidates. Ports known to be taken on the router are skipped.
+ *
+ * Returns: the port, or 0 if every port is known to be taken
+ */
+static guint
+proxy_allocate_port (struct ProxyMapping *pm)
+{
+  struct Mapping *mapping = pm->mapping;
+  guint hash;
+
+  hash = g_str_hash (mapping->local_ip);
+  hash = hash * 31 + mapping->local_port;
+  hash = hash * 31 + g_str_hash (mapping->protocol);
+
+  while (pm->port_candidate < PORT_RANGE_SIZE)
+  {
+    guint port = PORT_RANGE_START + ((guint64) hash +
+        (guint64) pm->port_candidate * PORT_RANGE_STRIDE) % PORT_RANGE_SIZE;
+
+    pm->port_candidate++;
+
+    if (!proxy_port_used (pm->proxy, mapping->protocol, port))
+      return port;
+  }
+
+  return 0;
+}
+
+static void _service_proxy_added_port_mapping (GObject *source_object,
+    GAsyncResult *res, gpointer user_data);
+static void _service_proxy_added_any_port_mapping (GObject *source_object,
+    GAsyncResult *res, gpointer user_data);
+static void _service_proxy_added_range_port (GObject *source_object,
+    GAsyncResult *res, gpointer user_data);
+
+/* Sends AddPortMapping for every port of a range at once, the action
+ * queue of the router pipelines them. A retry only sends the ports whose
+ * last request failed, and keeps the time of the first request as that of
+ * the leases. */
+static void
+proxy_mapping_send_range (struct ProxyMapping *pm, ActionPriority priority,
+    gboolean retry)
+{
+  struct Mapping *mapping = pm->mapping;
+  guint i;
+
+  g_return_if_fail (pm->cancellable == NULL);
+
+  pm->cancellable = g_cancellable_new ();
+  if (!retry)
+    pm->request_time = g_get_monotonic_time ();
+  g_clear_error (&pm->range_error);
+
+  for (i = 0; i < mapping->n_ports; i++)
+  {
+    if (retry && pm->ports[i].done)
+      continue;
+
+    pm->ports[i].done = FALSE;
+    pm->n_sending++;
+    proxy_call_action (pm->proxy,
+        add_port_mapping_action_new (mapping, "AddPortMapping",
+            pm->actual_external_port + i, i),
+        priority, pm->cancellable, _service_proxy_added_range_port,
+        &pm->ports[i]);
+  }
+}
+
+/* Called once every request sent by proxy_mapping_send_range() is
+ * answered. The ports that the router no longer has after a failed
+ * renewal are retried while their lease lasts, and are otherwise counted
+ * as unmapped until the next renewal of the range maps them again.
+ *
+ * Returns: the error to report for the range, only the first one is
+ *  reported until the range is fully mapped again
+ */
+static GError *
+proxy_mapping_range_done (struct ProxyMapping *pm)
+{
+  GUPnPSimpleIgd *self = pm->proxy->parent;
+  struct Mapping *mapping = pm->mapping;
+  gint64 now = g_get_monotonic_time ();
+  gboolean renewing = FALSE;
+  GError *error;
+  guint i;
+
+  g_clear_object (&pm->cancellable);
+
+  for (i = 0; pm->range_error && i < mapping->n_ports; i++)
+    if (pm->ports[i].mapped && !pm->ports[i].done)
+      renewing = TRUE;
+
+  if (renewing && schedule_renewal_retry (self, pm, now))
+  {
+    g_clear_error (&pm->range_error);
+    return NULL;
+  }
+
+  for (i = 0; pm->range_error && i < mapping->n_ports; i++)
+  {
+    if (pm->ports[i].mapped && !pm->ports[i].done)
+    {
+      pm->ports[i].mapped = FALSE;
+      pm->n_mapped--;
+    }
+  }
+
+  pm->lease_expiry = pm->request_time +
+      (gint64) mapping->lease_duration * G_USEC_PER_SEC;
+  pm->renew_retries = 0;
+
+  /* The renewals of a range already mapped are scheduled by
+   * _renew_mappings_timeout() */
+  if (mapping->lease_duration > 0 && pm->n_mapped > 0 &&
+      pm->renew_index == RENEW_NOT_SCHEDULED)
+    schedule_renewal (self, pm, MIN (renewal_deadline (self, pm, now),
+            now + (pm->lease_expiry - now) / 2));
+
+  error = g_steal_pointer (&pm->range_error);
+  if (error && pm->failed)
+    g_clear_error (&error);
+  else if (error)
+    pm->failed = TRUE;
+
+  return error;
+}
+
+/* Sends the request that creates pm on its router. If the mapping can go
+ * on any port and the router implements WANIPConnection:2, it picks a free
+ * port itself with AddAnyPortMapping and the port we propose is only a
+ * hint, so there are no conflicts to retry. The ports of a range are
+ * requested exactly, so that the range stays contiguous.
+ */
+static void
+proxy_mapping_send_add (struct ProxyMapping *pm)
+{
+  if (pm->mapping->n_ports)
+    proxy_mapping_send_range (pm, ACTION_PRIORITY_HIGH, FALSE);
+  else if (pm->mapping->requested_external_port == 0 &&
+      pm->proxy->add_any_port_mapping)
+    gupnp_simple_igd_call_add_port_mapping (pm, "AddAnyPortMapping",
+        ACTION_PRIORITY_HIGH, _service_proxy_added_any_port_mapping);
+  else
+    gupnp_simple_igd_call_add_port_mapping (pm, "AddPortMapping",
+        ACTION_PRIORITY_HIGH, _service_proxy_added_port_mapping);
+}
+
+/* Reports that pm is mapped on its router, either because AddPortMapping
+ * succeeded or because the router already had the same entry. The router
+ * forgets it at lease_expiry unless it is renewed before.
+ */
+static void
+proxy_mapping_mapped (struct ProxyMapping *pm, gint64 lease_expiry)
+{
+  GUPnPSimpleIgd *self = pm->proxy->parent;
+  GArray *returns;
+  GUPnPIgdMapping *handle;
+
+  pm->mapped = TRUE;
+  pm->lease_expiry = lease_expiry;
+  pm->renew_retries = 0;
+
+  returns = task_returns_new ();
+  if (pm->proxy->state == PROXY_STATE_READY)
+  {
+    mapping_take_task_mapped (pm->mapping, pm->proxy->external_ip,
+        pm->actual_external_port, returns);
+  }
+  else if (!pm->pending)
+  {
+    /* Reported by proxy_set_external_ip() once the address is known */
+    g_queue_push_tail_link (&pm->proxy->pending_mapped, &pm->pending_link);
+    pm->pending = TRUE;
+  }
+
+  if (pm->mapping->lease_duration > 0)
+  {
+    gint64 now = g_get_monotonic_time ();
+
+    schedule_renewal (self, pm, MIN (renewal_deadline (self, pm, now),
+            now + (lease_expiry - now) / 2));
+  }
+
+  handle = mapping_get_handle (pm->mapping);
+
+  if (pm->proxy->state == PROXY_STATE_READY)
+  {
+    gchar *external_ip = g_strdup (pm->proxy->external_ip);
+    guint external_port = pm->actual_external_port;
+
+    g_signal_emit (self, signals[SIGNAL_MAPPED_EXTERNAL_PORT], 0,
+        pm->mapping->protocol, pm->proxy->external_ip, NULL,
+        pm->actual_external_port, pm->mapping->local_ip,
+        pm->mapping->local_port, pm->mapping->description);
+
+    if (handle)
+      _gupnp_igd_mapping_mapped (handle, external_ip, external_port);
+    g_free (external_ip);
+  }
+
+  g_clear_object (&handle);
+  task_returns_flush (returns);
+}
+
+/* Handles a failure to map pm, tries another port if the requested one
+ * was taken and the mapping can go anywhere. Takes ownership of error.
+ */
+static void
+proxy_mapping_add_failed (struct ProxyMapping *pm, GError *error)
+{
+  GUPnPSimpleIgd *self = pm->proxy->parent;
+  GArray *returns;
+  GUPnPIgdMapping *handle;
+  gboolean failed;
+
+  /* 718 == ConflictInMappingEntry */
+  if (error->domain == GUPNP_CONTROL_ERROR && error->code == 718)
+  {
+    proxy_mark_port_used (pm->proxy, pm->mapping->protocol,
+        pm->actual_external_port, pm->mapping->lease_duration);
+
+    if (pm->mapping->requested_external_port == 0)
+    {
+      guint port = 0;
+
+      if (++pm->port_conflicts < MAX_PORT_CONFLICTS)
+        port = proxy_allocate_port (pm);
+
+      if (port)
+      {
+        pm->actual_external_port = port;
+        proxy_mapping_send_add (pm);
+        g_error_free (error);
+        return;
+      }
+
+      g_clear_error (&error);
+      g_set_error (&error, GUPNP_SIMPLE_IGD_ERROR,
+          GUPNP_SIMPLE_IGD_ERROR_NO_FREE_PORT,
+          "Could not find a free external port after %u attempts",
+          pm->port_conflicts);
+    }
+  }
+
+  returns = task_returns_new ();
+  pm->failed = TRUE;
+  failed = mapping_all_failed (pm->mapping);
+  mapping_add_task_error (pm->mapping, error);
+  mapping_take_task_failed (pm->mapping, returns);
+  handle = mapping_get_handle (pm->mapping);
+
+  g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT], error->domain,
+      error, pm->mapping->protocol, pm->mapping->requested_external_port,
+      pm->mapping->local_ip, pm->mapping->local_port,
+      pm->mapping->description);
+
+  if (handle)
+  {
+    _gupnp_igd_mapping_error (handle, error, failed);
+    g_object_unref (handle);
+  }
+
+  task_returns_flush (returns);
+  g_error_free (error);
+}
+
+static void
+_service_proxy_added_port_mapping (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  GUPnPServiceProxyAction *action;
+  struct ProxyMapping *pm = user_data;
+  GError *error = NULL;
+
+  /* This is a hack, but wek now that "res" is actually implemented as a GTask,
+   * we're just too lazy to carry our own reference counted structure
+   */
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (G_TASK (res))))
+    return;
+
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  if (action == NULL &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  {
+    g_error_free (error);
+    return;
+  }
+
+  g_clear_object (&pm->cancellable);
+
+  if (action == NULL)
+    goto error;
+
+  if (!gupnp_service_proxy_action_get_result (action, &error, NULL)) {
+    gupnp_service_proxy_action_unref (action);
+    goto error;
+  }
+
+  gupnp_service_proxy_action_unref (action);
+
+  proxy_mapping_mapped (pm, pm->request_time +
+      (gint64) pm->mapping->lease_duration * G_USEC_PER_SEC);
+
+  return;
+
+ error:
+  g_return_if_fail (error);
+  proxy_mapping_add_failed (pm, error);
+}
+
+static void
+_service_proxy_added_any_port_mapping (GObject *source_object,
+    GAsyncResult *res, gpointer user_data)
+{
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  GUPnPServiceProxyAction *action;
+  struct ProxyMapping *pm = user_data;
+  GError *error = NULL;
+  guint reserved_port = 0;
+
+  /* See _service_proxy_added_port_mapping() */
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (G_TASK (res))))
+    return;
+
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  if (action == NULL &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  {
+    g_error_free (error);
+    return;
+  }
+
+  g_clear_object (&pm->cancellable);
+
+  if (action &&
+      gupnp_service_proxy_action_get_result (action, &error,
+          "NewReservedPort", G_TYPE_UINT, &reserved_port,
+          NULL))
+  {
+    gupnp_service_proxy_action_unref (action);
+
+    if (reserved_port)
+      pm->actual_external_port = reserved_port;
+
+    proxy_mapping_mapped (pm, pm->request_time +
+        (gint64) pm->mapping->lease_duration * G_USEC_PER_SEC);
+    return;
+  }
+
+  if (action)
+    gupnp_service_proxy_action_unref (action);
+
+  g_return_if_fail (error);
+
+  /* 401 == Invalid Action, 602 == Optional Action Not Implemented, some
+   * routers claim the v2 service without implementing it */
+  if (error->domain == GUPNP_CONTROL_ERROR &&
+      (error->code == 401 || error->code == 602))
+  {
+    pm->proxy->add_any_port_mapping = FALSE;
+    g_error_free (error);
+    proxy_mapping_send_add (pm);
+    return;
+  }
+
+  proxy_mapping_add_failed (pm, error);
+}
+
+/* Counts the port of a range mapped, or keeps the error. Reports the
+ * progress each time another tenth of the range gets mapped on the router,
+ * and the whole range once all its ports are mapped and the router's
+ * address is known.
+ */
+static void
+_service_proxy_added_range_port (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  GUPnPServiceProxyAction *action;
+  struct RangePort *port = user_data;
+  struct ProxyMapping *pm;
+  struct Mapping *mapping;
+  GUPnPSimpleIgd *self;
+  GError *error = NULL;
+  GError *range_error = NULL;
+  gboolean newly_mapped = FALSE;
+  gboolean progress = FALSE;
+  gchar *external_ip = NULL;
+  struct MappingNotify mn;
+  guint n_mapped;
+
+  /* See _service_proxy_added_port_mapping() */
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (G_TASK (res))))
+    return;
+
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  if (action == NULL &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  {
+    g_error_free (error);
+    return;
+  }
+
+  pm = port->pm;
+  mapping = pm->mapping;
+  self = pm->proxy->parent;
+
+  if (action && gupnp_service_proxy_action_get_result (action, &error, NULL))
+  {
+    port->done = TRUE;
+    if (!port->mapped)
+    {
+      port->mapped = TRUE;
+      pm->n_mapped++;
+      newly_mapped = TRUE;
+    }
+  }
+  else
+  {
+    /* The round of requests must still be completed */
+    if (!error)
+      g_set_error_literal (&error, GUPNP_SIMPLE_IGD_ERROR,
+          GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED, "Could not map the port");
+    if (!pm->range_error)
+      pm->range_error = g_steal_pointer (&error);
+    g_clear_error (&error);
+  }
+
+  if (action)
+    gupnp_service_proxy_action_unref (action);
+
+  if (--pm->n_sending == 0)
+    range_error = proxy_mapping_range_done (pm);
+
+  n_mapped = pm->n_mapped;
+  if (newly_mapped)
+    progress = (n_mapped * 10 / mapping->n_ports !=
+        (n_mapped - 1) * 10 / mapping->n_ports);
+
+  if (newly_mapped && n_mapped == mapping->n_ports)
+  {
+    /* Errors get reported again if it is lost later */
+    pm->failed = FALSE;
+    if (pm->proxy->state == PROXY_STATE_READY)
+      external_ip = g_strdup (pm->proxy->external_ip);
+  }
+
+  if (!progress && !external_ip && !range_error)
+    return;
+
+  /* The handlers may remove the range */
+  port_range_notify_init (&mn, pm);
+
+  if (progress)
+    g_signal_emit (self, signals[SIGNAL_PORT_RANGE_PROGRESS], 0,
+        mn.protocol, mn.actual_external_port, mn.n_ports, n_mapped);
+
+  if (external_ip)
+    g_signal_emit (self, signals[SIGNAL_MAPPED_EXTERNAL_PORT_RANGE], 0,
+        mn.protocol, external_ip, NULL, mn.actual_external_port, mn.n_ports,
+        mn.local_ip, mn.local_port, mn.description);
+
+  if (range_error)
+    g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT_RANGE],
+        range_error->domain, range_error, mn.protocol,
+        mn.requested_external_port, mn.n_ports, mn.local_ip, mn.local_port,
+        mn.description);
+
+  mapping_notify_clear (&mn);
+  g_free (external_ip);
+  g_clear_error (&range_error);
+}
+
+/* An entry of the router's port mapping table, as read at discovery */
+struct PortEntry {
+  gchar *protocol;
+  guint external_port;
+  gchar *internal_client;
+  guint internal_port;
+  gchar *description;
+  guint lease_duration;
+  gboolean adopted;
+};
+
+static void
+free_port_entry (gpointer data)
+{
+  struct PortEntry *entry = data;
+
+  g_free (entry->protocol);
+  g_free (entry->internal_client);
+  g_free (entry->description);
+  g_slice_free (struct PortEntry, entry);
+}
+
+/* Whether a table entry forwards to the same place as mapping, or one of
+ * the ports of a range, and was created with the same description, so most
+ * likely by us earlier. With an instance tag, the entry may also come from
+ * a dead instance, as after a restart, the process id in the tag is then
+ * not ours.
+ */
+static gboolean
+port_entry_matches (struct PortEntry *entry, struct Mapping *mapping)
+{
+  gssize len;
+  gint64 pid;
+
+  if (entry->internal_port < mapping->local_port ||
+      entry->internal_port - mapping->local_port >=
+          MAX (mapping->n_ports, 1) ||
+      g_ascii_strcasecmp (entry->protocol, mapping->protocol) ||
+      strcmp (entry->internal_client, mapping->local_ip))
+    return FALSE;
+
+  if (!mapping->parent->priv->instance_tag)
+    return !g_strcmp0 (entry->description, mapping->router_description);
+
+  len = description_parse_instance (mapping->parent, entry->description,
+      &pid);
+
+  return len >= 0 && strlen (mapping->description) == (gsize) len &&
+      !strncmp (entry->description, mapping->description, len) &&
+      (pid == current_pid () || !pid_is_running (pid));
+}
+
+static void
+proxy_delete_port_mapping (struct Proxy *prox, const gchar *protocol,
+    guint external_port)
+{
+  GUPnPSimpleIgd *self = prox->parent;
+  GUPnPServiceProxyAction *action;
+
+  self->priv->deleting_count++;
+  g_object_ref (self);
+  g_hash_table_remove (prox->used_ports, port_key (protocol, external_port));
+
+  action = gupnp_service_proxy_action_new ("DeletePortMapping",
+      "NewRemoteHost", G_TYPE_STRING, "",
+      "NewExternalPort", G_TYPE_UINT, external_port,
+      "NewProtocol", G_TYPE_STRING, protocol,
+      NULL);
+
+  proxy_call_action (prox, action, ACTION_PRIORITY_HIGH,
+      self->priv->delete_cancellable,
+      _service_proxy_delete_port_mapping, self);
+}
+
+/* Whether the entry of the router's table on one of the ports of pm is
+ * being deleted, see prox->stale_deletes */
+static gboolean
+proxy_mapping_waits_delete (struct ProxyMapping *pm)
+{
+  GHashTable *stale_deletes = pm->proxy->stale_deletes;
+  guint i;
+
+  if (!stale_deletes || g_hash_table_size (stale_deletes) == 0)
+    return FALSE;
+
+  for (i = 0; i < MAX (pm->mapping->n_ports, 1); i++)
+    if (g_hash_table_contains (stale_deletes,
+            port_key (pm->mapping->protocol, pm->actual_external_port + i)))
+      return TRUE;
+
+  return FALSE;
+}
+
+static void
+proxy_mapping_start (struct ProxyMapping *pm)
+{
+  struct Proxy *prox = pm->proxy;
+  struct Mapping *mapping = pm->mapping;
+
+  if (mapping->requested_external_port == 0 && !mapping->n_ports &&
+      proxy_port_used (prox, mapping->protocol, pm->actual_external_port))
+  {
+    guint port = proxy_allocate_port (pm);
+
+    if (port)
+      pm->actual_external_port = port;
+  }
+
+  if (proxy_mapping_waits_delete (pm))
+  {
+    g_queue_push_tail_link (&prox->delete_waiting, &pm->scan_link);
+    pm->waiting_delete = TRUE;
+    return;
+  }
+
+  proxy_mapping_send_add (pm);
+}
+
+struct StaleDelete {
+  GUPnPSimpleIgd *self;
+  GUPnPServiceProxy *proxy;
+  gpointer key;
+};
+
+static void
+_service_proxy_deleted_stale_entry (GObject *source_object,
+    GAsyncResult *res, gpointer user_data)
+{
+  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
+  GUPnPServiceProxyAction *action;
+  struct StaleDelete *sd = user_data;
+  GUPnPSimpleIgd *self = sd->self;
+  GError *error = NULL;
+  guint i;
+
+  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+
+  if (action == NULL ||
+      !gupnp_service_proxy_action_get_result (action, &error, NULL)) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Error deleting stale port mapping: %s", error->message);
+  }
+
+  if (action)
+    gupnp_service_proxy_action_unref (action);
+
+  /* Send the mappings that wanted the port, if the router is still there */
+  for (i = 0; i < self->priv->service_proxies->len; i++)
+  {
+    struct Proxy *prox = g_ptr_array_index (self->priv->service_proxies, i);
+    GList *item, *next;
+
+    if (prox->proxy != sd->proxy || !prox->stale_deletes)
+      continue;
+
+    g_hash_table_remove (prox->stale_deletes, sd->key);
+
+    for (item = prox->delete_waiting.head; item; item = next)
+    {
+      struct ProxyMapping *pm = item->data;
+
+      next = item->next;
+      if (proxy_mapping_waits_delete (pm))
+        continue;
+
+      g_queue_unlink (&prox->delete_waiting, &pm->scan_link);
+      pm->waiting_delete = FALSE;
+      proxy_mapping_send_add (pm);
+    }
+  }
+
+  g_object_unref (sd->proxy);
+  g_slice_free (struct StaleDelete, sd);
+
+  deletion_done (self, 1, error);
+  g_clear_error (&error);
+  g_object_unref (self);
+}
+
+/* Deletes an entry found by the scan, see prox->stale_deletes */
+static void
+proxy_delete_stale_entry (struct Proxy *prox, struct PortEntry *entry)
+{
+  GUPnPSimpleIgd *self = prox->parent;
+  struct StaleDelete *sd = g_slice_new0 (struct StaleDelete);
+  GUPnPServiceProxyAction *action;
+
+  self->priv->deleting_count++;
+  sd->self = g_object_ref (self);
+  sd->proxy = g_object_ref (prox->proxy);
+  sd->key = port_key (entry->protocol, entry->external_port);
+
+  if (!prox->stale_deletes)
+    prox->stale_deletes = g_hash_table_new (NULL, NULL);
+  g_hash_table_add (prox->stale_deletes, sd->key);
+  g_hash_table_remove (prox->used_ports, sd->key);
+
+  action = gupnp_service_proxy_action_new ("DeletePortMapping",
+      "NewRemoteHost", G_TYPE_STRING, "",
+      "NewExternalPort", G_TYPE_UINT, entry->external_port,
+      "NewProtocol", G_TYPE_STRING, entry->protocol,
+      NULL);
+
+  proxy_call_action (prox, action, ACTION_PRIORITY_HIGH,
+      self->priv->delete_cancellable,
+      _service_proxy_deleted_stale_entry, sd);
+}
+
+static gboolean
+port_entry_adoptable (struct PortEntry *entry, struct Mapping *mapping)
+{
+  return !entry->adopted && port_entry_matches (entry, mapping) &&
+      (mapping->lease_duration != 0 || entry->lease_duration == 0);
+}
+
+/* Looks for an entry of the router's table that pm can take over instead
+ * of sending AddPortMapping. A mapping with a lease can take any entry,
+ * its lease will be set again at the first renewal, a permanent one can
+ * only take a permanent entry.
+ */
+static struct PortEntry *
+proxy_find_adoptable_entry (struct ProxyMapping *pm)
+{
+  struct Mapping *mapping = pm->mapping;
+  GHashTableIter iter;
+  struct PortEntry *entry;
+
+  /* Prefer the port we would have asked for */
+  entry = g_hash_table_lookup (pm->proxy->port_table,
+      port_key (mapping->protocol, pm->actual_external_port));
+  if (entry && port_entry_adoptable (entry, mapping))
+    return entry;
+
+  if (mapping->requested_external_port)
+    return NULL;
+
+  g_hash_table_iter_init (&iter, pm->proxy->port_table);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry))
+    if (port_entry_adoptable (entry, mapping))
+      return entry;
+
+  return NULL;
+}
+
+static gint
+current_pid (void)
+{
+#ifdef G_OS_UNIX
+  return getpid ();
+#else
+  return 0;
+#endif
+}
+
+static gboolean
+pid_is_running (gint64 pid)
+{
+#ifdef G_OS_UNIX
+  if (pid > G_MAXINT)
+    return FALSE;
+
+  /* EPERM means it exists but belongs to someone else */
+  return kill ((pid_t) pid, 0) == 0 || errno != ESRCH;
+#else
+  return TRUE;
+#endif
+}
+
+/* Looks for our instance tag and host at the end of a description, as
+ * added by gupnp_simple_igd_new_mapping(), followed by a process id.
+ *
+ * Returns: the length of the description before the tag, or -1 if it does
+ * not have one, with the process id in pid
+ */
+static gssize
+description_parse_instance (GUPnPSimpleIgd *self, const gchar *description,
+    gint64 *pid)
+{
+  const gchar *start;
+  gchar *prefix;
+  gssize len = -1;
+
+  if (!self->priv->instance_tag || !description ||
+      !g_str_has_suffix (description, "]"))
+    return -1;
+
+  start = g_strrstr (description, " [");
+  if (!start)
+    return -1;
+
+  prefix = g_strdup_printf ("%s:%s:", self->priv->instance_tag,
+      g_get_host_name ());
+
+  if (g_str_has_prefix (start + 2, prefix))
+  {
+    const gchar *pid_str = start + 2 + strlen (prefix);
+    gchar *end = NULL;
+
+    *pid = g_ascii_strtoll (pid_str, &end, 10);
+    if (end != pid_str && !strcmp (end, "]") && *pid > 0)
+      len = start - description;
+  }
+
+  g_free (prefix);
+
+  return len;
+}
+
+/* Whether a description ends with our instance tag and host, followed by
+ * the id of another process that is not running anymore */
+static gboolean
+description_from_dead_instance (GUPnPSimpleIgd *self,
+    const gchar *description)
+{
+  gint64 pid;
+
+  return description_parse_instance (self, description, &pid) >= 0 &&
+      pid != current_pid () && !pid_is_running (pid);
+}
+
+/* Called once the table of the router has been read. Mappings that are
+ * already on the router, also those added by a dead instance with the same
+ * tag, are reported as mapped right away, entries that
+ * duplicate one of our mappings on another external port or carry the tag
+ * of a dead instance are left over from an earlier run and get deleted,
+ * and ports known to be taken by someone else are not even asked for.
+ * A mapping that wants the port of a deleted entry waits for the deletion.
+ */
+static void
+proxy_scan_done (struct Proxy *prox)
+{
+  GUPnPSimpleIgd *self = prox->parent;
+  GHashTableIter iter;
+  struct PortEntry *entry;
+  GList *item;
+  GList *link;
+
+  prox->scanning = FALSE;
+  g_cancellable_cancel (prox->scan_cancellable);
+  g_clear_object (&prox->scan_cancellable);
+
+  if (prox->scan_timeout_src)
+  {
+    g_source_destroy (prox->scan_timeout_src);
+    g_source_unref (prox->scan_timeout_src);
+    prox->scan_timeout_src = NULL;
+  }
+
+  for (item = prox->scan_waiting.head; item; item = item->next)
+  {
+    struct ProxyMapping *pm = item->data;
+
+    /* A range is simply added again over the entries it left */
+    if (pm->mapping->n_ports)
+      continue;
+
+    entry = proxy_find_adoptable_entry (pm);
+    if (entry)
+    {
+      entry->adopted = TRUE;
+      pm->actual_external_port = entry->external_port;
+      pm->adopted = TRUE;
+    }
+  }
+
+  g_hash_table_iter_init (&iter, prox->port_table);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry))
+  {
+    if (entry->adopted)
+      continue;
+
+    if (description_from_dead_instance (self, entry->description))
+    {
+      proxy_delete_stale_entry (prox, entry);
+      g_hash_table_iter_remove (&iter);
+      continue;
+    }
+
+    for (item = prox->proxymappings.head; item; item = item->next)
+    {
+      struct ProxyMapping *pm = item->data;
+
+      /* Already on the right port of the range */
+      if (pm->mapping->n_ports &&
+          entry->external_port + pm->mapping->local_port ==
+              pm->actual_external_port + entry->internal_port)
+        continue;
+
+      if (port_entry_matches (entry, pm->mapping))
+      {
+        proxy_delete_stale_entry (prox, entry);
+        g_hash_table_iter_remove (&iter);
+        break;
+      }
+    }
+  }
+
+  /* Signal handlers may remove mappings or dispose of us */
+  g_object_ref (self);
+  while ((link = g_queue_pop_head_link (&prox->scan_waiting)))
+  {
+    struct ProxyMapping *pm = link->data;
+    struct Mapping *mapping = pm->mapping;
+
+    pm->waiting_scan = FALSE;
+
+    if (mapping->n_ports)
+    {
+      proxy_mapping_start (pm);
+    }
+    else if (pm->adopted)
+    {
+      gint64 now = g_get_monotonic_time ();
+
+      entry = g_hash_table_lookup (prox->port_table,
+          port_key (mapping->protocol, pm->actual_external_port));
+      pm->request_time = now;
+      if (entry->lease_duration)
+        proxy_mapping_mapped (pm,
+            now + (gint64) entry->lease_duration * G_USEC_PER_SEC);
+      else
+        proxy_mapping_mapped (pm,
+            now + (gint64) mapping->lease_duration * G_USEC_PER_SEC);
+    }
+    else if ((entry = g_hash_table_lookup (prox->port_table,
+                port_key (mapping->protocol, pm->actual_external_port))))
+    {
+      proxy_mapping_add_failed (pm, g_error_new (GUPNP_CONTROL_ERROR, 718,
+              "Port %u is already mapped to %s:%u", entry->external_port,
+              entry->internal_client, entry->internal_port));
+    }
+    else
+    {
+      proxy_mapping_start (pm);
+    }
+  }
+
+  g_clear_pointer (&prox->port_table, g_hash_table_unref);
+  g_object_unref (self);
+}
+
+/* A large table is not worth delaying the mappings for, those that are in
+ * the entries read so far are still found */
+static gboolean
+_scan_timeout (gpointer user_data)
+{
+  struct Proxy *prox = user_data;
+
+  g_debug ("Reading the table of %s took too long, stopping after %u "
+      "entries", gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (prox->proxy)),
+      prox->scan_index);
+
+  proxy_scan_done (prox);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+proxy_scan_next (struct Proxy *prox)
+{
+  GUPnPServiceProxyAction *action;
 
-  gupnp_service_proxy_add_notify (prox->proxy, "ExternalIPAddress",
-      G_TYPE_STRING, _external_ip_address_changed, prox);
+  action = gupnp_service_proxy_action_new ("GetGenericPortMappingEntry",
+      "NewPortMappingIndex", G_TYPE_UINT, prox->scan_index,
+      NULL);
 
-  gupnp_service_proxy_set_subscribed (prox->proxy, TRUE);
+  proxy_call_action (prox, action, ACTION_PRIORITY_HIGH,
+      prox->scan_cancellable, _service_proxy_got_port_mapping_entry, prox);
 }
 
 static void
-_service_proxy_renewed_port_mapping (GObject *source_object, GAsyncResult *res,
-    gpointer user_data)
+_service_proxy_got_port_mapping_entry (GObject *source_object,
+    GAsyncResult *res, gpointer user_data)
 {
   GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
   GUPnPServiceProxyAction *action;
-  struct ProxyMapping *pm = user_data;
-  GUPnPSimpleIgd *self = pm->proxy->parent;
+  struct Proxy *prox = user_data;
+  struct PortEntry *entry;
   GError *error = NULL;
 
   action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
 
   if (action == NULL &&
       g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+  {
+    g_error_free (error);
     return;
+  }
 
-  g_clear_object (&pm->cancellable);
+  entry = g_slice_new0 (struct PortEntry);
 
-  if (action) {
-    if (gupnp_service_proxy_action_get_result (action, &error, NULL)) {
+  /* 713 == SpecifiedArrayIndexInvalid, the end of the table, any other
+   * error also ends the scan as there is no way to skip an entry */
+  if (action == NULL ||
+      !gupnp_service_proxy_action_get_result (action, &error,
+          "NewExternalPort", G_TYPE_UINT, &entry->external_port,
+          "NewProtocol", G_TYPE_STRING, &entry->protocol,
+          "NewInternalPort", G_TYPE_UINT, &entry->internal_port,
+          "NewInternalClient", G_TYPE_STRING, &entry->internal_client,
+          "NewPortMappingDescription", G_TYPE_STRING, &entry->description,
+          "NewLeaseDuration", G_TYPE_UINT, &entry->lease_duration,
+          NULL))
+  {
+    g_clear_error (&error);
+    free_port_entry (entry);
+    if (action)
       gupnp_service_proxy_action_unref (action);
-      return;
-    }
-    gupnp_service_proxy_action_unref (action);
+    proxy_scan_done (prox);
+    return;
   }
 
-  g_return_if_fail (error);
-  g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT], error->domain,
-      error, pm->mapping->protocol, pm->mapping->requested_external_port,
-      pm->mapping->local_ip, pm->mapping->local_port,
-      pm->mapping->description);
-  g_clear_error (&error);
+  gupnp_service_proxy_action_unref (action);
+
+  if (entry->protocol && entry->internal_client && entry->external_port)
+  {
+    proxy_mark_port_used (prox, entry->protocol, entry->external_port,
+        entry->lease_duration);
+    g_hash_table_replace (prox->port_table,
+        port_key (entry->protocol, entry->external_port), entry);
+  }
+  else
+  {
+    free_port_entry (entry);
+  }
+
+  if (++prox->scan_index < MAX_SCANNED_ENTRIES)
+    proxy_scan_next (prox);
+  else
+    proxy_scan_done (prox);
 }
 
 static void
-gupnp_simple_igd_call_add_port_mapping (struct ProxyMapping *pm,
-    GAsyncReadyCallback callback)
+proxy_mapping_queue_start (struct ProxyMapping *pm)
 {
-  GUPnPServiceProxyAction *action;
-  g_assert (pm);
-  g_return_if_fail (pm->cancellable == NULL);
-  g_assert (pm->proxy);
-  g_assert (pm->mapping);
-
-  pm->cancellable = g_cancellable_new ();
-
-  action = gupnp_service_proxy_action_new ("AddPortMapping",
-      "NewRemoteHost", G_TYPE_STRING, "",
-      "NewExternalPort", G_TYPE_UINT, pm->actual_external_port,
-      "NewProtocol", G_TYPE_STRING, pm->mapping->protocol,
-      "NewInternalPort", G_TYPE_UINT, pm->mapping->local_port,
-      "NewInternalClient", G_TYPE_STRING, pm->mapping->local_ip,
-      "NewEnabled", G_TYPE_BOOLEAN, TRUE,
-      "NewPortMappingDescription", G_TYPE_STRING, pm->mapping->description,
-      "NewLeaseDuration", G_TYPE_UINT, pm->mapping->lease_duration,
-      NULL);
+  struct Proxy *prox = pm->proxy;
 
-  gupnp_service_proxy_call_action_async (pm->proxy->proxy, action,
-      pm->cancellable, callback, pm);
+  /* Started by proxy_scan_done() once the router's table is known */
+  if (prox->scanning)
+  {
+    g_queue_push_tail_link (&prox->scan_waiting, &pm->scan_link);
+    pm->waiting_scan = TRUE;
+  }
+  else
+  {
+    proxy_mapping_start (pm);
+  }
 }
 
-static gboolean
-_renew_mapping_timeout (gpointer user_data)
+static void
+gupnp_simple_igd_add_proxy_mapping (GUPnPSimpleIgd *self, struct Proxy *prox,
+    struct Mapping *mapping)
 {
-  struct ProxyMapping *pm = user_data;
+  struct ProxyMapping *pm = g_slice_new0 (struct ProxyMapping);
+  guint i;
+
+  pm->proxy = prox;
+  pm->mapping = mapping;
+  pm->proxy_link.data = pm;
+  pm->mapping_link.data = pm;
+  pm->pending_link.data = pm;
+  pm->scan_link.data = pm;
+  pm->renew_index = RENEW_NOT_SCHEDULED;
 
-  stop_proxymapping (pm, FALSE);
+  if (mapping->requested_external_port)
+    pm->actual_external_port = mapping->requested_external_port;
+  else
+    pm->actual_external_port = mapping->local_port;
 
-  gupnp_simple_igd_call_add_port_mapping (pm,
-      _service_proxy_renewed_port_mapping);
+  if (mapping->n_ports)
+  {
+    pm->ports = g_new0 (struct RangePort, mapping->n_ports);
+    for (i = 0; i < mapping->n_ports; i++)
+      pm->ports[i].pm = pm;
+  }
 
-  return TRUE;
+  /* Started by proxy_retry_refused_mappings() once the address is found */
+  if (prox->state == PROXY_STATE_FAILED)
+  {
+    g_queue_push_tail_link (&prox->refused, &pm->refused_link);
+    pm->refused = TRUE;
+    pm->failed = TRUE;
+  }
+  else
+  {
+    proxy_mapping_queue_start (pm);
+  }
+
+  g_queue_push_tail_link (&prox->proxymappings, &pm->proxy_link);
+  g_queue_push_tail_link (&mapping->proxymappings, &pm->mapping_link);
 }
 
-static void
-_service_proxy_added_port_mapping (GObject *source_object, GAsyncResult *res,
-    gpointer user_data)
+static gboolean
+_mapping_cancelled (GCancellable *cancellable, gpointer user_data)
 {
-  GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source_object);
-  GUPnPServiceProxyAction *action;
-  struct ProxyMapping *pm = user_data;
-  GUPnPSimpleIgd *self;
-  GError *error = NULL;
-
-  /* This is a hack, but wek now that "res" is actually implemented as a GTask,
-   * we're just too lazy to carry our own reference counted structure
-   */
-  if (g_cancellable_is_cancelled (g_task_get_cancellable (G_TASK (res))))
-    return;
+  struct Mapping *mapping = user_data;
 
-  action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+  /* This also cancels the AddPortMapping actions still in flight and
+   * returns the task */
+  remove_mapping (mapping->parent, mapping);
 
-  if (action == NULL &&
-      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-    return;
+  return G_SOURCE_REMOVE;
+}
 
-  self = pm->proxy->parent;
-  g_clear_object (&pm->cancellable);
+static void
+gupnp_simple_igd_new_mapping (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description,
+    GTask *task,
+    GUPnPIgdMapping *handle,
+    guint n_ports)
+{
+  struct Mapping *mapping = g_slice_new0 (struct Mapping);
+  gboolean all_refused = TRUE;
+  GArray *returns;
+  guint i;
 
-  if (action == NULL)
-    goto error;
+  mapping->parent = self;
+  mapping->protocol = g_strdup (protocol);
+  mapping->requested_external_port = external_port;
+  mapping->local_ip = g_strdup (local_ip);
+  mapping->local_port = local_port;
+  mapping->lease_duration = lease_duration;
+  mapping->description = g_strdup (description);
+  mapping->n_ports = n_ports;
+  mapping->task = task;
+  g_queue_init (&mapping->proxymappings);
 
-  if (!gupnp_service_proxy_action_get_result (action, &error, NULL)) {
-    gupnp_service_proxy_action_unref (action);
-    goto error;
+  if (handle)
+  {
+    mapping->id = _gupnp_igd_mapping_get_id (handle);
+    g_weak_ref_set (&mapping->handle, handle);
   }
 
-  gupnp_service_proxy_action_unref (action);
+  if (!mapping->description)
+    mapping->description = g_strdup ("");
 
-  pm->mapped = TRUE;
+  if (self->priv->instance_tag)
+    mapping->router_description = g_strdup_printf ("%s [%s:%s:%d]",
+        mapping->description, self->priv->instance_tag, g_get_host_name (),
+        current_pid ());
+  else
+    mapping->router_description = g_strdup (mapping->description);
 
-  if (pm->proxy->external_ip)
-    g_signal_emit (self, signals[SIGNAL_MAPPED_EXTERNAL_PORT], 0,
-        pm->mapping->protocol, pm->proxy->external_ip, NULL,
-        pm->actual_external_port, pm->mapping->local_ip,
-        pm->mapping->local_port, pm->mapping->description);
+  add_mapping (self, mapping);
 
-  if (pm->mapping->lease_duration > 0)
+  if (task && g_task_get_cancellable (task))
   {
-    pm->renew_src =
-      g_timeout_source_new_seconds (pm->mapping->lease_duration / 2);
-    g_source_set_callback (pm->renew_src,
-        _renew_mapping_timeout, pm, NULL);
-    g_source_attach (pm->renew_src, self->priv->main_context);
+    mapping->cancel_src =
+        g_cancellable_source_new (g_task_get_cancellable (task));
+    g_source_set_callback (mapping->cancel_src,
+        (GSourceFunc) _mapping_cancelled, mapping, NULL);
+    g_source_attach (mapping->cancel_src, self->priv->main_context);
   }
 
-  return;
+  for (i=0; i < self->priv->service_proxies->len; i++)
+  {
+    struct Proxy *prox = g_ptr_array_index (self->priv->service_proxies, i);
 
- error:
+    if (prox->state != PROXY_STATE_FAILED)
+      all_refused = FALSE;
+  }
+
+  for (i=0; i < self->priv->service_proxies->len; i++)
   {
-    g_return_if_fail (error);
+    struct Proxy *prox = g_ptr_array_index (self->priv->service_proxies, i);
 
-    /* 718 == ConflictInMappingEntry */
-    if (pm->mapping->requested_external_port == 0 &&
-        error->domain == GUPNP_CONTROL_ERROR && error->code == 718)
+    if (prox->state == PROXY_STATE_FAILED)
     {
-      /* The previous port was already used, lets pick another random port */
-      pm->actual_external_port = g_random_int_range (1025, 65535);
+      GError error = {GUPNP_SIMPLE_IGD_ERROR,
+                      GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS,
+                      "Could not get external address"};
 
-      gupnp_simple_igd_call_add_port_mapping (pm,
-          _service_proxy_added_port_mapping);
-    }
-    else
-    {
-      g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT], error->domain,
-          error, pm->mapping->protocol, pm->mapping->requested_external_port,
-          pm->mapping->local_ip, pm->mapping->local_port,
-          pm->mapping->description);
+      if (n_ports)
+      {
+        g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT_RANGE],
+            GUPNP_SIMPLE_IGD_ERROR, &error, mapping->protocol,
+            mapping->requested_external_port, n_ports, mapping->local_ip,
+            mapping->local_port, mapping->description);
+      }
+      else
+      {
+        mapping_add_task_error (mapping, &error);
+        g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT],
+            GUPNP_SIMPLE_IGD_ERROR,
+            &error, mapping->protocol, mapping->requested_external_port,
+            mapping->local_ip, mapping->local_port,
+            mapping->description);
+        if (handle)
+          _gupnp_igd_mapping_error (handle, &error, all_refused);
+      }
     }
+
+    gupnp_simple_igd_add_proxy_mapping (self, prox, mapping);
   }
-  g_clear_error (&error);
+
+  returns = task_returns_new ();
+  mapping_take_task_failed (mapping, returns);
+  task_returns_flush (returns);
 }
 
 static void
-gupnp_simple_igd_add_proxy_mapping (GUPnPSimpleIgd *self, struct Proxy *prox,
-    struct Mapping *mapping)
+gupnp_simple_igd_add_port_real (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description)
 {
-  struct ProxyMapping *pm = g_slice_new0 (struct ProxyMapping);
+  gupnp_simple_igd_new_mapping (self, protocol, external_port, local_ip,
+      local_port, lease_duration, description, NULL, NULL, 0);
+}
 
-  pm->proxy = prox;
-  pm->mapping = mapping;
+/**
+ * gupnp_simple_igd_add_port:
+ * @self: The #GUPnPSimpleIgd object
+ * @protocol: the protocol "UDP" or "TCP"
+ * @external_port: The port to try to open on the external device,
+ *   0 means to try the same port as the local port and, if it is already
+ *   taken, a few other ports picked from the local address and port
+ * @local_ip: The IP address to forward packets to (most likely the local ip address)
+ * @local_port: The local port to forward packets to
+ * @lease_duration: The duration of the lease (it will be auto-renewed before it expires). This is in seconds.
+ * @description: The description that will appear in the router's table
+ *
+ * This adds a port to the router's forwarding table. The mapping will
+ * be automatically refreshed by this object until it is either
+ * removed with gupnp_simple_igd_remove_port(),
+ * gupnp_simple_igd_remove_port_local() or the object disapears.
+ *
+ * If there is a problem, the #GUPnPSimpleIgd::error-mapping-port signal will
+ * be emitted. If a router is found and a port is mapped correctly,
+ * #GUPnPSimpleIgd::mapped-external-port will be emitted. These signals may
+ * be emitted multiple times if there are multiple routers present.
+ */
 
-  if (mapping->requested_external_port)
-    pm->actual_external_port = mapping->requested_external_port;
-  else
-    pm->actual_external_port = mapping->local_port;
+void
+gupnp_simple_igd_add_port (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description)
+{
+  GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
 
-  gupnp_simple_igd_call_add_port_mapping (pm,
-      _service_proxy_added_port_mapping);
+  g_return_if_fail (klass->add_port);
+  g_return_if_fail (protocol && local_ip);
+  g_return_if_fail (local_port > 0);
+  g_return_if_fail (!strcmp (protocol, "UDP") || !strcmp (protocol, "TCP"));
 
-  g_ptr_array_add (prox->proxymappings, pm);
+  klass->add_port (self, protocol, external_port, local_ip, local_port,
+      lease_duration, description);
 }
 
 static void
-gupnp_simple_igd_add_port_real (GUPnPSimpleIgd *self,
+gupnp_simple_igd_add_port_async_real (GUPnPSimpleIgd *self,
     const gchar *protocol,
     guint16 external_port,
     const gchar *local_ip,
     guint16 local_port,
     guint32 lease_duration,
-    const gchar *description)
+    const gchar *description,
+    GTask *task)
 {
-  struct Mapping *mapping = g_slice_new0 (struct Mapping);
-  guint i;
+  if (g_task_return_error_if_cancelled (task))
+  {
+    g_object_unref (task);
+    return;
+  }
+
+  gupnp_simple_igd_new_mapping (self, protocol, external_port, local_ip,
+      local_port, lease_duration, description, task, NULL, 0);
+}
+
+/**
+ * gupnp_simple_igd_add_port_async:
+ * @self: The #GUPnPSimpleIgd object
+ * @protocol: the protocol "UDP" or "TCP"
+ * @external_port: The port to try to open on the external device,
+ *   0 means to try the same port as the local port and, if it is already
+ *   taken, a few other ports picked from the local address and port
+ * @local_ip: The IP address to forward packets to (most likely the local ip address)
+ * @local_port: The local port to forward packets to
+ * @lease_duration: The duration of the lease (it will be auto-renewed before it expires). This is in seconds.
+ * @description: The description that will appear in the router's table
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: callback to call when the port is mapped or has failed
+ * @user_data: data to pass to @callback
+ *
+ * This adds a port exactly like gupnp_simple_igd_add_port(), but also
+ * reports the outcome of this specific mapping to @callback. It succeeds
+ * as soon as the port is mapped on one router and the external address of
+ * that router is known. It fails once the mapping has failed on every
+ * router it was tried on. If no router is present, it waits for one to
+ * appear.
+ *
+ * The mapping stays in place and is renewed after the operation completes,
+ * until it is removed with gupnp_simple_igd_remove_port() or
+ * gupnp_simple_igd_remove_port_local(). Cancelling @cancellable before
+ * that cancels the pending AddPortMapping actions and removes the mapping.
+ *
+ * The operation keeps a reference on @self, which is the source object
+ * passed to @callback, until it completes. Removing the mapping or
+ * running gupnp_simple_igd_shutdown_async() before that makes it fail with
+ * %G_IO_ERROR_CANCELLED.
+ *
+ * @callback is called in the thread-default #GMainContext of the thread
+ * this function is called from.
+ */
+
+void
+gupnp_simple_igd_add_port_async (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
+  GTask *task;
+
+  g_return_if_fail (klass->add_port_async);
+  g_return_if_fail (protocol && local_ip);
+  g_return_if_fail (local_port > 0);
+  g_return_if_fail (!strcmp (protocol, "UDP") || !strcmp (protocol, "TCP"));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gupnp_simple_igd_add_port_async);
+
+  klass->add_port_async (self, protocol, external_port, local_ip, local_port,
+      lease_duration, description, task);
+}
+
+/**
+ * gupnp_simple_igd_add_port_finish:
+ * @self: The #GUPnPSimpleIgd object
+ * @result: the #GAsyncResult passed to the callback
+ * @external_ip: (out) (optional) (transfer full): the external address of
+ *   the router the port was mapped on
+ * @external_port: (out) (optional): the port that was mapped on the router
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with gupnp_simple_igd_add_port_async().
+ *
+ * If the mapping failed on several routers, the error is
+ * %GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED and its message contains the
+ * error from each router. If it failed on only one, its error is returned
+ * unchanged.
+ *
+ * Returns: %TRUE if the port was mapped, %FALSE on error
+ */
+
+gboolean
+gupnp_simple_igd_add_port_finish (GUPnPSimpleIgd *self,
+    GAsyncResult *result,
+    gchar **external_ip,
+    guint *external_port,
+    GError **error)
+{
+  struct AddPortResult *res;
 
-  mapping->protocol = g_strdup (protocol);
-  mapping->requested_external_port = external_port;
-  mapping->local_ip = g_strdup (local_ip);
-  mapping->local_port = local_port;
-  mapping->lease_duration = lease_duration;
-  mapping->description = g_strdup (description);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+      gupnp_simple_igd_add_port_async, FALSE);
 
-  if (!mapping->description)
-    mapping->description = g_strdup ("");
+  res = g_task_propagate_pointer (G_TASK (result), error);
+  if (!res)
+    return FALSE;
 
-  g_ptr_array_add (self->priv->mappings, mapping);
+  if (external_ip)
+    *external_ip = g_steal_pointer (&res->external_ip);
+  if (external_port)
+    *external_port = res->external_port;
 
-  for (i=0; i < self->priv->service_proxies->len; i++)
-  {
-    struct Proxy *prox = g_ptr_array_index (self->priv->service_proxies, i);
+  add_port_result_free (res);
 
-    if (prox->external_ip_failed)
-    {
-      GError error = {GUPNP_SIMPLE_IGD_ERROR,
-                      GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS,
-                      "Could not get external address"};
-      g_signal_emit (self, signals[SIGNAL_ERROR_MAPPING_PORT],
-          GUPNP_SIMPLE_IGD_ERROR,
-          &error, mapping->protocol, mapping->requested_external_port,
-          mapping->local_ip, mapping->local_port,
-          mapping->description);
-    }
-    else
-    {
-      gupnp_simple_igd_add_proxy_mapping (self, prox, mapping);
-    }
-  }
+  return TRUE;
+}
+
+static void
+gupnp_simple_igd_add_mapping_real (GUPnPSimpleIgd *self,
+    GUPnPIgdMapping *handle)
+{
+  GUPnPSimpleIgdPortSpec spec;
+
+  _gupnp_igd_mapping_get_spec (handle, &spec);
+
+  gupnp_simple_igd_new_mapping (self, spec.protocol, spec.external_port,
+      spec.local_ip, spec.local_port, spec.lease_duration, spec.description,
+      NULL, handle, 0);
 }
 
 /**
- * gupnp_simple_igd_add_port:
+ * gupnp_simple_igd_add_mapping:
  * @self: The #GUPnPSimpleIgd object
  * @protocol: the protocol "UDP" or "TCP"
  * @external_port: The port to try to open on the external device,
- *   0 means to try a random port if the same port as the local port is already
- *   taken
+ *   0 means to try the same port as the local port and, if it is already
+ *   taken, a few other ports picked from the local address and port
  * @local_ip: The IP address to forward packets to (most likely the local ip address)
  * @local_port: The local port to forward packets to
  * @lease_duration: The duration of the lease (it will be auto-renewed before it expires). This is in seconds.
  * @description: The description that will appear in the router's table
  *
- * This adds a port to the router's forwarding table. The mapping will
- * be automatically refreshed by this object until it is either
- * removed with gupnp_simple_igd_remove_port(),
- * gupnp_simple_igd_remove_port_local() or the object disapears.
+ * This adds a port exactly like gupnp_simple_igd_add_port(), but returns a
+ * #GUPnPIgdMapping that represents this mapping. Its signals are only
+ * emitted for this mapping, in addition to the #GUPnPSimpleIgd signals.
  *
- * If there is a problem, the #GUPnPSimpleIgd::error-mapping-port signal will
- * be emitted. If a router is found and a port is mapped correctly,
- * #GUPnPSimpleIgd::mapped-external-port will be emitted. These signals may
- * be emitted multiple times if there are multiple routers present.
+ * The mapping is removed when the last reference to the returned object
+ * is dropped, there is no need to call gupnp_simple_igd_remove_port().
+ *
+ * Returns: (transfer full): a new #GUPnPIgdMapping
  */
 
-void
-gupnp_simple_igd_add_port (GUPnPSimpleIgd *self,
+GUPnPIgdMapping *
+gupnp_simple_igd_add_mapping (GUPnPSimpleIgd *self,
     const gchar *protocol,
     guint16 external_port,
     const gchar *local_ip,
@@ -963,40 +5811,115 @@ gupnp_simple_igd_add_port (GUPnPSimpleIgd *self,
     const gchar *description)
 {
   GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
+  GUPnPIgdMapping *handle;
 
-  g_return_if_fail (klass->add_port);
-  g_return_if_fail (protocol && local_ip);
-  g_return_if_fail (local_port > 0);
-  g_return_if_fail (!strcmp (protocol, "UDP") || !strcmp (protocol, "TCP"));
+  g_return_val_if_fail (klass->add_mapping, NULL);
+  g_return_val_if_fail (protocol && local_ip, NULL);
+  g_return_val_if_fail (local_port > 0, NULL);
+  g_return_val_if_fail (!strcmp (protocol, "UDP") || !strcmp (protocol, "TCP"),
+      NULL);
 
-  klass->add_port (self, protocol, external_port, local_ip, local_port,
-      lease_duration, description);
+  handle = _gupnp_igd_mapping_new (self,
+      g_atomic_int_add (&self->priv->last_mapping_id, 1) + 1,
+      protocol, external_port, local_ip, local_port, lease_duration,
+      description ? description : "");
+
+  klass->add_mapping (self, handle);
+
+  return handle;
 }
 
 static void
-gupnp_simple_igd_remove_port_real (GUPnPSimpleIgd *self,
-    const gchar *protocol,
-    guint external_port)
+gupnp_simple_igd_remove_mapping_id_real (GUPnPSimpleIgd *self, guint id)
+{
+  struct Mapping *mapping;
+
+  mapping = g_hash_table_lookup (self->priv->mappings_by_id,
+      GUINT_TO_POINTER (id));
+  if (!mapping)
+    return;
+
+  remove_mapping (self, mapping);
+}
+
+void
+_gupnp_simple_igd_remove_mapping_id (GUPnPSimpleIgd *self, guint id)
+{
+  GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
+
+  g_return_if_fail (klass->remove_mapping_id);
+
+  klass->remove_mapping_id (self, id);
+}
+
+static void
+gupnp_simple_igd_add_ports_real (GUPnPSimpleIgd *self,
+    const GUPnPSimpleIgdPortSpec *specs,
+    guint n_specs)
 {
-  struct Mapping *mapping = NULL;
+  GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
   guint i;
 
-  for (i = 0; i < self->priv->mappings->len; i++)
+  /* Through the class, a subclass may override add_port alone */
+  for (i = 0; i < n_specs; i++)
+    klass->add_port (self, specs[i].protocol,
+        specs[i].external_port, specs[i].local_ip, specs[i].local_port,
+        specs[i].lease_duration, specs[i].description);
+}
+
+/**
+ * gupnp_simple_igd_add_ports:
+ * @self: The #GUPnPSimpleIgd object
+ * @specs: (array length=n_specs): The mappings to add
+ * @n_specs: The number of elements in @specs
+ *
+ * This adds several ports to the routers' forwarding tables at once, each
+ * of them behaves exactly as if it had been added with
+ * gupnp_simple_igd_add_port(). The strings in @specs are copied.
+ *
+ * This is cheaper than calling gupnp_simple_igd_add_port() repeatedly,
+ * in particular with a #GUPnPSimpleIgdThread where all the mappings are
+ * handed to the thread in one go.
+ */
+
+void
+gupnp_simple_igd_add_ports (GUPnPSimpleIgd *self,
+    const GUPnPSimpleIgdPortSpec *specs,
+    guint n_specs)
+{
+  GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
+  guint i;
+
+  g_return_if_fail (klass->add_ports);
+  g_return_if_fail (specs || n_specs == 0);
+
+  for (i = 0; i < n_specs; i++)
   {
-    struct Mapping *tmpmapping = g_ptr_array_index (self->priv->mappings, i);
-    if (tmpmapping->requested_external_port == external_port &&
-        !strcmp (tmpmapping->protocol, protocol))
-    {
-      mapping = tmpmapping;
-      break;
-    }
+    g_return_if_fail (specs[i].protocol && specs[i].local_ip);
+    g_return_if_fail (specs[i].local_port > 0);
+    g_return_if_fail (!strcmp (specs[i].protocol, "UDP") ||
+        !strcmp (specs[i].protocol, "TCP"));
   }
-  if (!mapping)
+
+  if (n_specs == 0)
     return;
 
-  g_ptr_array_remove_index_fast (self->priv->mappings, i);
+  klass->add_ports (self, specs, n_specs);
+}
 
-  free_mapping (self, mapping);
+static void
+gupnp_simple_igd_remove_port_real (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint external_port)
+{
+  struct Mapping *mapping;
+
+  mapping = mapping_index_lookup (self->priv->mappings_by_external,
+      mapping_external_key (protocol, external_port));
+  if (!mapping)
+    return;
+
+  remove_mapping (self, mapping);
 }
 
 /**
@@ -1034,26 +5957,14 @@ gupnp_simple_igd_remove_port_local_real (GUPnPSimpleIgd *self,
     const gchar *local_ip,
     guint16 local_port)
 {
-  struct Mapping *mapping = NULL;
-  guint i;
+  struct Mapping *mapping;
 
-  for (i = 0; i < self->priv->mappings->len; i++)
-  {
-    struct Mapping *tmpmapping = g_ptr_array_index (self->priv->mappings, i);
-    if (tmpmapping->local_port == local_port &&
-        !strcmp (tmpmapping->local_ip, local_ip) &&
-        !strcmp (tmpmapping->protocol, protocol))
-    {
-      mapping = tmpmapping;
-      break;
-    }
-  }
+  mapping = mapping_index_lookup (self->priv->mappings_by_local,
+      mapping_local_key (protocol, local_ip, local_port));
   if (!mapping)
     return;
 
-  g_ptr_array_remove_index_fast (self->priv->mappings, i);
-
-  free_mapping (self, mapping);
+  remove_mapping (self, mapping);
 }
 
 /**
@@ -1088,16 +5999,327 @@ gupnp_simple_igd_remove_port_local (GUPnPSimpleIgd *self,
   klass->remove_port_local (self, protocol, local_ip, local_port);
 }
 
+static void
+gupnp_simple_igd_add_port_range_real (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint n_ports,
+    guint32 lease_duration,
+    const gchar *description)
+{
+  gupnp_simple_igd_new_mapping (self, protocol, external_port, local_ip,
+      local_port, lease_duration, description, NULL, NULL, n_ports);
+}
+
+/**
+ * gupnp_simple_igd_add_port_range:
+ * @self: The #GUPnPSimpleIgd object
+ * @protocol: the protocol "UDP" or "TCP"
+ * @external_port: The first port to open on the external device, 0 means
+ *   to use the same ports as the local ones
+ * @local_ip: The IP address to forward packets to (most likely the local ip address)
+ * @local_port: The first local port to forward packets to
+ * @n_ports: The number of consecutive ports in the range
+ * @lease_duration: The duration of the lease (it will be auto-renewed before it expires). This is in seconds.
+ * @description: The description that will appear in the router's table
+ *
+ * This maps @n_ports consecutive external ports to as many consecutive
+ * local ports, as if each of them had been added with
+ * gupnp_simple_igd_add_port(), but the range is handled as a single
+ * mapping. The requests for all its ports are sent at once, the ports are
+ * mapped exactly where requested, a port that is already taken is not
+ * moved elsewhere. All the ports of the range are renewed at the same
+ * time, and the range is removed with gupnp_simple_igd_remove_port_range(),
+ * not port by port.
+ *
+ * No signal is emitted for the individual ports. Instead,
+ * #GUPnPSimpleIgd::port-range-progress reports how many ports are mapped
+ * on each router as they get mapped,
+ * #GUPnPSimpleIgd::mapped-external-port-range is emitted once all of them
+ * are mapped on a router and #GUPnPSimpleIgd::error-mapping-port-range if
+ * mapping or renewing any of them fails on a router. A port lost that way
+ * is tried again at the next renewal of the range.
+ */
+
+void
+gupnp_simple_igd_add_port_range (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint n_ports,
+    guint32 lease_duration,
+    const gchar *description)
+{
+  GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
+
+  g_return_if_fail (klass->add_port_range);
+  g_return_if_fail (protocol && local_ip);
+  g_return_if_fail (local_port > 0);
+  g_return_if_fail (n_ports > 0);
+  g_return_if_fail (n_ports <= 65536 - MAX (external_port, local_port));
+  g_return_if_fail (!strcmp (protocol, "UDP") || !strcmp (protocol, "TCP"));
+
+  klass->add_port_range (self, protocol, external_port, local_ip, local_port,
+      n_ports, lease_duration, description);
+}
+
+static void
+gupnp_simple_igd_remove_port_range_real (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint external_port)
+{
+  struct Mapping *range = NULL;
+  GList *item;
+  guint i;
+
+  /* The first external port is that of the first local port if none was
+   * requested, so it tells the ranges apart */
+  for (i = 0; i < self->priv->mappings->len; i++)
+  {
+    struct Mapping *mapping = g_ptr_array_index (self->priv->mappings, i);
+
+    if (mapping->n_ports && !strcmp (mapping->protocol, protocol) &&
+        (mapping->requested_external_port ?
+            mapping->requested_external_port : mapping->local_port) ==
+        external_port)
+    {
+      range = mapping;
+      break;
+    }
+  }
+
+  if (!range)
+    return;
+
+  for (item = range->proxymappings.head; item; item = item->next)
+  {
+    struct ProxyMapping *pm = item->data;
+
+    if (pm->proxy->delete_port_mapping_range)
+      proxy_mapping_delete_port_runs (pm);
+  }
+
+  remove_mapping (self, range);
+}
+
+/**
+ * gupnp_simple_igd_remove_port_range:
+ * @self: The #GUPnPSimpleIgd object
+ * @protocol: the protocol "UDP" or "TCP" as given to
+ *  gupnp_simple_igd_add_port_range()
+ * @external_port: The first external port of the range, that is the
+ *  first local port if 0 was given to gupnp_simple_igd_add_port_range()
+ *
+ * This removes all the ports of a range added with
+ * gupnp_simple_igd_add_port_range() from the routers. On routers that
+ * implement WANIPConnection:2, the whole range is deleted with a single
+ * request. Like gupnp_simple_igd_remove_port(), this is a best effort
+ * mechanism.
+ */
+void
+gupnp_simple_igd_remove_port_range (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint external_port)
+{
+  GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
+
+  g_return_if_fail (protocol);
+  g_return_if_fail (external_port > 0 && external_port <= 65535);
+
+  g_return_if_fail (klass->remove_port_range);
+
+  klass->remove_port_range (self, protocol, external_port);
+}
+
+static gboolean
+_shutdown_deadline (gpointer user_data)
+{
+  GUPnPSimpleIgd *self = user_data;
+
+  shutdown_clear_sources (self);
+
+  /* The deletions still in flight complete with G_IO_ERROR_CANCELLED,
+   * the last of them returns the task */
+  self->priv->shutdown_timed_out = TRUE;
+  g_cancellable_cancel (self->priv->delete_cancellable);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+_shutdown_cancelled (GCancellable *cancellable, gpointer user_data)
+{
+  return _shutdown_deadline (user_data);
+}
+
+static void
+gupnp_simple_igd_shutdown_async_real (GUPnPSimpleIgd *self,
+    guint timeout,
+    GTask *task)
+{
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  struct ShutdownResult *result;
+  guint i;
+
+  if (self->priv->shutdown_task)
+  {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_PENDING,
+        "The object is already being shut down");
+    g_object_unref (task);
+    return;
+  }
+
+  self->priv->shutting_down = TRUE;
+  self->priv->deleted_ports = 0;
+  self->priv->failed_ports = 0;
+
+  gupnp_simple_igd_delete_all_mappings (self);
+
+  /* The deletions queued before are sent too */
+  for (i = 0; i < self->priv->service_proxies->len; i++)
+    proxy_dispatch_actions (g_ptr_array_index (self->priv->service_proxies,
+            i));
+
+  if (self->priv->deleting_count == 0)
+  {
+    result = g_slice_new0 (struct ShutdownResult);
+    g_task_return_pointer (task, result,
+        (GDestroyNotify) shutdown_result_free);
+    g_object_unref (task);
+    return;
+  }
+
+  self->priv->shutdown_task = task;
+
+  if (timeout)
+  {
+    self->priv->shutdown_timeout_src = g_timeout_source_new (timeout);
+    g_source_set_callback (self->priv->shutdown_timeout_src,
+        _shutdown_deadline, self, NULL);
+    g_source_attach (self->priv->shutdown_timeout_src,
+        self->priv->main_context);
+  }
+
+  if (cancellable)
+  {
+    self->priv->shutdown_cancel_src = g_cancellable_source_new (cancellable);
+    g_source_set_callback (self->priv->shutdown_cancel_src,
+        (GSourceFunc) _shutdown_cancelled, self, NULL);
+    g_source_attach (self->priv->shutdown_cancel_src,
+        self->priv->main_context);
+  }
+}
+
+/**
+ * gupnp_simple_igd_shutdown_async:
+ * @self: The #GUPnPSimpleIgd object
+ * @timeout: The deadline in milliseconds, 0 to wait for every router to
+ *   answer
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: callback to call when the shutdown is complete
+ * @user_data: data to pass to @callback
+ *
+ * Removes all the mappings from the routers and prevents new ones from
+ * being formed, like disposing of @self, but without blocking the calling
+ * thread. All the deletions are sent at once, regardless of
+ * #GUPnPSimpleIgd:max-concurrent-actions. Those that are still in flight
+ * when @timeout expires, or when @cancellable is cancelled, are abandoned
+ * and the mappings will disappear from the routers when their lease runs
+ * out.
+ *
+ * The operation keeps a reference on @self until it completes. Once it
+ * is complete, dropping the last reference to @self does not wait for the
+ * routers anymore.
+ *
+ * @callback is called in the thread-default #GMainContext of the thread
+ * this function is called from.
+ */
+
+void
+gupnp_simple_igd_shutdown_async (GUPnPSimpleIgd *self,
+    guint timeout,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  GUPnPSimpleIgdClass *klass = GUPNP_SIMPLE_IGD_GET_CLASS (self);
+  GTask *task;
+
+  g_return_if_fail (GUPNP_IS_SIMPLE_IGD (self));
+  g_return_if_fail (klass->shutdown_async);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gupnp_simple_igd_shutdown_async);
+
+  /* Cancelling only cuts the deletions short, the result is still
+   * returned */
+  g_task_set_check_cancellable (task, FALSE);
+
+  klass->shutdown_async (self, timeout, task);
+}
+
+/**
+ * gupnp_simple_igd_shutdown_finish:
+ * @self: The #GUPnPSimpleIgd object
+ * @result: the #GAsyncResult passed to the callback
+ * @n_deleted: (out) (optional): the number of ports deleted from the
+ *   routers
+ * @n_failed: (out) (optional): the number of ports that could not be
+ *   deleted, because the router returned an error or did not answer in
+ *   time
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with gupnp_simple_igd_shutdown_async().
+ * @n_deleted and @n_failed are set even if the deadline was reached.
+ *
+ * Returns: %TRUE if every router answered before the deadline, %FALSE
+ * with %G_IO_ERROR_TIMED_OUT otherwise
+ */
+
+gboolean
+gupnp_simple_igd_shutdown_finish (GUPnPSimpleIgd *self,
+    GAsyncResult *result,
+    guint *n_deleted,
+    guint *n_failed,
+    GError **error)
+{
+  struct ShutdownResult *res;
+  gboolean ret;
+
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+      gupnp_simple_igd_shutdown_async, FALSE);
+
+  res = g_task_propagate_pointer (G_TASK (result), error);
+  if (!res)
+    return FALSE;
+
+  if (n_deleted)
+    *n_deleted = res->n_deleted;
+  if (n_failed)
+    *n_failed = res->n_failed;
+
+  ret = !res->timed_out;
+  if (!ret)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+        "%u port mappings were not deleted before the deadline",
+        res->n_failed);
+
+  shutdown_result_free (res);
+
+  return ret;
+}
+
 static void
 stop_proxymapping (struct ProxyMapping *pm, gboolean stop_renew)
 {
   g_cancellable_cancel (pm->cancellable);
   g_clear_object (&pm->cancellable);
+  pm->n_sending = 0;
 
-  if (stop_renew && pm->renew_src)
-  {
-    g_source_destroy (pm->renew_src);
-    g_source_unref (pm->renew_src);
-    pm->renew_src = NULL;
-  }
+  if (stop_renew)
+    unschedule_renewal (pm->proxy->parent, pm);
 }
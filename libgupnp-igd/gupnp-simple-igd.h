@@ -25,6 +25,9 @@
 
 #include <glib.h>
 #include <glib-object.h>
+#include <gio/gio.h>
+
+#include <libgupnp-igd/gupnp-igd-mapping.h>
 
 G_BEGIN_DECLS
 
@@ -77,16 +80,68 @@ struct _GUPnPSimpleIgd
  * GUPnPSimpleIgdError:
  * @GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS: Error getting the external
  * address of the router
+ * @GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED: The port could not be mapped on
+ * any of the routers
+ * @GUPNP_SIMPLE_IGD_ERROR_NO_FREE_PORT: The router refused every external
+ * port that was tried for a mapping that did not request a specific one
  *
  * Errors coming out of the GUPnPSimpleIGD object.
  */
 
 typedef enum {
   GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS,
+  GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED,
+  GUPNP_SIMPLE_IGD_ERROR_NO_FREE_PORT,
 } GUPnPSimpleIgdError;
 
 GQuark gupnp_simple_igd_error_quark (void);
 
+/**
+ * GUPnPSimpleIgdRoutingPolicy:
+ * @GUPNP_SIMPLE_IGD_ROUTING_POLICY_ALL: The mappings are added on every
+ * router that is found
+ * @GUPNP_SIMPLE_IGD_ROUTING_POLICY_FIRST: The mappings are only added on
+ * the first router that is found connected
+ * @GUPNP_SIMPLE_IGD_ROUTING_POLICY_DEFAULT_ROUTE: The mappings are only
+ * added on the router that is the default gateway of its network
+ * interface, or on the first router if the default gateway is not known
+ * or if no router that is found is the default gateway
+ *
+ * Which routers get the mappings when several are found, see the
+ * #GUPnPSimpleIgd:routing-policy property.
+ */
+
+typedef enum {
+  GUPNP_SIMPLE_IGD_ROUTING_POLICY_ALL,
+  GUPNP_SIMPLE_IGD_ROUTING_POLICY_FIRST,
+  GUPNP_SIMPLE_IGD_ROUTING_POLICY_DEFAULT_ROUTE,
+} GUPnPSimpleIgdRoutingPolicy;
+
+/**
+ * GUPnPSimpleIgdPortSpec:
+ * @protocol: the protocol "UDP" or "TCP"
+ * @external_port: The port to try to open on the external device, 0 means
+ *   to try the same port as the local port, and a few others if it is taken
+ * @local_ip: The IP address to forward packets to
+ * @local_port: The local port to forward packets to
+ * @lease_duration: The duration of the lease in seconds
+ * @description: The description that will appear in the router's table
+ *
+ * Describes one port mapping, as passed to gupnp_simple_igd_add_ports()
+ */
+
+typedef struct _GUPnPSimpleIgdPortSpec GUPnPSimpleIgdPortSpec;
+
+struct _GUPnPSimpleIgdPortSpec
+{
+  const gchar *protocol;
+  guint16 external_port;
+  const gchar *local_ip;
+  guint16 local_port;
+  guint32 lease_duration;
+  const gchar *description;
+};
+
 GType gupnp_simple_igd_get_type (void);
 
 GUPnPSimpleIgd *
@@ -101,6 +156,49 @@ gupnp_simple_igd_add_port (GUPnPSimpleIgd *self,
     guint32 lease_duration,
     const gchar *description);
 
+void
+gupnp_simple_igd_add_port_async (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+gboolean
+gupnp_simple_igd_add_port_finish (GUPnPSimpleIgd *self,
+    GAsyncResult *result,
+    gchar **external_ip,
+    guint *external_port,
+    GError **error);
+
+GUPnPIgdMapping *
+gupnp_simple_igd_add_mapping (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint32 lease_duration,
+    const gchar *description);
+
+void
+gupnp_simple_igd_add_ports (GUPnPSimpleIgd *self,
+    const GUPnPSimpleIgdPortSpec *specs,
+    guint n_specs);
+
+void
+gupnp_simple_igd_add_port_range (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint16 external_port,
+    const gchar *local_ip,
+    guint16 local_port,
+    guint n_ports,
+    guint32 lease_duration,
+    const gchar *description);
+
 void
 gupnp_simple_igd_remove_port (GUPnPSimpleIgd *self,
     const gchar *protocol,
@@ -112,10 +210,29 @@ gupnp_simple_igd_remove_port_local (GUPnPSimpleIgd *self,
     const gchar *local_ip,
     guint16 local_port);
 
+void
+gupnp_simple_igd_remove_port_range (GUPnPSimpleIgd *self,
+    const gchar *protocol,
+    guint external_port);
+
 
 gboolean
 gupnp_simple_igd_delete_all_mappings (GUPnPSimpleIgd *self);
 
+void
+gupnp_simple_igd_shutdown_async (GUPnPSimpleIgd *self,
+    guint timeout,
+    GCancellable *cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+gboolean
+gupnp_simple_igd_shutdown_finish (GUPnPSimpleIgd *self,
+    GAsyncResult *result,
+    guint *n_deleted,
+    guint *n_failed,
+    GError **error);
+
 
 G_END_DECLS
 
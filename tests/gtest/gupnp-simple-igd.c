@@ -23,11 +23,13 @@
 #endif
 
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include <string.h>
 
 #include "libgupnp-igd/gupnp-simple-igd.h"
 #include "libgupnp-igd/gupnp-simple-igd-thread.h"
+#include "libgupnp-igd/gupnp-simple-igd-priv.h"
 
 #include <libgupnp/gupnp.h>
 
@@ -38,20 +40,126 @@
 
 #define INTERNAL_PORT    6543
 
+#define EXTERNAL_IP_DELAY 500
+
+#define STALE_PORT       7000
+#define STALE_DELETE_DELAY 200
+#define MAX_TABLE_ENTRIES 8
+
+#define SLOW_DELETE_DELAY 1000
+
+#define MANY_MAPPINGS    10000
+#define TEARDOWN_BUDGET  (10 * G_USEC_PER_SEC)
+
+#define POLICY_SETTLE_TIME 1000
+
 typedef enum {
   CONNECTION_IP,
   CONNECTION_PPP
 } ConnectionType;
 
+typedef struct {
+  const gchar *protocol;
+  guint external_port;
+  const gchar *internal_client;
+  guint internal_port;
+  const gchar *description;
+  guint lease_duration;
+  gboolean stale;
+} PortTableEntry;
+
+/* The mapping of the test left over from an earlier run, a duplicate of it
+ * on another port, the only one to delete, and mappings of another host */
+static const PortTableEntry leftover_port_table[] = {
+  { "UDP", STALE_PORT, "192.168.4.22", INTERNAL_PORT, "GUPnP Simple IGD test",
+    10, TRUE },
+  { "UDP", INTERNAL_PORT, "192.168.4.22", INTERNAL_PORT,
+    "GUPnP Simple IGD test", 10, FALSE },
+  { "TCP", INTERNAL_PORT, "192.168.4.99", 1234, "Another host", 0, FALSE },
+  { "UDP", STALE_PORT + 1, "192.168.4.99", INTERNAL_PORT, "Another host", 0,
+    FALSE },
+};
+
 static GMainLoop *loop = NULL;
 
 static GUPnPServiceInfo *ipservice = NULL;
 static GUPnPServiceInfo *pppservice = NULL;
 
 gboolean return_conflict = FALSE;
+gboolean always_conflict = FALSE;
+const gchar *device_description = "InternetGatewayDevice.xml";
+const gchar *ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:1";
+guint add_any_port_mapping_calls = 0;
+guint extra_mappings = 0;
+guint extra_mapped = 0;
+guint range_deletes = 0;
+guint expected_range_deletes = 1;
+guint single_deletes = 0;
+guint range_ports = 0;
+guint ranges_mapped = 0;
+guint range_progress = 0;
+guint range_errors = 0;
+gboolean break_range_renewals = FALSE;
+guint router_port = 0;
+gboolean announce_after_add = FALSE;
+gboolean added_before_announce = FALSE;
+guint shutdown_deadline = 0;
+gboolean slow_deletes = FALSE;
+gboolean shutdown_done = FALSE;
+guint no_free_port_errors = 0;
 gboolean dispose_removes = FALSE;
 gboolean local_remove = FALSE;
+gboolean use_add_ports = FALSE;
+gboolean use_async = FALSE;
+gboolean async_mapped = FALSE;
+gboolean use_handle = FALSE;
+GUPnPIgdMapping *mapping_handle = NULL;
+guint handle_events = 0;
+gboolean suppress_remap = FALSE;
+guint router_ip_changes = 0;
 gchar *invalid_ip = NULL;
+gboolean delay_external_ip = FALSE;
+guint invalid_ip_replies = 0;
+guint test_lease = 10;
+gboolean wait_renewal = FALSE;
+guint failed_renewals = 0;
+guint add_port_mapping_calls = 0;
+guint renewals = 0;
+const PortTableEntry *port_table = NULL;
+guint port_table_len = 0;
+guint stale_deletes = 0;
+guint expected_stale_deletes = 0;
+gboolean table_deleted[2][MAX_TABLE_ENTRIES];
+guint stale_delete_held[2] = { 0, 0 };
+gboolean removal_deleted = FALSE;
+gboolean ppp_disconnected = FALSE;
+gboolean ip_disconnected = FALSE;
+guint fallbacks_used = 0;
+gboolean connection_lost = FALSE;
+guint standby_deletes = 0;
+GUPnPRootDevice *policy_routers[2] = { NULL, NULL };
+GList *policy_services = NULL;
+guint policy_router_adds[2] = { 0, 0 };
+GSource *policy_settle_src = NULL;
+gboolean teardown_many = FALSE;
+guint teardown_mapped = 0;
+gint64 teardown_start = 0;
+gboolean spread_renewals = FALSE;
+guint ip_add_port_mapping_calls = 0;
+gint64 first_add_time = 0;
+GArray *renewal_times = NULL;
+gboolean bounded_actions = FALSE;
+gboolean external_ip_held[2] = { FALSE, FALSE };
+GCancellable *queued_cancellable = NULL;
+gboolean queued_add_cancelled = FALSE;
+GUPnPRootDevice *fake_igd = NULL;
+gboolean router_vanishes = FALSE;
+GPtrArray *held_actions = NULL;
+GUPnPSimpleIgd *late_add_igd = NULL;
+gboolean late_add_scheduled = FALSE;
+guint address_errors = 0;
+gboolean scan_stalls = FALSE;
+const gchar *mapped_local_ip = "192.168.4.22";
 
 static void
 test_gupnp_simple_igd_new (void)
@@ -66,6 +174,52 @@ test_gupnp_simple_igd_new (void)
 }
 
 
+static gboolean
+return_success_later (gpointer user_data)
+{
+  GUPnPServiceAction *action = user_data;
+
+  gupnp_service_action_return_success (action);
+
+  return G_SOURCE_REMOVE;
+}
+
+typedef struct {
+  GUPnPServiceAction *action;
+  ConnectionType ct;
+} HeldReply;
+
+static gboolean
+return_held_external_ip (gpointer user_data)
+{
+  HeldReply *reply = user_data;
+
+  external_ip_held[reply->ct] = FALSE;
+  gupnp_service_action_return_success (reply->action);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Adds the mapping once the routers could not give their address */
+static gboolean
+add_port_late (gpointer user_data)
+{
+  gupnp_simple_igd_add_port (late_add_igd, "UDP", INTERNAL_PORT,
+      mapped_local_ip, INTERNAL_PORT, test_lease, "GUPnP Simple IGD test");
+
+  return G_SOURCE_REMOVE;
+}
+
+static const gchar *
+connection_status (ConnectionType ct)
+{
+  if ((ct == CONNECTION_PPP && ppp_disconnected) ||
+      (ct == CONNECTION_IP && ip_disconnected))
+    return "Disconnected";
+  else
+    return "Connected";
+}
+
 static void
 get_external_ip_address_cb (GUPnPService *service,
     GUPnPServiceAction *action,
@@ -73,10 +227,58 @@ get_external_ip_address_cb (GUPnPService *service,
 {
   ConnectionType ct = GPOINTER_TO_INT (user_data);
 
+  /* A service that is not connected is only used while none is */
+  g_assert (!ppp_disconnected || ct != CONNECTION_PPP || ip_disconnected);
+
+  /* The IP connection comes up once the first one is used anyway, it
+   * replaces the PPP connection, which never gets its address */
+  if (ip_disconnected && ppp_disconnected)
+  {
+    fallbacks_used++;
+    ip_disconnected = FALSE;
+    gupnp_service_notify (GUPNP_SERVICE (ipservice), "ConnectionStatus",
+        G_TYPE_STRING, "Connected", NULL);
+
+    if (ct == CONNECTION_PPP)
+    {
+      g_ptr_array_add (held_actions, action);
+      return;
+    }
+  }
+
+  /* The second mapping is queued behind this request */
+  if (queued_cancellable)
+    g_cancellable_cancel (queued_cancellable);
+
+  /* Go away while the mapping waits for the address */
+  if (router_vanishes)
+  {
+    g_ptr_array_add (held_actions, action);
+    gupnp_root_device_set_available (fake_igd, FALSE);
+    return;
+  }
+
   if (invalid_ip)
     gupnp_service_action_set (action,
         "NewExternalIPAddress", G_TYPE_STRING, invalid_ip,
         NULL);
+  else if (invalid_ip_replies > 0)
+  {
+    invalid_ip_replies--;
+    gupnp_service_action_set (action,
+        "NewExternalIPAddress", G_TYPE_STRING, "",
+        NULL);
+
+    if (late_add_igd && !late_add_scheduled)
+    {
+      GSource *src = g_timeout_source_new (EXTERNAL_IP_DELAY);
+
+      g_source_set_callback (src, add_port_late, NULL, NULL);
+      g_source_attach (src, g_main_context_get_thread_default ());
+      g_source_unref (src);
+      late_add_scheduled = TRUE;
+    }
+  }
   else if (ct == CONNECTION_IP)
     gupnp_service_action_set (action,
         "NewExternalIPAddress", G_TYPE_STRING, IP_ADDRESS_FIRST,
@@ -88,10 +290,46 @@ get_external_ip_address_cb (GUPnPService *service,
   else
     g_assert_not_reached ();
 
+  /* Make sure the AddPortMapping replies arrive first */
+  if (delay_external_ip)
+  {
+    GSource *src = g_timeout_source_new (EXTERNAL_IP_DELAY);
+    HeldReply *reply = g_new0 (HeldReply, 1);
+
+    reply->action = action;
+    reply->ct = ct;
+    external_ip_held[ct] = TRUE;
+    g_source_set_callback (src, return_held_external_ip, reply, g_free);
+    g_source_attach (src, g_main_context_get_thread_default ());
+    g_source_unref (src);
+    return;
+  }
+
   gupnp_service_action_return_success (action);
 
 }
 
+/* Notes when the mappings of the IP router are renewed, the first call
+ * for each of them creates it */
+static void
+record_renewal (GUPnPService *service)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if ((GUPnPServiceInfo *) service != ipservice)
+    return;
+
+  if (++ip_add_port_mapping_calls == 1)
+    first_add_time = now;
+
+  if (ip_add_port_mapping_calls <= extra_mappings + 1)
+    return;
+
+  g_array_append_val (renewal_times, now);
+  if (renewal_times->len == extra_mappings + 1)
+    g_main_loop_quit (loop);
+}
+
 static void
 add_port_mapping_cb (GUPnPService *service,
     GUPnPServiceAction *action,
@@ -121,25 +359,148 @@ add_port_mapping_cb (GUPnPService *service,
   g_assert (external_port);
   g_assert (remote_host && !strcmp (remote_host, ""));
   g_assert (proto && (!strcmp (proto, "UDP") || !strcmp (proto, "TCP")));
-  g_assert (internal_port == INTERNAL_PORT);
-  g_assert (internal_client && !strcmp (internal_client, "192.168.4.22"));
+  if (range_ports)
+    g_assert (internal_port - INTERNAL_PORT == external_port -
+        (requested_external_port ? requested_external_port : INTERNAL_PORT));
+  else
+    g_assert (internal_port == INTERNAL_PORT);
+  g_assert (internal_client && !strcmp (internal_client, mapped_local_ip));
   g_assert (enabled == TRUE);
   g_assert (desc != NULL);
-  g_assert (lease == 10);
+  g_assert (lease == test_lease);
 
   g_free (remote_host);
   g_free (proto);
   g_free (internal_client);
   g_free (desc);
 
+  /* The router must have deleted the old entry before */
+  g_assert_cmpuint (external_port, !=, stale_delete_held[
+          (GUPnPServiceInfo *) service == pppservice ?
+          CONNECTION_PPP : CONNECTION_IP]);
+
+  /* With one action at a time, the mapping waits for the address */
+  if (bounded_actions)
+    g_assert_false (external_ip_held[(GUPnPServiceInfo *) service ==
+            pppservice ? CONNECTION_PPP : CONNECTION_IP]);
+
   if (requested_external_port)
-    g_assert (external_port == requested_external_port);
+    g_assert (external_port >= requested_external_port &&
+        external_port <= requested_external_port + extra_mappings +
+        MAX (range_ports, 1) - 1);
+
 
+  /* The first call on each of the two routers creates the mapping */
+  add_port_mapping_calls++;
 
-  if (return_conflict && external_port == INTERNAL_PORT)
+  /* The router read from the cache is used before it announces itself */
+  if (announce_after_add && !gupnp_root_device_get_available (fake_igd))
+  {
+    added_before_announce = TRUE;
+    gupnp_root_device_set_available (fake_igd, TRUE);
+  }
+
+  if (always_conflict ||
+      (return_conflict && external_port == INTERNAL_PORT))
     gupnp_service_action_return_error (action, 718, "ConflictInMappingEntry");
+  else if (break_range_renewals && ranges_mapped == 2 && !range_errors &&
+      (GUPnPServiceInfo *) service == ipservice)
+    /* The IP router loses the range until it is reported */
+    gupnp_service_action_return_error (action, 501, "ActionFailed");
+  else if (wait_renewal && add_port_mapping_calls > 2 && failed_renewals > 0)
+  {
+    failed_renewals--;
+    gupnp_service_action_return_error (action, 501, "ActionFailed");
+  }
   else
+  {
     gupnp_service_action_return_success (action);
+
+    if (wait_renewal && add_port_mapping_calls > 2 && ++renewals == 2)
+      g_main_loop_quit (loop);
+    else if (spread_renewals)
+      record_renewal (service);
+  }
+}
+
+static void
+get_generic_port_mapping_entry_cb (GUPnPService *service,
+    GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  guint index = G_MAXUINT;
+  const PortTableEntry *entry;
+
+  gupnp_service_action_get (action,
+      "NewPortMappingIndex", G_TYPE_UINT, &index,
+      NULL);
+
+  /* A huge table, the entries never come */
+  if (scan_stalls)
+  {
+    g_ptr_array_add (held_actions, action);
+    return;
+  }
+
+  if (index >= port_table_len)
+  {
+    gupnp_service_action_return_error (action, 713,
+        "SpecifiedArrayIndexInvalid");
+    return;
+  }
+
+  entry = &port_table[index];
+  gupnp_service_action_set (action,
+      "NewRemoteHost", G_TYPE_STRING, "",
+      "NewExternalPort", G_TYPE_UINT, entry->external_port,
+      "NewProtocol", G_TYPE_STRING, entry->protocol,
+      "NewInternalPort", G_TYPE_UINT, entry->internal_port,
+      "NewInternalClient", G_TYPE_STRING, entry->internal_client,
+      "NewEnabled", G_TYPE_BOOLEAN, TRUE,
+      "NewPortMappingDescription", G_TYPE_STRING, entry->description,
+      "NewLeaseDuration", G_TYPE_UINT, entry->lease_duration,
+      NULL);
+  gupnp_service_action_return_success (action);
+}
+
+/* Reserves the next port if the proposed one is taken */
+static void
+add_any_port_mapping_cb (GUPnPService *service,
+    GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  guint external_port = 0;
+  gchar *proto = NULL;
+  guint internal_port = 0;
+  gchar *internal_client = NULL;
+  guint lease = 0;
+
+  gupnp_service_action_get (action,
+      "NewExternalPort", G_TYPE_UINT, &external_port,
+      "NewProtocol", G_TYPE_STRING, &proto,
+      "NewInternalPort", G_TYPE_UINT, &internal_port,
+      "NewInternalClient", G_TYPE_STRING, &internal_client,
+      "NewLeaseDuration", G_TYPE_UINT, &lease,
+      NULL);
+
+  g_assert (external_port == INTERNAL_PORT);
+  g_assert (proto && !strcmp (proto, "UDP"));
+  g_assert (internal_port == INTERNAL_PORT);
+  g_assert (internal_client && !strcmp (internal_client, mapped_local_ip));
+  g_assert (lease == test_lease);
+
+  g_free (proto);
+  g_free (internal_client);
+
+  add_any_port_mapping_calls++;
+
+  if (return_conflict)
+    external_port++;
+
+  gupnp_service_action_set (action,
+      "NewReservedPort", G_TYPE_UINT, external_port,
+      NULL);
+  gupnp_service_action_return_success (action);
 }
 
 static gboolean
@@ -149,6 +510,129 @@ loop_quit (gpointer user_data) {
     return FALSE;
 }
 
+/* The WANIPConnection:2 router gets a single DeletePortMappingRange, the
+ * other one a DeletePortMapping for each port, the test ends once all of
+ * them have arrived */
+static void
+range_deletes_maybe_quit (void)
+{
+  GSource *src;
+
+  if (range_deletes != expected_range_deletes ||
+      single_deletes != (2 - expected_range_deletes) *
+          (extra_mappings + MAX (range_ports, 1)))
+    return;
+
+  src = g_idle_source_new ();
+  g_source_set_callback (src, loop_quit, NULL, NULL);
+  g_source_attach (src, g_main_context_get_thread_default ());
+  g_source_unref (src);
+}
+
+static void
+delete_port_mapping_range_cb (GUPnPService *service,
+    GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  guint start_port = 0;
+  guint end_port = 0;
+  gchar *proto = NULL;
+
+  gupnp_service_action_get (action,
+      "NewStartPort", G_TYPE_UINT, &start_port,
+      "NewEndPort", G_TYPE_UINT, &end_port,
+      "NewProtocol", G_TYPE_STRING, &proto,
+      NULL);
+
+  g_assert_cmpuint (start_port, ==, INTERNAL_PORT);
+  g_assert_cmpuint (end_port, ==,
+      INTERNAL_PORT + extra_mappings + MAX (range_ports, 1) - 1);
+  g_assert (proto && !strcmp (proto, "UDP"));
+  g_free (proto);
+
+  range_deletes++;
+  gupnp_service_action_return_success (action);
+
+  range_deletes_maybe_quit ();
+}
+
+static void
+get_status_info_cb (GUPnPService *service,
+    GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  ConnectionType ct = GPOINTER_TO_INT (user_data);
+
+  gupnp_service_action_set (action,
+      "NewConnectionStatus", G_TYPE_STRING, connection_status (ct),
+      "NewLastConnectionError", G_TYPE_STRING, "ERROR_NONE",
+      "NewUptime", G_TYPE_UINT, 42,
+      NULL);
+  gupnp_service_action_return_success (action);
+}
+
+/* Sent to the services that subscribe, it may arrive before the
+ * ConnectionStatus event */
+static void
+query_connection_status_cb (GUPnPService *service, gchar *variable,
+    GValue *value, gpointer user_data)
+{
+  ConnectionType ct = GPOINTER_TO_INT (user_data);
+
+  g_value_init (value, G_TYPE_STRING);
+  g_value_set_string (value, connection_status (ct));
+}
+
+/* Ends the test once our mapping is deleted and the stale entries of the
+ * table too */
+static void
+deletes_maybe_quit (void)
+{
+  GSource *src;
+
+  if (!removal_deleted || stale_deletes < expected_stale_deletes ||
+      stale_delete_held[CONNECTION_IP] || stale_delete_held[CONNECTION_PPP])
+    return;
+
+  src = g_idle_source_new ();
+  g_source_set_callback (src, loop_quit, NULL, NULL);
+  g_source_attach (src, g_main_context_get_thread_default ());
+  g_source_unref (src);
+}
+
+static gboolean
+return_stale_delete_later (gpointer user_data)
+{
+  HeldReply *reply = user_data;
+
+  stale_delete_held[reply->ct] = 0;
+  gupnp_service_action_return_success (reply->action);
+  deletes_maybe_quit ();
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Whether the port is that of an entry of the table the router was
+ * expected to delete at discovery, and the first time it is deleted */
+static gboolean
+delete_stale_entry (ConnectionType ct, const gchar *proto, guint port)
+{
+  guint i;
+
+  for (i = 0; i < port_table_len; i++)
+  {
+    if (port_table[i].external_port != port ||
+        strcmp (port_table[i].protocol, proto) ||
+        !port_table[i].stale || table_deleted[ct][i])
+      continue;
+
+    table_deleted[ct][i] = TRUE;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
 static void
 delete_port_mapping_cb (GUPnPService *service,
     GUPnPServiceAction *action,
@@ -165,6 +649,53 @@ delete_port_mapping_cb (GUPnPService *service,
       "NewProtocol", G_TYPE_STRING, &proto,
       NULL);
 
+  /* From a service put back on standby, the test goes on */
+  if (((GUPnPServiceInfo *) service == ipservice && ip_disconnected) ||
+      ((GUPnPServiceInfo *) service == pppservice && ppp_disconnected))
+  {
+    g_assert_cmpuint (external_port, ==, INTERNAL_PORT);
+    standby_deletes++;
+    gupnp_service_action_return_success (action);
+    g_free (remote_host);
+    g_free (proto);
+    return;
+  }
+
+  if (extra_mappings || range_ports)
+  {
+    g_assert (external_port >= INTERNAL_PORT &&
+        external_port <= INTERNAL_PORT + extra_mappings +
+        MAX (range_ports, 1) - 1);
+    single_deletes++;
+    gupnp_service_action_return_success (action);
+    g_free (remote_host);
+    g_free (proto);
+    range_deletes_maybe_quit ();
+    return;
+  }
+
+  if (delete_stale_entry ((GUPnPServiceInfo *) service == pppservice ?
+          CONNECTION_PPP : CONNECTION_IP, proto, external_port))
+  {
+    GSource *src = g_timeout_source_new (STALE_DELETE_DELAY);
+    HeldReply *reply = g_new0 (HeldReply, 1);
+
+    /* Held for a while, the add of the same port must wait for it */
+    reply->action = action;
+    reply->ct = (GUPnPServiceInfo *) service == pppservice ?
+        CONNECTION_PPP : CONNECTION_IP;
+    g_assert_cmpuint (stale_delete_held[reply->ct], ==, 0);
+    stale_delete_held[reply->ct] = external_port;
+    g_source_set_callback (src, return_stale_delete_later, reply, g_free);
+    g_source_attach (src, g_main_context_get_thread_default ());
+    g_source_unref (src);
+
+    stale_deletes++;
+    g_free (remote_host);
+    g_free (proto);
+    return;
+  }
+
   g_assert (remote_host != NULL);
   if (requested_external_port || !return_conflict)
     g_assert (external_port == INTERNAL_PORT);
@@ -172,14 +703,65 @@ delete_port_mapping_cb (GUPnPService *service,
     g_assert (external_port != INTERNAL_PORT);
   g_assert (proto && !strcmp (proto, "UDP"));
 
-  gupnp_service_action_return_success (action);
-
   g_free (remote_host);
   g_free (proto);
 
-  GSource* src = g_idle_source_new ();
-  g_source_set_callback (src, loop_quit, NULL, NULL);
-  g_source_attach (src, g_main_context_get_thread_default ());
+  /* The shutdown callback ends the test */
+  if (shutdown_deadline && slow_deletes)
+  {
+    GSource *src = g_timeout_source_new (SLOW_DELETE_DELAY);
+
+    g_source_set_callback (src, return_success_later, action, NULL);
+    g_source_attach (src, g_main_context_get_thread_default ());
+    g_source_unref (src);
+    return;
+  }
+
+  gupnp_service_action_return_success (action);
+
+  if (shutdown_deadline)
+    return;
+
+  removal_deleted = TRUE;
+  deletes_maybe_quit ();
+}
+
+static void
+shutdown_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GError *error = NULL;
+  guint n_deleted = 0;
+  guint n_failed = 0;
+  gboolean ret;
+
+  ret = gupnp_simple_igd_shutdown_finish (GUPNP_SIMPLE_IGD (source_object),
+      res, &n_deleted, &n_failed, &error);
+
+  if (slow_deletes)
+  {
+    GSource *src = g_timeout_source_new (SLOW_DELETE_DELAY);
+
+    g_assert_false (ret);
+    g_assert_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+    g_assert_cmpuint (n_deleted, ==, 0);
+    g_assert_cmpuint (n_failed, >=, 1);
+    g_clear_error (&error);
+
+    /* Let the routers answer the abandoned requests first */
+    g_source_set_callback (src, loop_quit, NULL, NULL);
+    g_source_attach (src, g_main_context_get_thread_default ());
+    g_source_unref (src);
+  }
+  else
+  {
+    g_assert_true (ret);
+    g_assert_no_error (error);
+    g_assert_cmpuint (n_deleted, >=, 1);
+    g_assert_cmpuint (n_failed, ==, 0);
+    g_main_loop_quit (loop);
+  }
+
+  shutdown_done = TRUE;
 }
 
 typedef struct _MappedData {
@@ -206,6 +788,61 @@ mapped_external_port_cb (GUPnPSimpleIgd *igd, gchar *proto,
   guint requested_external_port = d->port;
 
   g_assert (invalid_ip == NULL);
+  g_assert (range_ports == 0);
+
+  /* Each spec of a batch is mapped with its own description */
+  if (use_add_ports)
+  {
+    gchar *expected = g_strdup_printf ("GUPnP Simple IGD test %u",
+        external_port - requested_external_port);
+
+    g_assert_cmpstr (description, ==, expected);
+    g_free (expected);
+  }
+
+  if (spread_renewals)
+    return;
+
+  /* Load both routers with many mappings and time tearing them down */
+  if (teardown_many)
+  {
+    guint i;
+
+    if (++teardown_mapped != 2)
+      return;
+
+    for (i = 0; i < MANY_MAPPINGS; i++)
+      gupnp_simple_igd_add_port (igd, "UDP", 20000 + i, "192.168.4.22",
+          10000 + i, test_lease, "GUPnP Simple IGD test");
+
+    teardown_start = g_get_monotonic_time ();
+
+    for (i = 0; i < MANY_MAPPINGS / 2; i++)
+    {
+      if (i % 2)
+        gupnp_simple_igd_remove_port (igd, "UDP", 20000 + i);
+      else
+        gupnp_simple_igd_remove_port_local (igd, "UDP", "192.168.4.22",
+            10000 + i);
+    }
+
+    g_main_loop_quit (loop);
+    return;
+  }
+
+  /* Only change the address once everything is mapped on both routers */
+  if (extra_mappings && !replaces_external_ip)
+  {
+    if (++extra_mapped == 2 * (extra_mappings + 1))
+    {
+      d->ip_address = IP_ADDRESS_SECOND;
+      g_main_context_invoke (d->context, service_notify, d);
+    }
+    return;
+  }
+
+  if (extra_mappings && external_port != requested_external_port)
+    return;
 
   if (requested_external_port)
     g_assert (external_port == requested_external_port);
@@ -215,9 +852,31 @@ mapped_external_port_cb (GUPnPSimpleIgd *igd, gchar *proto,
     g_assert (external_port == INTERNAL_PORT);
   g_assert (proto && !strcmp (proto, "UDP"));
   g_assert (local_port == INTERNAL_PORT);
-  g_assert (local_ip && !strcmp (local_ip, "192.168.4.22"));
+  g_assert (local_ip && !strcmp (local_ip, mapped_local_ip));
   g_assert (description != NULL);
   g_assert (external_ip);
+  g_assert (replaces_external_ip == NULL || !suppress_remap);
+
+  if (wait_renewal)
+    return;
+
+  /* The IP connection goes down, the PPP one comes up instead */
+  if (connection_lost)
+  {
+    if (!strcmp (external_ip, IP_ADDRESS_FIRST))
+    {
+      ip_disconnected = TRUE;
+      ppp_disconnected = FALSE;
+      gupnp_service_notify (GUPNP_SERVICE (ipservice), "ConnectionStatus",
+          G_TYPE_STRING, "Disconnected", NULL);
+    }
+    else
+    {
+      g_assert_cmpstr (external_ip, ==, PPP_ADDRESS_FIRST);
+      gupnp_simple_igd_remove_port (igd, proto, requested_external_port);
+    }
+    return;
+  }
 
   if (replaces_external_ip)
   {
@@ -225,8 +884,13 @@ mapped_external_port_cb (GUPnPSimpleIgd *igd, gchar *proto,
             !strcmp (external_ip, IP_ADDRESS_SECOND)) ||
         (!strcmp (replaces_external_ip, PPP_ADDRESS_FIRST) &&
             !strcmp (external_ip, PPP_ADDRESS_SECOND)));
-    if (dispose_removes)
+    if (mapping_handle)
+      g_clear_object (&mapping_handle);
+    else if (dispose_removes)
       g_object_unref (igd);
+    else if (shutdown_deadline)
+      gupnp_simple_igd_shutdown_async (igd, shutdown_deadline, NULL,
+          shutdown_cb, NULL);
     else if (local_remove)
       gupnp_simple_igd_remove_port_local (igd, proto, local_ip, local_port);
     else
@@ -246,18 +910,107 @@ mapped_external_port_cb (GUPnPSimpleIgd *igd, gchar *proto,
 }
 
 static void
-error_mapping_port_cb (GUPnPSimpleIgd *igd, GError *error, gchar *proto,
-    guint external_port, gchar *local_ip, guint local_port,
-    gchar *description, gpointer user_data)
+mapped_external_port_range_cb (GUPnPSimpleIgd *igd, gchar *proto,
+    gchar *external_ip, gchar *replaces_external_ip, guint external_port,
+    guint n_ports, gchar *local_ip, guint local_port, gchar *description,
+    gpointer user_data)
 {
   g_assert (proto && !strcmp (proto, "UDP"));
-  g_assert (local_ip && !strcmp (local_ip, "192.168.4.22"));
+  g_assert (!strcmp (external_ip, IP_ADDRESS_FIRST) ||
+      !strcmp (external_ip, PPP_ADDRESS_FIRST));
+  g_assert (replaces_external_ip == NULL);
+  g_assert_cmpuint (external_port, ==, INTERNAL_PORT);
+  g_assert_cmpuint (n_ports, ==, range_ports);
+  g_assert (local_ip && !strcmp (local_ip, mapped_local_ip));
+  g_assert_cmpuint (local_port, ==, INTERNAL_PORT);
   g_assert (description != NULL);
-  g_assert (local_port == INTERNAL_PORT);
 
-  if (invalid_ip && error->domain != GUPNP_CONTROL_ERROR)
-  {
-    g_assert (error);
+  /* Remove it once it is mapped on both routers, and once more after it
+   * was lost on the IP router */
+  if (++ranges_mapped == (break_range_renewals ? 3 : 2))
+    gupnp_simple_igd_remove_port_range (igd, proto, INTERNAL_PORT);
+
+  if (ranges_mapped == 3)
+    g_assert_cmpstr (external_ip, ==, IP_ADDRESS_FIRST);
+}
+
+static void
+error_mapping_port_range_cb (GUPnPSimpleIgd *igd, GError *error,
+    gchar *proto, guint external_port, guint n_ports, gchar *local_ip,
+    guint local_port, gchar *description, gpointer user_data)
+{
+  g_assert (break_range_renewals);
+  g_assert_error (error, GUPNP_CONTROL_ERROR, 501);
+  g_assert (proto && !strcmp (proto, "UDP"));
+  g_assert_cmpuint (n_ports, ==, range_ports);
+  g_assert_cmpuint (local_port, ==, INTERNAL_PORT);
+
+  range_errors++;
+}
+
+static void
+port_range_progress_cb (GUPnPSimpleIgd *igd, gchar *proto,
+    guint external_port, guint n_ports, guint n_mapped, gpointer user_data)
+{
+  g_assert (proto && !strcmp (proto, "UDP"));
+  g_assert_cmpuint (external_port, ==, INTERNAL_PORT);
+  g_assert_cmpuint (n_ports, ==, range_ports);
+  g_assert_cmpuint (n_mapped, >, 0);
+  g_assert_cmpuint (n_mapped, <=, n_ports);
+
+  range_progress++;
+}
+
+static void
+external_ip_changed_cb (GUPnPSimpleIgd *igd, gchar *old_ip, gchar *new_ip,
+    gchar *udn, gpointer user_data)
+{
+  MappedData *d = (MappedData *) user_data;
+
+  g_assert (new_ip);
+  g_assert (udn && udn[0]);
+
+  if (!old_ip)
+    return;
+
+  g_assert ((!strcmp (old_ip, IP_ADDRESS_FIRST) &&
+          !strcmp (new_ip, IP_ADDRESS_SECOND)) ||
+      (!strcmp (old_ip, PPP_ADDRESS_FIRST) &&
+          !strcmp (new_ip, PPP_ADDRESS_SECOND)));
+
+  router_ip_changes++;
+
+  if (suppress_remap)
+    gupnp_simple_igd_remove_port (igd, "UDP", d->port);
+}
+
+static void
+error_mapping_port_cb (GUPnPSimpleIgd *igd, GError *error, gchar *proto,
+    guint external_port, gchar *local_ip, guint local_port,
+    gchar *description, gpointer user_data)
+{
+  g_assert (proto && !strcmp (proto, "UDP"));
+  g_assert (local_ip && !strcmp (local_ip, mapped_local_ip));
+  g_assert (description != NULL);
+  g_assert (local_port == INTERNAL_PORT);
+  g_assert (!wait_renewal);
+
+  if (g_error_matches (error, GUPNP_SIMPLE_IGD_ERROR,
+          GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS))
+    address_errors++;
+
+  if (always_conflict)
+  {
+    g_assert_error (error, GUPNP_SIMPLE_IGD_ERROR,
+        GUPNP_SIMPLE_IGD_ERROR_NO_FREE_PORT);
+    if (++no_free_port_errors == 2)
+      g_main_loop_quit (loop);
+    return;
+  }
+
+  if (invalid_ip && error->domain != GUPNP_CONTROL_ERROR)
+  {
+    g_assert (error);
     g_assert (error->domain == GUPNP_SIMPLE_IGD_ERROR);
     g_assert (error->code == GUPNP_SIMPLE_IGD_ERROR_EXTERNAL_ADDRESS);
     g_assert (error->message);
@@ -269,6 +1022,84 @@ error_mapping_port_cb (GUPnPSimpleIgd *igd, GError *error, gchar *proto,
 #endif
 }
 
+static void
+add_port_async_queued_cb (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  GUPnPSimpleIgd *igd = user_data;
+  GError *error = NULL;
+
+  g_assert (!gupnp_simple_igd_add_port_finish (igd, res, NULL, NULL,
+          &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&error);
+
+  queued_add_cancelled = TRUE;
+}
+
+static void
+add_port_async_router_gone_cb (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  GUPnPSimpleIgd *igd = user_data;
+  GError *error = NULL;
+
+  g_assert (!gupnp_simple_igd_add_port_finish (igd, res, NULL, NULL,
+          &error));
+  g_assert_error (error, GUPNP_SIMPLE_IGD_ERROR,
+      GUPNP_SIMPLE_IGD_ERROR_MAPPING_FAILED);
+  g_clear_error (&error);
+
+  async_mapped = FALSE;
+  g_main_loop_quit (loop);
+}
+
+static void
+add_port_async_cb (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  GUPnPSimpleIgd *igd = user_data;
+  GError *error = NULL;
+  gchar *external_ip = NULL;
+  guint external_port = 0;
+
+  g_assert (source_object == G_OBJECT (igd));
+  g_assert (gupnp_simple_igd_add_port_finish (igd, res, &external_ip,
+          &external_port, &error));
+  g_assert_no_error (error);
+  g_assert (!strcmp (external_ip, IP_ADDRESS_FIRST) ||
+      !strcmp (external_ip, PPP_ADDRESS_FIRST));
+  g_assert (external_port == INTERNAL_PORT);
+  g_free (external_ip);
+
+  async_mapped = TRUE;
+}
+
+static void
+handle_mapped_cb (GUPnPIgdMapping *mapping, gchar *external_ip,
+    guint external_port, gpointer user_data)
+{
+  g_assert (!strcmp (external_ip, IP_ADDRESS_FIRST) ||
+      !strcmp (external_ip, PPP_ADDRESS_FIRST));
+  g_assert (external_port == INTERNAL_PORT);
+  g_assert (gupnp_igd_mapping_get_state (mapping) ==
+      GUPNP_IGD_MAPPING_STATE_MAPPED);
+
+  handle_events |= 1;
+}
+
+static void
+handle_external_ip_changed_cb (GUPnPIgdMapping *mapping, gchar *old_ip,
+    gchar *new_ip, gpointer user_data)
+{
+  g_assert ((!strcmp (old_ip, IP_ADDRESS_FIRST) &&
+          !strcmp (new_ip, IP_ADDRESS_SECOND)) ||
+      (!strcmp (old_ip, PPP_ADDRESS_FIRST) &&
+          !strcmp (new_ip, PPP_ADDRESS_SECOND)));
+
+  handle_events |= 2;
+}
+
 static gboolean
 ignore_non_localhost (GUPnPSimpleIgd *igd, GUPnPContext *gupnp_context,
     gpointer user_data)
@@ -280,6 +1111,49 @@ ignore_non_localhost (GUPnPSimpleIgd *igd, GUPnPContext *gupnp_context,
     return TRUE;
 }
 
+static void
+send_msearch_answer (GSocket *socket, GSocketAddress *address,
+    const gchar *location)
+{
+  gchar *answer = g_strdup_printf ("HTTP/1.1 200 OK\r\n"
+      "CACHE-CONTROL: max-age=1800\r\n"
+      "LOCATION: %s\r\n"
+      "ST: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+      "\r\n", location);
+
+  g_assert_cmpint (g_socket_send_to (socket, address, answer, strlen (answer),
+          NULL, NULL), ==, strlen (answer));
+  g_free (answer);
+}
+
+/* Answers the unicast M-SEARCH of the gateway probe for the fake router,
+ * after an answer from another host and one pointing to another host */
+static gboolean
+gateway_responder_cb (GSocket *socket, GIOCondition condition,
+    gpointer user_data)
+{
+  GSocket *other_host = user_data;
+  GSocketAddress *sender = NULL;
+  gchar buffer[2048];
+
+  if (g_socket_receive_from (socket, &sender, buffer, sizeof (buffer), NULL,
+          NULL) <= 0)
+  {
+    g_clear_object (&sender);
+    return G_SOURCE_CONTINUE;
+  }
+
+  g_assert (fake_igd);
+  send_msearch_answer (other_host, sender,
+      gupnp_device_info_get_location (GUPNP_DEVICE_INFO (fake_igd)));
+  send_msearch_answer (socket, sender, "http://127.0.0.2:1/igd.xml");
+  send_msearch_answer (socket, sender,
+      gupnp_device_info_get_location (GUPNP_DEVICE_INFO (fake_igd)));
+  g_object_unref (sender);
+
+  return G_SOURCE_CONTINUE;
+}
+
 static void
 run_gupnp_simple_igd_test (GMainContext *mainctx, GUPnPSimpleIgd *igd,
     guint requested_port)
@@ -292,13 +1166,19 @@ run_gupnp_simple_igd_test (GMainContext *mainctx, GUPnPSimpleIgd *igd,
   GError *error = NULL;
   GInetAddress *loopback = NULL;
 
+  add_port_mapping_calls = 0;
+  add_any_port_mapping_calls = 0;
+  removal_deleted = FALSE;
+  memset (table_deleted, 0, sizeof (table_deleted));
+
   g_signal_connect (igd, "context-available",
         G_CALLBACK (ignore_non_localhost), NULL);
 
   if (mainctx)
     g_main_context_push_thread_default (mainctx);
   loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
-  context = gupnp_context_new_for_address (loopback, 0, GSSDP_UDA_VERSION_1_0, NULL);
+  context = gupnp_context_new_for_address (loopback, router_port,
+      GSSDP_UDA_VERSION_1_0, NULL);
   g_object_unref (loopback);
   g_assert (context);
 
@@ -306,9 +1186,11 @@ run_gupnp_simple_igd_test (GMainContext *mainctx, GUPnPSimpleIgd *igd,
     xml_path = g_getenv ("XML_PATH");
 
 
-  dev = gupnp_root_device_new (context, "InternetGatewayDevice.xml", xml_path, &error);
+  dev = gupnp_root_device_new (context, device_description, xml_path,
+      &error);
   g_assert (dev);
   g_assert (error == NULL);
+  fake_igd = dev;
 
   subdev1 = gupnp_device_info_get_device (GUPNP_DEVICE_INFO (dev),
       "urn:schemas-upnp-org:device:WANDevice:1");
@@ -319,8 +1201,7 @@ run_gupnp_simple_igd_test (GMainContext *mainctx, GUPnPSimpleIgd *igd,
   g_assert (subdev2);
   g_object_unref (subdev1);
 
-  ipservice = gupnp_device_info_get_service (subdev2,
-      "urn:schemas-upnp-org:service:WANIPConnection:1");
+  ipservice = gupnp_device_info_get_service (subdev2, ip_service_type);
   g_assert (ipservice);
   pppservice = gupnp_device_info_get_service (subdev2,
       "urn:schemas-upnp-org:service:WANPPPConnection:1");
@@ -333,6 +1214,17 @@ run_gupnp_simple_igd_test (GMainContext *mainctx, GUPnPSimpleIgd *igd,
       G_CALLBACK (add_port_mapping_cb), GUINT_TO_POINTER (requested_port));;
   g_signal_connect (ipservice, "action-invoked::DeletePortMapping",
       G_CALLBACK (delete_port_mapping_cb), GUINT_TO_POINTER (requested_port));
+  g_signal_connect (ipservice, "action-invoked::GetGenericPortMappingEntry",
+      G_CALLBACK (get_generic_port_mapping_entry_cb), NULL);
+  g_signal_connect (ipservice, "action-invoked::AddAnyPortMapping",
+      G_CALLBACK (add_any_port_mapping_cb), NULL);
+  g_signal_connect (ipservice, "action-invoked::DeletePortMappingRange",
+      G_CALLBACK (delete_port_mapping_range_cb), NULL);
+  g_signal_connect (ipservice, "action-invoked::GetStatusInfo",
+      G_CALLBACK (get_status_info_cb), GINT_TO_POINTER (CONNECTION_IP));
+  g_signal_connect (ipservice, "query-variable::ConnectionStatus",
+      G_CALLBACK (query_connection_status_cb),
+      GINT_TO_POINTER (CONNECTION_IP));
 
   g_signal_connect (pppservice, "action-invoked::GetExternalIPAddress",
       G_CALLBACK (get_external_ip_address_cb),
@@ -341,9 +1233,16 @@ run_gupnp_simple_igd_test (GMainContext *mainctx, GUPnPSimpleIgd *igd,
       G_CALLBACK (add_port_mapping_cb), GUINT_TO_POINTER (requested_port));
   g_signal_connect (pppservice, "action-invoked::DeletePortMapping",
       G_CALLBACK (delete_port_mapping_cb), GUINT_TO_POINTER (requested_port));
+  g_signal_connect (pppservice, "action-invoked::GetGenericPortMappingEntry",
+      G_CALLBACK (get_generic_port_mapping_entry_cb), NULL);
+  g_signal_connect (pppservice, "action-invoked::GetStatusInfo",
+      G_CALLBACK (get_status_info_cb), GINT_TO_POINTER (CONNECTION_PPP));
+  g_signal_connect (pppservice, "query-variable::ConnectionStatus",
+      G_CALLBACK (query_connection_status_cb),
+      GINT_TO_POINTER (CONNECTION_PPP));
 
-
-  gupnp_root_device_set_available (dev, TRUE);
+  if (!announce_after_add)
+    gupnp_root_device_set_available (dev, TRUE);
 
   MappedData d;
   d.context = mainctx;
@@ -353,16 +1252,94 @@ run_gupnp_simple_igd_test (GMainContext *mainctx, GUPnPSimpleIgd *igd,
       G_CALLBACK (mapped_external_port_cb), &d);
   g_signal_connect (igd, "error-mapping-port",
       G_CALLBACK (error_mapping_port_cb), NULL);
+  g_signal_connect (igd, "external-ip-changed",
+      G_CALLBACK (external_ip_changed_cb), &d);
+  g_signal_connect (igd, "mapped-external-port-range",
+      G_CALLBACK (mapped_external_port_range_cb), NULL);
+  g_signal_connect (igd, "port-range-progress",
+      G_CALLBACK (port_range_progress_cb), NULL);
+  g_signal_connect (igd, "error-mapping-port-range",
+      G_CALLBACK (error_mapping_port_range_cb), NULL);
+
+  if (use_add_ports)
+  {
+    GUPnPSimpleIgdPortSpec *specs = g_new0 (GUPnPSimpleIgdPortSpec,
+        extra_mappings + 1);
+    guint i;
+
+    /* Each spec has its own strings, freed before the batch is handled */
+    for (i = 0; i <= extra_mappings; i++)
+    {
+      specs[i].protocol = g_strdup ("UDP");
+      specs[i].external_port = requested_port + i;
+      specs[i].local_ip = g_strdup (mapped_local_ip);
+      specs[i].local_port = INTERNAL_PORT;
+      specs[i].lease_duration = test_lease;
+      specs[i].description = g_strdup_printf ("GUPnP Simple IGD test %u", i);
+    }
+
+    gupnp_simple_igd_add_ports (igd, specs, extra_mappings + 1);
+
+    for (i = 0; i <= extra_mappings; i++)
+    {
+      g_free ((gchar *) specs[i].protocol);
+      g_free ((gchar *) specs[i].local_ip);
+      g_free ((gchar *) specs[i].description);
+    }
+    g_free (specs);
+  }
+  else if (use_handle)
+  {
+    mapping_handle = gupnp_simple_igd_add_mapping (igd, "UDP", requested_port,
+        mapped_local_ip, INTERNAL_PORT, test_lease, "GUPnP Simple IGD test");
+    g_signal_connect (mapping_handle, "mapped",
+        G_CALLBACK (handle_mapped_cb), NULL);
+    g_signal_connect (mapping_handle, "external-ip-changed",
+        G_CALLBACK (handle_external_ip_changed_cb), NULL);
+  }
+  else if (use_async)
+  {
+    gupnp_simple_igd_add_port_async (igd, "UDP", requested_port,
+        mapped_local_ip, INTERNAL_PORT, test_lease, "GUPnP Simple IGD test",
+        NULL, router_vanishes ? add_port_async_router_gone_cb :
+        add_port_async_cb, igd);
+  }
+  else if (range_ports)
+  {
+    gupnp_simple_igd_add_port_range (igd, "UDP", requested_port,
+        mapped_local_ip, INTERNAL_PORT, range_ports, test_lease,
+        "GUPnP Simple IGD test");
+  }
+  else
+  {
+    guint i;
 
-  gupnp_simple_igd_add_port (igd, "UDP", requested_port, "192.168.4.22",
-      INTERNAL_PORT, 10, "GUPnP Simple IGD test");
+    if (!late_add_igd)
+      gupnp_simple_igd_add_port (igd, "UDP", requested_port, mapped_local_ip,
+          INTERNAL_PORT, test_lease, "GUPnP Simple IGD test");
+
+    for (i = 1; i <= extra_mappings; i++)
+      gupnp_simple_igd_add_port (igd, "UDP", requested_port + i,
+          mapped_local_ip, INTERNAL_PORT, test_lease, "GUPnP Simple IGD test");
+  }
+
+  /* The routers never see it, its port would fail add_port_mapping_cb() */
+  if (queued_cancellable)
+    gupnp_simple_igd_add_port_async (igd, "UDP", requested_port + 1,
+        mapped_local_ip, INTERNAL_PORT, test_lease, "GUPnP Simple IGD test",
+        queued_cancellable, add_port_async_queued_cb, igd);
 
   loop = g_main_loop_new (mainctx, FALSE);
   g_main_loop_run (loop);
   g_main_loop_unref (loop);
 
+  while (held_actions && held_actions->len)
+    gupnp_service_action_return_success (g_ptr_array_steal_index (
+            held_actions, held_actions->len - 1));
+
   gupnp_root_device_set_available (dev, FALSE);
   g_object_unref (dev);
+  fake_igd = NULL;
 
   if (mainctx)
     g_main_context_pop_thread_default (mainctx);
@@ -379,112 +1356,1141 @@ test_gupnp_simple_igd_default_ctx (void)
   g_object_unref (igd);
 }
 
-static void
-test_gupnp_simple_igd_default_ctx_local (void)
+static gchar *
+read_cached_control_url (const gchar *path)
 {
-  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+  GKeyFile *cache = g_key_file_new ();
+  gchar **groups;
+  gchar *control_url;
+
+  g_assert (g_key_file_load_from_file (cache, path, G_KEY_FILE_NONE, NULL));
+  groups = g_key_file_get_groups (cache, NULL);
+  g_assert (groups[0]);
+  control_url = g_key_file_get_string (cache, groups[0], "control-url", NULL);
+  g_assert (control_url);
+  g_strfreev (groups);
+  g_key_file_unref (cache);
+
+  return control_url;
+}
 
-  local_remove = TRUE;
+static void
+test_gupnp_simple_igd_single_control_point (void)
+{
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "single-control-point", TRUE, NULL);
 
   run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
   g_object_unref (igd);
-
-  local_remove = FALSE;
 }
 
+/* The PPP connection of the router is down, only its IP connection may be
+ * used */
 static void
-test_gupnp_simple_igd_custom_ctx (void)
+test_gupnp_simple_igd_single_connection (void)
 {
-  GMainContext *mainctx = g_main_context_new ();
-  GUPnPSimpleIgd *igd;
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "single-connection", TRUE, NULL);
 
-  g_main_context_push_thread_default (mainctx);
-  igd = gupnp_simple_igd_new ();
-  g_main_context_pop_thread_default (mainctx);
-
-  run_gupnp_simple_igd_test (mainctx, igd, INTERNAL_PORT);
+  ppp_disconnected = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
   g_object_unref (igd);
-  g_main_context_unref (mainctx);
+  ppp_disconnected = FALSE;
 }
 
-
+/* Neither connection of the router is up, one of them is used anyway
+ * until the IP connection says with an event that it is connected */
 static void
-test_gupnp_simple_igd_thread (void)
+test_gupnp_simple_igd_single_connection_none_connected (void)
 {
-  GUPnPSimpleIgdThread *igd = gupnp_simple_igd_thread_new ();
-  GMainContext *mainctx = g_main_context_new ();
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "single-connection", TRUE, NULL);
 
-  run_gupnp_simple_igd_test (mainctx, GUPNP_SIMPLE_IGD (igd), INTERNAL_PORT);
+  ppp_disconnected = TRUE;
+  ip_disconnected = TRUE;
+  held_actions = g_ptr_array_new ();
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
   g_object_unref (igd);
-  g_main_context_unref (mainctx);
-}
+  g_clear_pointer (&held_actions, g_ptr_array_unref);
+
+  g_assert_cmpuint (fallbacks_used, ==, 1);
+  g_assert_false (ip_disconnected);
+  g_assert_cmpuint (standby_deletes, <=, 1);
 
+  ppp_disconnected = FALSE;
+  fallbacks_used = 0;
+  standby_deletes = 0;
+}
 
+/* The IP connection goes down once the port is mapped on it, the port is
+ * deleted there and mapped on the PPP connection that came up instead */
 static void
-test_gupnp_simple_igd_random_no_conflict (void)
+test_gupnp_simple_igd_single_connection_lost (void)
 {
-  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "single-connection", TRUE, NULL);
 
-  run_gupnp_simple_igd_test (NULL, igd, 0);
+  ppp_disconnected = TRUE;
+  connection_lost = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
   g_object_unref (igd);
-}
 
+  g_assert_cmpuint (standby_deletes, ==, 1);
+  g_assert_false (ppp_disconnected);
+
+  ip_disconnected = FALSE;
+  connection_lost = FALSE;
+  standby_deletes = 0;
+}
 
+/* Both services are on the first router that is found, they are both
+ * used */
 static void
-test_gupnp_simple_igd_random_conflict (void)
+test_gupnp_simple_igd_routing_policy_first (void)
 {
-  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "routing-policy", GUPNP_SIMPLE_IGD_ROUTING_POLICY_FIRST, NULL);
 
-  return_conflict = TRUE;
-  run_gupnp_simple_igd_test (NULL, igd, 0);
-  return_conflict = FALSE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
   g_object_unref (igd);
 }
 
+/* The routers of the routing policy tests count the mappings they get */
+static void
+policy_add_port_mapping_cb (GUPnPService *service,
+    GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  guint router = GPOINTER_TO_UINT (user_data);
+  guint external_port = 0;
+
+  policy_router_adds[router]++;
+
+  if (!strcmp (gupnp_service_action_get_name (action), "AddAnyPortMapping"))
+  {
+    gupnp_service_action_get (action,
+        "NewExternalPort", G_TYPE_UINT, &external_port,
+        NULL);
+    gupnp_service_action_set (action,
+        "NewReservedPort", G_TYPE_UINT, external_port,
+        NULL);
+  }
+
+  gupnp_service_action_return_success (action);
+}
 
 static void
-test_gupnp_simple_igd_dispose_removes (void)
+policy_delete_port_mapping_cb (GUPnPService *service,
+    GUPnPServiceAction *action,
+    gpointer user_data)
 {
-  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+  gupnp_service_action_return_success (action);
+}
 
-  dispose_removes = TRUE;
-  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
-  dispose_removes = FALSE;
+static GUPnPRootDevice *
+policy_router_new (GUPnPContext *context, const gchar *description,
+    guint router)
+{
+  const gchar *xml_path = ".";
+  GUPnPRootDevice *dev;
+  GUPnPDeviceInfo *subdev1;
+  GUPnPDeviceInfo *subdev2;
+  GList *services;
+  GList *item;
+  GError *error = NULL;
+
+  if (g_getenv ("XML_PATH"))
+    xml_path = g_getenv ("XML_PATH");
+
+  dev = gupnp_root_device_new (context, description, xml_path, &error);
+  g_assert (dev);
+  g_assert (error == NULL);
+
+  subdev1 = gupnp_device_info_get_device (GUPNP_DEVICE_INFO (dev),
+      "urn:schemas-upnp-org:device:WANDevice:1");
+  g_assert (subdev1);
+  subdev2 = gupnp_device_info_get_device (subdev1,
+      "urn:schemas-upnp-org:device:WANConnectionDevice:1");
+  g_assert (subdev2);
+  g_object_unref (subdev1);
+
+  /* The services only answer while they are alive */
+  services = gupnp_device_info_list_services (subdev2);
+  for (item = services; item; item = item->next)
+  {
+    g_signal_connect (item->data, "action-invoked::GetExternalIPAddress",
+        G_CALLBACK (get_external_ip_address_cb),
+        GINT_TO_POINTER (CONNECTION_IP));
+    g_signal_connect (item->data, "action-invoked::GetStatusInfo",
+        G_CALLBACK (get_status_info_cb), GINT_TO_POINTER (CONNECTION_IP));
+    g_signal_connect (item->data, "query-variable::ConnectionStatus",
+        G_CALLBACK (query_connection_status_cb),
+        GINT_TO_POINTER (CONNECTION_IP));
+    g_signal_connect (item->data, "action-invoked::AddPortMapping",
+        G_CALLBACK (policy_add_port_mapping_cb), GUINT_TO_POINTER (router));
+    g_signal_connect (item->data, "action-invoked::AddAnyPortMapping",
+        G_CALLBACK (policy_add_port_mapping_cb), GUINT_TO_POINTER (router));
+    g_signal_connect (item->data, "action-invoked::DeletePortMapping",
+        G_CALLBACK (policy_delete_port_mapping_cb), NULL);
+  }
+  policy_services = g_list_concat (policy_services, services);
+  g_object_unref (subdev2);
+
+  gupnp_root_device_set_available (dev, TRUE);
+
+  return dev;
 }
 
+static gboolean
+policy_settled (gpointer user_data)
+{
+  g_clear_pointer (&policy_settle_src, g_source_unref);
+  g_main_loop_quit (loop);
+
+  return G_SOURCE_REMOVE;
+}
 
+/* Leaves the other router time to get the mapping too */
 static void
-test_gupnp_simple_igd_dispose_removes_thread (void)
+policy_mapped_cb (GUPnPSimpleIgd *igd, gchar *proto,
+    gchar *external_ip, gchar *replaces_external_ip, guint external_port,
+    gchar *local_ip, guint local_port, gchar *description, gpointer user_data)
 {
-  GUPnPSimpleIgdThread *igd = gupnp_simple_igd_thread_new ();
-  GMainContext *mainctx = g_main_context_new ();
+  if (policy_settle_src)
+    return;
 
-  dispose_removes = TRUE;
-  run_gupnp_simple_igd_test (mainctx, GUPNP_SIMPLE_IGD (igd), INTERNAL_PORT);
-  dispose_removes = FALSE;
-  g_main_context_unref (mainctx);
+  policy_settle_src = g_timeout_source_new (POLICY_SETTLE_TIME);
+  g_source_set_callback (policy_settle_src, policy_settled, NULL, NULL);
+  g_source_attach (policy_settle_src, NULL);
+}
+
+/* Only one of the two routers gets the mapping, the other one gets it once
+ * the first one goes away */
+static void
+run_routing_policy_test (GUPnPSimpleIgd *igd)
+{
+  GInetAddress *loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  GUPnPContext *contexts[2];
+  guint chosen;
+  guint i;
+
+  g_signal_connect (igd, "context-available",
+        G_CALLBACK (ignore_non_localhost), NULL);
+  g_signal_connect (igd, "mapped-external-port",
+      G_CALLBACK (policy_mapped_cb), NULL);
+
+  for (i = 0; i < 2; i++)
+  {
+    contexts[i] = gupnp_context_new_for_address (loopback, 0,
+        GSSDP_UDA_VERSION_1_0, NULL);
+    g_assert (contexts[i]);
+  }
+  g_object_unref (loopback);
+
+  policy_routers[0] = policy_router_new (contexts[0],
+      "InternetGatewayDevice.xml", 0);
+  policy_routers[1] = policy_router_new (contexts[1],
+      "InternetGatewayDevice2.xml", 1);
+
+  gupnp_simple_igd_add_port (igd, "UDP", INTERNAL_PORT, "192.168.4.22",
+      INTERNAL_PORT, test_lease, "GUPnP Simple IGD test");
+
+  loop = g_main_loop_new (NULL, FALSE);
+  g_main_loop_run (loop);
+
+  g_assert_cmpuint (!policy_router_adds[0] + !policy_router_adds[1], ==, 1);
+  chosen = policy_router_adds[0] ? 0 : 1;
+
+  gupnp_root_device_set_available (policy_routers[chosen], FALSE);
+  g_main_loop_run (loop);
+  g_main_loop_unref (loop);
+
+  g_assert_cmpuint (policy_router_adds[!chosen], >, 0);
+
+  for (i = 0; i < 2; i++)
+  {
+    gupnp_root_device_set_available (policy_routers[i], FALSE);
+    g_clear_object (&policy_routers[i]);
+    g_object_unref (contexts[i]);
+    policy_router_adds[i] = 0;
+  }
+  g_list_free_full (policy_services, g_object_unref);
+  policy_services = NULL;
 }
 
+static void
+test_gupnp_simple_igd_routing_policy_first_two_routers (void)
+{
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "routing-policy", GUPNP_SIMPLE_IGD_ROUTING_POLICY_FIRST, NULL);
+
+  run_routing_policy_test (igd);
+  g_object_unref (igd);
+}
 
+/* Neither router is the default gateway, the first one is used */
 static void
-test_gupnp_simple_igd_invalid_ip(void)
+test_gupnp_simple_igd_routing_policy_default_route (void)
 {
-  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "routing-policy", GUPNP_SIMPLE_IGD_ROUTING_POLICY_DEFAULT_ROUTE, NULL);
 
-  invalid_ip = "asdas";
-  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
-  invalid_ip = NULL;
+  _gupnp_simple_igd_set_gateway (igd, "192.168.4.1", 0);
+  run_routing_policy_test (igd);
   g_object_unref (igd);
 }
+
+/* The router of the second run listens on another port, the one read from
+ * the cache must be replaced by the one found by SSDP */
 static void
-test_gupnp_simple_igd_empty_ip(void)
+test_gupnp_simple_igd_discovery_cache (void)
 {
-  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+  gchar *dir = g_dir_make_tmp ("gupnp-igd-XXXXXX", NULL);
+  gchar *path = g_build_filename (dir, "routers", NULL);
+  GUPnPSimpleIgd *igd;
+  gchar *first_url;
+  gchar *second_url;
 
-  invalid_ip = "";
+  igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD, "discovery-cache", path, NULL);
   run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
-  invalid_ip = NULL;
   g_object_unref (igd);
+  first_url = read_cached_control_url (path);
+
+  igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD, "discovery-cache", path, NULL);
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_object_unref (igd);
+  second_url = read_cached_control_url (path);
+
+  g_assert_cmpstr (first_url, !=, second_url);
+
+  g_free (first_url);
+  g_free (second_url);
+  g_unlink (path);
+  g_rmdir (dir);
+  g_free (path);
+  g_free (dir);
+}
+
+/* The router of the second run is at the same address but only announces
+ * itself once it got the first AddPortMapping, sent to the cached router
+ * without waiting for SSDP */
+static void
+test_gupnp_simple_igd_discovery_cache_fast (void)
+{
+  gchar *dir = g_dir_make_tmp ("gupnp-igd-XXXXXX", NULL);
+  gchar *path = g_build_filename (dir, "routers", NULL);
+  GUPnPSimpleIgd *igd;
+  gchar *first_url;
+  gchar *second_url;
+  GUri *uri;
+
+  igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD, "discovery-cache", path, NULL);
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_object_unref (igd);
+  first_url = read_cached_control_url (path);
+
+  uri = g_uri_parse (first_url, G_URI_FLAGS_NONE, NULL);
+  g_assert (uri);
+  router_port = g_uri_get_port (uri);
+  g_uri_unref (uri);
+
+  announce_after_add = TRUE;
+  igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD, "discovery-cache", path, NULL);
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_object_unref (igd);
+  second_url = read_cached_control_url (path);
+
+  g_assert (added_before_announce);
+  g_assert_cmpstr (first_url, ==, second_url);
+
+  router_port = 0;
+  announce_after_add = FALSE;
+  added_before_announce = FALSE;
+  g_free (first_url);
+  g_free (second_url);
+  g_unlink (path);
+  g_rmdir (dir);
+  g_free (path);
+  g_free (dir);
+}
+
+static GSocket *
+bound_udp_socket (const gchar *host)
+{
+  GInetAddress *inet_address = g_inet_address_new_from_string (host);
+  GSocketAddress *address = g_inet_socket_address_new (inet_address, 0);
+  GSocket *socket = g_socket_new (G_SOCKET_FAMILY_IPV4,
+      G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+
+  g_assert (socket);
+  g_assert (g_socket_bind (socket, address, FALSE, NULL));
+  g_object_unref (address);
+  g_object_unref (inet_address);
+
+  return socket;
+}
+
+/* The router only announces itself once it got the first AddPortMapping,
+ * it must be found by the unicast M-SEARCH to the gateway */
+static void
+test_gupnp_simple_igd_probe_gateway (void)
+{
+  GSocket *responder = bound_udp_socket ("127.0.0.1");
+  GSocket *other_host = bound_udp_socket ("127.0.0.2");
+  GSocketAddress *address = g_socket_get_local_address (responder, NULL);
+  GUPnPSimpleIgd *igd;
+  GSource *src;
+
+  src = g_socket_create_source (responder, G_IO_IN, NULL);
+  g_source_set_callback (src, (GSourceFunc) gateway_responder_cb, other_host,
+      NULL);
+  g_source_attach (src, NULL);
+
+  announce_after_add = TRUE;
+  igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD, "probe-gateway", TRUE, NULL);
+  _gupnp_simple_igd_set_gateway (igd, "127.0.0.1",
+      g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address)));
+  g_object_unref (address);
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_object_unref (igd);
+
+  g_assert (added_before_announce);
+
+  announce_after_add = FALSE;
+  added_before_announce = FALSE;
+  g_source_destroy (src);
+  g_source_unref (src);
+  g_object_unref (responder);
+  g_object_unref (other_host);
+}
+
+static void
+test_gupnp_simple_igd_default_ctx_local (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  local_remove = TRUE;
+
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_object_unref (igd);
+
+  local_remove = FALSE;
+}
+
+static void
+test_gupnp_simple_igd_custom_ctx (void)
+{
+  GMainContext *mainctx = g_main_context_new ();
+  GUPnPSimpleIgd *igd;
+
+  g_main_context_push_thread_default (mainctx);
+  igd = gupnp_simple_igd_new ();
+  g_main_context_pop_thread_default (mainctx);
+
+  run_gupnp_simple_igd_test (mainctx, igd, INTERNAL_PORT);
+  g_object_unref (igd);
+  g_main_context_unref (mainctx);
+}
+
+
+static void
+test_gupnp_simple_igd_thread (void)
+{
+  GUPnPSimpleIgdThread *igd = gupnp_simple_igd_thread_new ();
+  GMainContext *mainctx = g_main_context_new ();
+
+  run_gupnp_simple_igd_test (mainctx, GUPNP_SIMPLE_IGD (igd), INTERNAL_PORT);
+  g_object_unref (igd);
+  g_main_context_unref (mainctx);
+}
+
+static void
+test_gupnp_simple_igd_thread_add_ports (void)
+{
+  GUPnPSimpleIgdThread *igd = gupnp_simple_igd_thread_new ();
+  GMainContext *mainctx = g_main_context_new ();
+
+  use_add_ports = TRUE;
+  run_gupnp_simple_igd_test (mainctx, GUPNP_SIMPLE_IGD (igd), INTERNAL_PORT);
+  use_add_ports = FALSE;
+  g_object_unref (igd);
+  g_main_context_unref (mainctx);
+}
+
+/* Three specs go through the thread in one command, every one of them is
+ * mapped on both routers and then removed by the dispose */
+static void
+test_gupnp_simple_igd_thread_add_ports_batch (void)
+{
+  GUPnPSimpleIgdThread *igd = gupnp_simple_igd_thread_new ();
+  GMainContext *mainctx = g_main_context_new ();
+
+  device_description = "InternetGatewayDevice2.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:2";
+  mapped_local_ip = "127.0.0.1";
+  use_add_ports = TRUE;
+  dispose_removes = TRUE;
+  extra_mappings = 2;
+  run_gupnp_simple_igd_test (mainctx, GUPNP_SIMPLE_IGD (igd), INTERNAL_PORT);
+  g_assert_cmpuint (extra_mapped, ==, 2 * (extra_mappings + 1));
+  g_assert_cmpuint (range_deletes, ==, 1);
+  g_assert_cmpuint (single_deletes, ==, extra_mappings + 1);
+  device_description = "InternetGatewayDevice.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:1";
+  mapped_local_ip = "192.168.4.22";
+  use_add_ports = FALSE;
+  dispose_removes = FALSE;
+  extra_mappings = 0;
+  extra_mapped = 0;
+  range_deletes = 0;
+  single_deletes = 0;
+  g_main_context_unref (mainctx);
+}
+
+
+/* Each router first returns an empty address, as while its WAN link is
+ * coming up, the mapping must still be reported once it has a valid one */
+static void
+test_gupnp_simple_igd_empty_ip_retry (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  invalid_ip_replies = 2;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (invalid_ip_replies, ==, 0);
+  g_object_unref (igd);
+}
+
+/* The mapping is added while both routers are failed, it must be mapped
+ * once they have an address, and only reported as failed when added */
+static void
+test_gupnp_simple_igd_empty_ip_late_add (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  invalid_ip_replies = 4;
+  address_errors = 0;
+  late_add_igd = igd;
+  late_add_scheduled = FALSE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_true (late_add_scheduled);
+  g_assert_cmpuint (invalid_ip_replies, ==, 0);
+  g_assert_cmpuint (address_errors, ==, 2);
+  late_add_igd = NULL;
+  g_object_unref (igd);
+}
+
+/* The first renewal on each router fails, it must be retried before the
+ * lease runs out without the application hearing about it */
+static void
+test_gupnp_simple_igd_renewal_retry (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  g_object_set (igd, "renewal-jitter", 0, "renewal-coalesce-window", 0,
+      NULL);
+
+  test_lease = 2;
+  wait_renewal = TRUE;
+  failed_renewals = 2;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (failed_renewals, ==, 0);
+  g_assert_cmpuint (renewals, ==, 2);
+  test_lease = 10;
+  wait_renewal = FALSE;
+  add_port_mapping_calls = 0;
+  renewals = 0;
+
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_max_concurrent_actions (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  g_object_set (igd, "max-concurrent-actions", 1, NULL);
+
+  bounded_actions = TRUE;
+  delay_external_ip = TRUE;
+  queued_add_cancelled = FALSE;
+  queued_cancellable = g_cancellable_new ();
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_true (queued_add_cancelled);
+  g_clear_object (&queued_cancellable);
+  delay_external_ip = FALSE;
+  bounded_actions = FALSE;
+
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_renewal_spread (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+  gint64 interval, earliest, latest;
+  guint i;
+
+  g_object_set (igd, "renewal-jitter", 50, "renewal-coalesce-window", 2000,
+      NULL);
+
+  test_lease = 4;
+  extra_mappings = 5;
+  spread_renewals = TRUE;
+  ip_add_port_mapping_calls = 0;
+  renewal_times = g_array_new (FALSE, FALSE, sizeof (gint64));
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (renewal_times->len, ==, extra_mappings + 1);
+
+  /* Every renewal stays within its jittered half lease */
+  interval = test_lease / 2 * G_USEC_PER_SEC;
+  earliest = latest = g_array_index (renewal_times, gint64, 0);
+  for (i = 0; i < renewal_times->len; i++)
+  {
+    gint64 t = g_array_index (renewal_times, gint64, i) - first_add_time;
+
+    g_assert_cmpint (t, >=, interval / 2);
+    g_assert_cmpint (t, <=, interval + G_USEC_PER_SEC / 2);
+    earliest = MIN (earliest, g_array_index (renewal_times, gint64, i));
+    latest = MAX (latest, g_array_index (renewal_times, gint64, i));
+  }
+
+  /* and the batch is spread over the window rather than sent at once */
+  g_assert_cmpint (latest - earliest, >, 10 * 1000);
+
+  g_array_unref (renewal_times);
+  renewal_times = NULL;
+  spread_renewals = FALSE;
+  extra_mappings = 0;
+  test_lease = 10;
+  add_port_mapping_calls = 0;
+
+  g_object_unref (igd);
+}
+
+static gboolean
+ignore_all_contexts (GUPnPSimpleIgd *igd, GUPnPContext *gupnp_context,
+    gpointer user_data)
+{
+  return TRUE;
+}
+
+static void
+test_gupnp_simple_igd_add_port_async (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  use_async = TRUE;
+  async_mapped = FALSE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert (async_mapped);
+  use_async = FALSE;
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_add_port_async_thread (void)
+{
+  GUPnPSimpleIgdThread *igd = gupnp_simple_igd_thread_new ();
+  GMainContext *mainctx = g_main_context_new ();
+
+  use_async = TRUE;
+  async_mapped = FALSE;
+  run_gupnp_simple_igd_test (mainctx, GUPNP_SIMPLE_IGD (igd), INTERNAL_PORT);
+  g_assert (async_mapped);
+  use_async = FALSE;
+  g_object_unref (igd);
+  g_main_context_unref (mainctx);
+}
+
+/* The only router goes away before the port is known to be mapped */
+static void
+test_gupnp_simple_igd_add_port_async_router_gone (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  use_async = TRUE;
+  router_vanishes = TRUE;
+  async_mapped = TRUE;
+  held_actions = g_ptr_array_new ();
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_false (async_mapped);
+  g_clear_pointer (&held_actions, g_ptr_array_unref);
+  router_vanishes = FALSE;
+  use_async = FALSE;
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_mapping_handle (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  use_handle = TRUE;
+  handle_events = 0;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert (mapping_handle == NULL);
+  g_assert_cmpuint (handle_events, ==, 3);
+  use_handle = FALSE;
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_no_remap (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  g_object_set (igd, "remap-on-ip-change", FALSE, NULL);
+
+  suppress_remap = TRUE;
+  router_ip_changes = 0;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (router_ip_changes, >=, 1);
+  suppress_remap = FALSE;
+  g_object_unref (igd);
+}
+
+static void
+add_port_async_cancelled_cb (GObject *source_object, GAsyncResult *res,
+    gpointer user_data)
+{
+  GUPnPSimpleIgd *igd = user_data;
+  GError *error = NULL;
+
+  g_assert (!gupnp_simple_igd_add_port_finish (igd, res, NULL, NULL,
+          &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&error);
+
+  g_main_loop_quit (loop);
+}
+
+static void
+test_gupnp_simple_igd_add_port_async_cancel (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+  GCancellable *cancellable = g_cancellable_new ();
+
+  g_signal_connect (igd, "context-available",
+      G_CALLBACK (ignore_all_contexts), NULL);
+
+  gupnp_simple_igd_add_port_async (igd, "UDP", INTERNAL_PORT, "192.168.4.22",
+      INTERNAL_PORT, test_lease, "GUPnP Simple IGD test", cancellable,
+      add_port_async_cancelled_cb, igd);
+  g_cancellable_cancel (cancellable);
+
+  loop = g_main_loop_new (NULL, FALSE);
+  g_main_loop_run (loop);
+  g_main_loop_unref (loop);
+
+  g_object_unref (cancellable);
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_delayed_external_ip (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  delay_external_ip = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  delay_external_ip = FALSE;
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_random_no_conflict (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  run_gupnp_simple_igd_test (NULL, igd, 0);
+  g_object_unref (igd);
+}
+
+
+static void
+test_gupnp_simple_igd_random_conflict (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  return_conflict = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, 0);
+  return_conflict = FALSE;
+  g_object_unref (igd);
+}
+
+
+/* A router that refuses every port must not be asked forever */
+static void
+test_gupnp_simple_igd_always_conflict (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  always_conflict = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, 0);
+  g_assert_cmpuint (no_free_port_errors, ==, 2);
+  /* 8 attempts on each router */
+  g_assert_cmpuint (add_port_mapping_calls, ==, 16);
+  always_conflict = FALSE;
+  add_port_mapping_calls = 0;
+
+  g_object_unref (igd);
+}
+
+/* The routers already have the mapping, it must be taken over without
+ * adding it again and its duplicate must be cleaned up */
+static void
+test_gupnp_simple_igd_scan_port_mappings (void)
+{
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "scan-port-mappings", TRUE, NULL);
+
+  port_table = leftover_port_table;
+  port_table_len = G_N_ELEMENTS (leftover_port_table);
+  expected_stale_deletes = 2;
+  run_gupnp_simple_igd_test (NULL, igd, 0);
+  g_assert_cmpuint (add_port_mapping_calls, ==, 0);
+  g_assert_cmpuint (stale_deletes, ==, 2);
+  port_table = NULL;
+  port_table_len = 0;
+  stale_deletes = 0;
+  expected_stale_deletes = 0;
+
+  g_object_unref (igd);
+}
+
+/* The mappings must not wait for the end of a table that takes too long
+ * to read */
+static void
+test_gupnp_simple_igd_scan_port_mappings_stalled (void)
+{
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "scan-port-mappings", TRUE, NULL);
+
+  scan_stalls = TRUE;
+  held_actions = g_ptr_array_new ();
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (add_port_mapping_calls, >, 0);
+  scan_stalls = FALSE;
+  g_clear_pointer (&held_actions, g_ptr_array_unref);
+
+  g_object_unref (igd);
+}
+
+/* Only the entry of a dead instance of the same application on the same
+ * host may be deleted, deleting any other port would fail the test. It is
+ * on the port we ask for, so the add must wait for the deletion. */
+static void
+test_gupnp_simple_igd_instance_tag (void)
+{
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "instance-tag", "test", NULL);
+  gchar *dead = g_strdup_printf ("Old [test:%s:%d]", g_get_host_name (),
+      G_MAXINT - 1);
+  gchar *other_host = g_strdup_printf ("Old [test:not-%s:%d]",
+      g_get_host_name (), G_MAXINT - 1);
+  gchar *alive = g_strdup_printf ("Old [test:%s:1]", g_get_host_name ());
+  PortTableEntry table[] = {
+    { "UDP", INTERNAL_PORT, "192.168.4.22", 5555, dead, 0, TRUE },
+    { "UDP", STALE_PORT + 1, "192.168.4.23", 5555, other_host, 0, FALSE },
+    { "UDP", STALE_PORT + 2, "192.168.4.22", 5556, alive, 0, FALSE },
+    { "UDP", STALE_PORT + 3, "192.168.4.22", 5557, "Old [other:1234]", 0,
+      FALSE },
+  };
+
+  port_table = table;
+  port_table_len = G_N_ELEMENTS (table);
+  expected_stale_deletes = 2;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (stale_deletes, ==, 2);
+  port_table = NULL;
+  port_table_len = 0;
+  stale_deletes = 0;
+  expected_stale_deletes = 0;
+
+  g_object_unref (igd);
+  g_free (dead);
+  g_free (other_host);
+  g_free (alive);
+}
+
+/* Our own mapping left by the previous process is taken over after a
+ * restart instead of being deleted and added again */
+static void
+test_gupnp_simple_igd_instance_tag_adopt (void)
+{
+  GUPnPSimpleIgd *igd = g_object_new (GUPNP_TYPE_SIMPLE_IGD,
+      "instance-tag", "test", NULL);
+  gchar *ours = g_strdup_printf ("GUPnP Simple IGD test [test:%s:%d]",
+      g_get_host_name (), G_MAXINT - 1);
+  PortTableEntry table[] = {
+    { "UDP", INTERNAL_PORT, "192.168.4.22", INTERNAL_PORT, ours, 10, FALSE },
+  };
+
+  port_table = table;
+  port_table_len = G_N_ELEMENTS (table);
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (add_port_mapping_calls, ==, 0);
+  g_assert_cmpuint (stale_deletes, ==, 0);
+  port_table = NULL;
+  port_table_len = 0;
+
+  g_object_unref (igd);
+  g_free (ours);
+}
+
+/* The WANIPConnection:2 router picks a free port in a single call, the
+ * other router still goes through a conflict */
+static void
+test_gupnp_simple_igd_add_any_port_mapping (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  device_description = "InternetGatewayDevice2.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:2";
+  return_conflict = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, 0);
+  g_assert_cmpuint (add_any_port_mapping_calls, ==, 1);
+  g_assert_cmpuint (add_port_mapping_calls, ==, 2);
+  device_description = "InternetGatewayDevice.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:1";
+  return_conflict = FALSE;
+  add_any_port_mapping_calls = 0;
+  add_port_mapping_calls = 0;
+
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_dispose_removes (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  dispose_removes = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  dispose_removes = FALSE;
+}
+
+
+/* The WANIPConnection:2 router gets a single DeletePortMappingRange for
+ * the consecutive ports, the other one a DeletePortMapping for each */
+static void
+test_gupnp_simple_igd_dispose_removes_range (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  device_description = "InternetGatewayDevice2.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:2";
+  mapped_local_ip = "127.0.0.1";
+  dispose_removes = TRUE;
+  extra_mappings = 2;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (range_deletes, ==, 1);
+  g_assert_cmpuint (single_deletes, ==, extra_mappings + 1);
+  device_description = "InternetGatewayDevice.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:1";
+  mapped_local_ip = "192.168.4.22";
+  dispose_removes = FALSE;
+  extra_mappings = 0;
+  extra_mapped = 0;
+  range_deletes = 0;
+  single_deletes = 0;
+}
+
+/* DeletePortMappingRange would leave the entries of another host in
+ * place, they are all deleted one by one */
+static void
+test_gupnp_simple_igd_dispose_removes_range_other_host (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  device_description = "InternetGatewayDevice2.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:2";
+  dispose_removes = TRUE;
+  extra_mappings = 2;
+  expected_range_deletes = 0;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (range_deletes, ==, 0);
+  g_assert_cmpuint (single_deletes, ==, 2 * (extra_mappings + 1));
+  device_description = "InternetGatewayDevice.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:1";
+  dispose_removes = FALSE;
+  extra_mappings = 0;
+  extra_mapped = 0;
+  expected_range_deletes = 1;
+  single_deletes = 0;
+}
+
+/* The range is reported as a whole and removed with a single
+ * DeletePortMappingRange on the WANIPConnection:2 router */
+static void
+test_gupnp_simple_igd_port_range (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  device_description = "InternetGatewayDevice2.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:2";
+  mapped_local_ip = "127.0.0.1";
+  range_ports = 3;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (ranges_mapped, ==, 2);
+  g_assert_cmpuint (range_progress, ==, 2 * range_ports);
+  g_assert_cmpuint (range_deletes, ==, 1);
+  g_assert_cmpuint (single_deletes, ==, range_ports);
+  g_object_unref (igd);
+  device_description = "InternetGatewayDevice.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:1";
+  mapped_local_ip = "192.168.4.22";
+  range_ports = 0;
+  ranges_mapped = 0;
+  range_progress = 0;
+  range_deletes = 0;
+  single_deletes = 0;
+}
+
+/* The range goes on the same ports as the local ones, and is removed by
+ * its first external port */
+static void
+test_gupnp_simple_igd_port_range_same_port (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  device_description = "InternetGatewayDevice2.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:2";
+  mapped_local_ip = "127.0.0.1";
+  range_ports = 3;
+  run_gupnp_simple_igd_test (NULL, igd, 0);
+  g_assert_cmpuint (ranges_mapped, ==, 2);
+  g_assert_cmpuint (range_deletes, ==, 1);
+  g_assert_cmpuint (single_deletes, ==, range_ports);
+  g_object_unref (igd);
+  device_description = "InternetGatewayDevice.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:1";
+  mapped_local_ip = "192.168.4.22";
+  range_ports = 0;
+  ranges_mapped = 0;
+  range_progress = 0;
+  range_deletes = 0;
+  single_deletes = 0;
+}
+
+/* The IP router fails every renewal of the range until its lease runs
+ * out, the range is reported lost once and mapped again by the next
+ * renewal */
+static void
+test_gupnp_simple_igd_port_range_renewal_lost (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  g_object_set (igd, "renewal-jitter", 0, "renewal-coalesce-window", 0,
+      NULL);
+
+  device_description = "InternetGatewayDevice2.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:2";
+  mapped_local_ip = "127.0.0.1";
+  range_ports = 3;
+  test_lease = 2;
+  break_range_renewals = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (range_errors, ==, 1);
+  g_assert_cmpuint (ranges_mapped, ==, 3);
+  g_assert_cmpuint (range_progress, ==, 3 * range_ports);
+  g_assert_cmpuint (range_deletes, ==, 1);
+  g_assert_cmpuint (single_deletes, ==, range_ports);
+  g_object_unref (igd);
+  device_description = "InternetGatewayDevice.xml";
+  ip_service_type = "urn:schemas-upnp-org:service:WANIPConnection:1";
+  mapped_local_ip = "192.168.4.22";
+  range_ports = 0;
+  test_lease = 10;
+  break_range_renewals = FALSE;
+  ranges_mapped = 0;
+  range_progress = 0;
+  range_errors = 0;
+  range_deletes = 0;
+  single_deletes = 0;
+}
+
+static void
+test_gupnp_simple_igd_shutdown_async (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  shutdown_deadline = 5000;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_true (shutdown_done);
+  shutdown_deadline = 0;
+  shutdown_done = FALSE;
+  g_object_unref (igd);
+}
+
+/* The routers answer the deletions after the deadline */
+static void
+test_gupnp_simple_igd_shutdown_async_deadline (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  shutdown_deadline = 100;
+  slow_deletes = TRUE;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_true (shutdown_done);
+  shutdown_deadline = 0;
+  slow_deletes = FALSE;
+  shutdown_done = FALSE;
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_dispose_removes_thread (void)
+{
+  GUPnPSimpleIgdThread *igd = gupnp_simple_igd_thread_new ();
+  GMainContext *mainctx = g_main_context_new ();
+
+  dispose_removes = TRUE;
+  run_gupnp_simple_igd_test (mainctx, GUPNP_SIMPLE_IGD (igd), INTERNAL_PORT);
+  dispose_removes = FALSE;
+  g_main_context_unref (mainctx);
+}
+
+
+static void
+test_gupnp_simple_igd_invalid_ip(void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  invalid_ip = "asdas";
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  invalid_ip = NULL;
+  g_object_unref (igd);
+}
+static void
+test_gupnp_simple_igd_empty_ip(void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  invalid_ip = "";
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  invalid_ip = NULL;
+  g_object_unref (igd);
+}
+
+static void
+test_gupnp_simple_igd_teardown_many (void)
+{
+  GUPnPSimpleIgd *igd = gupnp_simple_igd_new ();
+
+  /* Keep the routers from being flooded with requests */
+  g_object_set (igd, "max-concurrent-actions", 1, NULL);
+
+  teardown_many = TRUE;
+  teardown_mapped = 0;
+  run_gupnp_simple_igd_test (NULL, igd, INTERNAL_PORT);
+  g_assert_cmpuint (teardown_mapped, >=, 2);
+  g_object_unref (igd);
+  teardown_many = FALSE;
+
+  g_assert_cmpint (g_get_monotonic_time () - teardown_start, <,
+      TEARDOWN_BUDGET);
 }
 
 
@@ -497,19 +2503,95 @@ int main (int argc, char **argv)
   g_test_add_func ("/simpleigd/default_ctx/remove_local",
       test_gupnp_simple_igd_default_ctx_local);
   g_test_add_func ("/simpleigd/custom_ctx", test_gupnp_simple_igd_custom_ctx);
+  g_test_add_func ("/simpleigd/single_control_point",
+      test_gupnp_simple_igd_single_control_point);
+  g_test_add_func ("/simpleigd/single_connection",
+      test_gupnp_simple_igd_single_connection);
+  g_test_add_func ("/simpleigd/single_connection/none_connected",
+      test_gupnp_simple_igd_single_connection_none_connected);
+  g_test_add_func ("/simpleigd/single_connection/lost",
+      test_gupnp_simple_igd_single_connection_lost);
+  g_test_add_func ("/simpleigd/routing_policy/first",
+      test_gupnp_simple_igd_routing_policy_first);
+  g_test_add_func ("/simpleigd/routing_policy/first/two_routers",
+      test_gupnp_simple_igd_routing_policy_first_two_routers);
+  g_test_add_func ("/simpleigd/routing_policy/default_route",
+      test_gupnp_simple_igd_routing_policy_default_route);
+  g_test_add_func ("/simpleigd/discovery_cache",
+      test_gupnp_simple_igd_discovery_cache);
+  g_test_add_func ("/simpleigd/discovery_cache/fast",
+      test_gupnp_simple_igd_discovery_cache_fast);
+  g_test_add_func ("/simpleigd/probe_gateway",
+      test_gupnp_simple_igd_probe_gateway);
   g_test_add_func ("/simpleigd/thread", test_gupnp_simple_igd_thread);
+  g_test_add_func ("/simpleigd/thread/add_ports",
+      test_gupnp_simple_igd_thread_add_ports);
+  g_test_add_func ("/simpleigd/thread/add_ports/batch",
+      test_gupnp_simple_igd_thread_add_ports_batch);
+  g_test_add_func ("/simpleigd/add_port_async",
+      test_gupnp_simple_igd_add_port_async);
+  g_test_add_func ("/simpleigd/add_port_async/cancel",
+      test_gupnp_simple_igd_add_port_async_cancel);
+  g_test_add_func ("/simpleigd/add_port_async/thread",
+      test_gupnp_simple_igd_add_port_async_thread);
+  g_test_add_func ("/simpleigd/add_port_async/router_gone",
+      test_gupnp_simple_igd_add_port_async_router_gone);
+  g_test_add_func ("/simpleigd/mapping_handle",
+      test_gupnp_simple_igd_mapping_handle);
+  g_test_add_func ("/simpleigd/external_ip_changed/no_remap",
+      test_gupnp_simple_igd_no_remap);
+  g_test_add_func ("/simpleigd/delayed_external_ip",
+      test_gupnp_simple_igd_delayed_external_ip);
   g_test_add_func ("/simpleigd/random/no_conflict",
       test_gupnp_simple_igd_random_no_conflict);
   g_test_add_func ("/simpleigd/random/conflict",
       test_gupnp_simple_igd_random_conflict);
+  g_test_add_func ("/simpleigd/random/always_conflict",
+      test_gupnp_simple_igd_always_conflict);
+  g_test_add_func ("/simpleigd/random/add_any_port_mapping",
+      test_gupnp_simple_igd_add_any_port_mapping);
+  g_test_add_func ("/simpleigd/scan_port_mappings",
+      test_gupnp_simple_igd_scan_port_mappings);
+  g_test_add_func ("/simpleigd/scan_port_mappings/stalled",
+      test_gupnp_simple_igd_scan_port_mappings_stalled);
+  g_test_add_func ("/simpleigd/instance_tag",
+      test_gupnp_simple_igd_instance_tag);
+  g_test_add_func ("/simpleigd/instance_tag/adopt",
+      test_gupnp_simple_igd_instance_tag_adopt);
   g_test_add_func ("/simpleigd/dispose_removes/regular",
       test_gupnp_simple_igd_dispose_removes);
+  g_test_add_func ("/simpleigd/dispose_removes/range",
+      test_gupnp_simple_igd_dispose_removes_range);
+  g_test_add_func ("/simpleigd/dispose_removes/range/other_host",
+      test_gupnp_simple_igd_dispose_removes_range_other_host);
+  g_test_add_func ("/simpleigd/port_range",
+      test_gupnp_simple_igd_port_range);
+  g_test_add_func ("/simpleigd/port_range/same_port",
+      test_gupnp_simple_igd_port_range_same_port);
+  g_test_add_func ("/simpleigd/port_range/renewal_lost",
+      test_gupnp_simple_igd_port_range_renewal_lost);
+  g_test_add_func ("/simpleigd/shutdown_async",
+      test_gupnp_simple_igd_shutdown_async);
+  g_test_add_func ("/simpleigd/shutdown_async/deadline",
+      test_gupnp_simple_igd_shutdown_async_deadline);
   g_test_add_func ("/simpleigd/dispose_removes/thread",
       test_gupnp_simple_igd_dispose_removes_thread);
   g_test_add_func ("/simpleigd/invalid_ip",
       test_gupnp_simple_igd_invalid_ip);
   g_test_add_func ("/simpleigd/empty_ip",
       test_gupnp_simple_igd_empty_ip);
+  g_test_add_func ("/simpleigd/empty_ip/retry",
+      test_gupnp_simple_igd_empty_ip_retry);
+  g_test_add_func ("/simpleigd/empty_ip/late_add",
+      test_gupnp_simple_igd_empty_ip_late_add);
+  g_test_add_func ("/simpleigd/renewal/retry",
+      test_gupnp_simple_igd_renewal_retry);
+  g_test_add_func ("/simpleigd/max_concurrent_actions",
+      test_gupnp_simple_igd_max_concurrent_actions);
+  g_test_add_func ("/simpleigd/renewal/spread",
+      test_gupnp_simple_igd_renewal_spread);
+  g_test_add_func ("/simpleigd/teardown_many",
+      test_gupnp_simple_igd_teardown_many);
 
   g_test_run ();
 